@@ -0,0 +1,90 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Compares the bone palette skinning path (AVX2 if available) against the scalar path on a synthetic mesh.
+// Usage: bench_skinning [vertex count] [bone count] [iterations]
+
+#include "pr_cycles/skinning.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+template<typename TFunc>
+static double measure(uint32_t iterations, const TFunc &func)
+{
+	auto best = std::numeric_limits<double>::max();
+	for(auto i = decltype(iterations) {0u}; i < iterations; ++i) {
+		auto t0 = std::chrono::steady_clock::now();
+		func();
+		auto t1 = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	return best;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t numVerts = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+	uint32_t numBones = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 64;
+	uint32_t iterations = (argc > 3) ? std::strtoul(argv[3], nullptr, 10) : 10;
+	if(numVerts == 0 || numBones == 0 || iterations == 0) {
+		std::fprintf(stderr, "Usage: %s [vertex count] [bone count] [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::mt19937 rng {1337};
+	std::uniform_real_distribution<float> dis {-1.f, 1.f};
+	std::uniform_int_distribution<int32_t> disBone {0, static_cast<int32_t>(numBones) - 1};
+
+	std::vector<Mat4> palette(numBones);
+	for(auto &m : palette) {
+		m = Mat4 {1.f};
+		for(auto c = 0u; c < 4; ++c) {
+			for(auto r = 0u; r < 3; ++r)
+				m[c][r] += dis(rng) * 0.1f;
+		}
+	}
+
+	std::vector<umath::Vertex> verts(numVerts);
+	std::vector<umath::VertexWeight> weights(numVerts);
+	for(auto i = decltype(numVerts) {0u}; i < numVerts; ++i) {
+		auto &v = verts[i];
+		v.position = {dis(rng) * 100.f, dis(rng) * 100.f, dis(rng) * 100.f};
+		v.normal = {dis(rng), dis(rng), dis(rng)};
+		v.tangent = {dis(rng), dis(rng), dis(rng), 1.f};
+		v.uv = {dis(rng), dis(rng)};
+		auto &vw = weights[i];
+		// Mix of one to four influences, like a typical character mesh
+		auto numInfluences = 1 + (i % 4);
+		auto sum = 0.f;
+		for(auto j = 0u; j < 4; ++j) {
+			vw.boneIds[j] = (j < numInfluences) ? disBone(rng) : -1;
+			vw.weights[j] = (j < numInfluences) ? (dis(rng) + 1.f) : 0.f;
+			sum += vw.weights[j];
+		}
+		for(auto j = 0u; j < 4; ++j)
+			vw.weights[j] /= sum;
+	}
+
+	std::vector<umath::Vertex> outScalar(numVerts);
+	std::vector<umath::Vertex> outDefault(numVerts);
+	auto tScalar = measure(iterations, [&]() { pragma::modules::cycles::skin_vertices_scalar(verts.data(), weights.data(), numVerts, palette.data(), numBones, outScalar.data()); });
+	auto tDefault = measure(iterations, [&]() { pragma::modules::cycles::skin_vertices(verts.data(), weights.data(), numVerts, palette.data(), numBones, outDefault.data()); });
+	auto identical = std::memcmp(outScalar.data(), outDefault.data(), numVerts * sizeof(umath::Vertex)) == 0;
+
+	std::printf("Vertices: %zu, bones: %u, iterations: %u (best of)\n", numVerts, numBones, iterations);
+	std::printf("AVX2: %s\n", pragma::modules::cycles::is_avx2_skinning_available() ? "yes" : "no");
+	std::printf("scalar:        %8.3f ms\n", tScalar);
+	std::printf("skin_vertices: %8.3f ms (%.2fx)\n", tDefault, tScalar / tDefault);
+	std::printf("Results identical: %s\n", identical ? "yes" : "no");
+	return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
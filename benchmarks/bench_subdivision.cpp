@@ -0,0 +1,83 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Runs subdivide_mesh on synthetic height field meshes of growing size.
+// Every triangle has its own three vertices, like meshes with hard edges or uv seams, so the vertex welding is included in the measurement.
+// Usage: bench_subdivision [max grid size] [subdivision level] [thread count]
+
+#include "pr_cycles/subdivision.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+
+static void generate_height_field(uint32_t gridSize, std::vector<umath::Vertex> &outVerts, std::vector<int32_t> &outTris)
+{
+	auto getVertex = [gridSize](uint32_t x, uint32_t y) {
+		umath::Vertex v {};
+		auto fx = static_cast<float>(x) / gridSize;
+		auto fy = static_cast<float>(y) / gridSize;
+		v.position = {fx * 100.f, std::sin(fx * 12.f) * std::cos(fy * 9.f) * 5.f, fy * 100.f};
+		v.normal = {0.f, 1.f, 0.f};
+		v.uv = {fx, fy};
+		return v;
+	};
+	outVerts.clear();
+	outTris.clear();
+	outVerts.reserve(static_cast<size_t>(gridSize) * gridSize * 6);
+	outTris.reserve(outVerts.capacity());
+	for(auto y = decltype(gridSize) {0u}; y < gridSize; ++y) {
+		for(auto x = decltype(gridSize) {0u}; x < gridSize; ++x) {
+			const umath::Vertex quad[6] = {getVertex(x, y), getVertex(x, y + 1), getVertex(x + 1, y), getVertex(x + 1, y), getVertex(x, y + 1), getVertex(x + 1, y + 1)};
+			for(auto &v : quad) {
+				outTris.push_back(static_cast<int32_t>(outVerts.size()));
+				outVerts.push_back(v);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t maxGridSize = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 512;
+	uint32_t subdivLevel = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 2;
+	uint32_t numThreads = (argc > 3) ? std::strtoul(argv[3], nullptr, 10) : 0;
+	if(maxGridSize == 0 || subdivLevel == 0) {
+		std::fprintf(stderr, "Usage: %s [max grid size] [subdivision level] [thread count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::printf("Subdivision level: %u, threads: %u (0 = automatic)\n", subdivLevel, numThreads);
+	std::printf("%12s %12s %12s %12s\n", "triangles", "out tris", "time (ms)", "ns/out tri");
+	std::vector<umath::Vertex> verts;
+	std::vector<int32_t> tris;
+	std::vector<umath::Vertex> outVerts;
+	std::vector<int32_t> outTris;
+	for(uint32_t gridSize = 16; gridSize <= maxGridSize; gridSize *= 2) {
+		generate_height_field(gridSize, verts, tris);
+		auto best = std::numeric_limits<double>::max();
+		// Smaller meshes are measured more often to reduce the noise
+		auto iterations = std::max(1u, 256u / gridSize);
+		for(auto i = decltype(iterations) {0u}; i < iterations; ++i) {
+			outVerts.clear();
+			outTris.clear();
+			auto t0 = std::chrono::steady_clock::now();
+			pragma::modules::cycles::subdivide_mesh(verts, tris, outVerts, outTris, subdivLevel, {}, numThreads);
+			auto t1 = std::chrono::steady_clock::now();
+			best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+		}
+		auto numOutTris = outTris.size() / 3;
+		if(numOutTris == 0) {
+			std::fprintf(stderr, "Subdivision of a %ux%u grid produced no triangles\n", gridSize, gridSize);
+			return EXIT_FAILURE;
+		}
+		std::printf("%12zu %12zu %12.3f %12.1f\n", tris.size() / 3, numOutTris, best, best * 1'000'000.0 / numOutTris);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Checks the hit, miss and eviction behavior and the statistics of StagingImagePool without a GPU.
+// Usage: check_staging_image_pool (no arguments)
+// Returns EXIT_FAILURE if any of the checks fails.
+
+#include "pr_cycles/staging_image_pool.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using pragma::modules::cycles::StagingImagePool;
+
+namespace {
+	struct CreatedImage {
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+	// The pool never dereferences its images, so the factory hands out pointers that only share ownership of the size they were created with
+	struct FakeImageFactory {
+		std::vector<CreatedImage> createdImages;
+		bool fail = false;
+		StagingImagePool::ImageFactory Get()
+		{
+			return [this](uint32_t width, uint32_t height) -> std::shared_ptr<prosper::IImage> {
+				if(fail)
+					return nullptr;
+				createdImages.push_back({width, height});
+				auto owner = std::make_shared<CreatedImage>(createdImages.back());
+				return std::shared_ptr<prosper::IImage> {owner, reinterpret_cast<prosper::IImage *>(owner.get())};
+			};
+		}
+	};
+};
+
+static bool g_success = true;
+static void check(const char *name, bool passed)
+{
+	std::printf("%-52s %s\n", name, passed ? "OK" : "FAILED");
+	g_success = g_success && passed;
+}
+
+static bool check_stats(const StagingImagePool::Stats &stats, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t failedRequests, uint32_t imageCount, uint32_t imagesInUse, uint32_t peakImageCount)
+{
+	return stats.hits == hits && stats.misses == misses && stats.evictions == evictions && stats.failedRequests == failedRequests && stats.imageCount == imageCount && stats.imagesInUse == imagesInUse && stats.peakImageCount == peakImageCount;
+}
+
+int main()
+{
+	check("size class rounds up to the next power of two", StagingImagePool::GetSizeClass(0) == StagingImagePool::MIN_SIZE_CLASS && StagingImagePool::GetSizeClass(17) == 32 && StagingImagePool::GetSizeClass(256) == 256);
+	check("size class of sizes above 2^31 terminates", StagingImagePool::GetSizeClass((1u << 31) + 1) >= (1u << 31) + 1 && StagingImagePool::GetSizeClass(UINT32_MAX) == UINT32_MAX);
+
+	{
+		FakeImageFactory factory {};
+		StagingImagePool pool {factory.Get(), 2};
+		auto a = pool.Acquire(100, 60);
+		check("miss creates an image of the size class", a != nullptr && factory.createdImages.size() == 1 && factory.createdImages[0].width == 128 && factory.createdImages[0].height == 64);
+		pool.Release(a);
+		auto b = pool.Acquire(120, 50);
+		check("hit reuses a released image of the same size class", b == a && factory.createdImages.size() == 1);
+		check("stats after a miss and a hit", check_stats(pool.GetStats(), 1, 1, 0, 0, 1, 1, 1));
+
+		auto c = pool.Acquire(100, 60);
+		check("images in use aren't handed out twice", c != nullptr && c != b && factory.createdImages.size() == 2);
+		auto d = pool.Acquire(16, 16);
+		check("returns nullptr if all images are in use", d == nullptr && check_stats(pool.GetStats(), 1, 2, 0, 1, 2, 2, 2));
+
+		// b was released before c, so it is the least recently used image
+		pool.Release(b);
+		pool.Release(c);
+		d = pool.Acquire(16, 16);
+		auto e = pool.Acquire(128, 64);
+		check("evicts the least recently released image", d != nullptr && d != b && d != c && e == c);
+		check("stats after the eviction", check_stats(pool.GetStats(), 2, 3, 1, 1, 2, 2, 2));
+
+		pool.Release(d);
+		pool.Clear();
+		check("clear keeps the images that are in use", pool.GetStats().imageCount == 1 && pool.Acquire(16, 16) != d);
+	}
+
+	{
+		FakeImageFactory factory {};
+		factory.fail = true;
+		StagingImagePool pool {factory.Get(), 2};
+		check("factory failures count as failed requests", pool.Acquire(32, 32) == nullptr && check_stats(pool.GetStats(), 0, 0, 0, 1, 0, 0, 0));
+	}
+
+	return g_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+// Checks apply_temporal_denoise against a synthetic history image, which is shifted by known motion vectors (or a known camera translation)
+// and overlaid with noise to get the current frame. Wherever the reprojected history is available, the result has to match the analytic
+// blend of both frames.
+// Usage: check_temporal_denoise (no arguments)
+// Returns EXIT_FAILURE if any of the checks fails.
+
+#include "pr_cycles/denoise.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+constexpr uint32_t g_width = 64;
+constexpr uint32_t g_height = 48;
+
+static std::shared_ptr<uimg::ImageBuffer> create_image(const std::function<Vector3(float, float)> &f)
+{
+	auto img = uimg::ImageBuffer::Create(g_width, g_height, uimg::Format::RGB_FLOAT);
+	auto *data = static_cast<float *>(img->GetData());
+	for(auto y = decltype(g_height) {0u}; y < g_height; ++y) {
+		for(auto x = decltype(g_width) {0u}; x < g_width; ++x) {
+			auto c = f(static_cast<float>(x), static_cast<float>(y));
+			auto *p = data + (static_cast<size_t>(y) * g_width + x) * 3;
+			p[0] = c.x;
+			p[1] = c.y;
+			p[2] = c.z;
+		}
+	}
+	return img;
+}
+
+// Deterministic per-pixel noise in [-amplitude,amplitude]
+static Vector3 get_noise(float x, float y, float amplitude)
+{
+	auto hash = static_cast<uint32_t>(x) * 73856093u ^ static_cast<uint32_t>(y) * 19349663u;
+	auto get = [&hash]() {
+		hash = hash * 1664525u + 1013904223u;
+		return (static_cast<float>(hash >> 8) / static_cast<float>(1u << 24)) * 2.f - 1.f;
+	};
+	return Vector3 {get(), get(), get()} * amplitude;
+}
+
+struct CheckResult {
+	float maxError = 0.f; // Maximum deviation from the expected blend
+	float rmsNoise = 0.f; // Remaining deviation from the noise-free frame
+	size_t numChecked = 0;
+};
+
+// Bilinear sampling is exact for linear functions, which is why the fractional motion case uses a linear pattern
+static CheckResult run_check(const std::function<Vector3(float, float)> &pattern, const Vector2 &motion, const Vector2 &assumedMotion, float noiseAmplitude, float historyWeight)
+{
+	// The surface point at (x,y) in the current frame was at (x,y) + motion in the history
+	auto history = create_image(pattern);
+	auto current = create_image([&](float x, float y) { return pattern(x + motion.x, y + motion.y) + get_noise(x, y, noiseAmplitude); });
+	auto original = current->Copy();
+
+	pragma::modules::cycles::TemporalFrameInfo currentInfo {};
+	currentInfo.motionVectors = create_image([&](float, float) { return Vector3 {assumedMotion, 0.f}; });
+	pragma::modules::cycles::TemporalDenoiseSettings settings {};
+	settings.historyWeight = historyWeight;
+	settings.clampHistory = false; // Clamping would reject part of the history wherever the noise is large
+	if(!pragma::modules::cycles::apply_temporal_denoise(*current, *history, currentInfo, {}, settings)) {
+		std::fprintf(stderr, "apply_temporal_denoise failed!\n");
+		std::exit(EXIT_FAILURE);
+	}
+
+	CheckResult result {};
+	double sumSqr = 0.0;
+	auto *resultData = static_cast<const float *>(current->GetData());
+	auto *originalData = static_cast<const float *>(original->GetData());
+	for(auto y = decltype(g_height) {0u}; y < g_height; ++y) {
+		for(auto x = decltype(g_width) {0u}; x < g_width; ++x) {
+			auto idx = (static_cast<size_t>(y) * g_width + x) * 3;
+			Vector3 color {resultData[idx], resultData[idx + 1], resultData[idx + 2]};
+			Vector3 currentColor {originalData[idx], originalData[idx + 1], originalData[idx + 2]};
+			auto hx = x + assumedMotion.x;
+			auto hy = y + assumedMotion.y;
+			Vector3 expected;
+			if(hx >= 0.f && hy >= 0.f && hx <= g_width - 1 && hy <= g_height - 1)
+				expected = glm::mix(currentColor, pattern(hx, hy), historyWeight);
+			else if(hx < -0.5f || hy < -0.5f || hx > g_width - 0.5f || hy > g_height - 0.5f)
+				expected = currentColor; // No history
+			else
+				continue; // The history is clamped to the border here
+			auto diff = glm::abs(color - expected);
+			result.maxError = std::max({result.maxError, diff.x, diff.y, diff.z});
+			auto noise = color - pattern(x + motion.x, y + motion.y);
+			sumSqr += glm::dot(noise, noise) / 3.0;
+			++result.numChecked;
+		}
+	}
+	result.rmsNoise = static_cast<float>(std::sqrt(sumSqr / std::max<size_t>(result.numChecked, 1)));
+	return result;
+}
+
+// Camera conventions of the depth path (see TemporalFrameInfo): The camera looks along -z in view space, NDC y points down
+// (row 0 of the image is at y = -1) and the depth is the distance along the view ray.
+constexpr float g_planeDistance = 10.f; // The scene is a plane at z = -g_planeDistance, parallel to the image plane
+constexpr float g_tanHalfFov = 0.57735f;  // 60 degrees vertical field of view
+
+static Mat4 get_projection()
+{
+	constexpr float nearZ = 0.1f;
+	constexpr float farZ = 100.f;
+	auto aspectRatio = static_cast<float>(g_width) / static_cast<float>(g_height);
+	Mat4 projection {0.f};
+	projection[0][0] = 1.f / (aspectRatio * g_tanHalfFov);
+	projection[1][1] = -1.f / g_tanHalfFov; // Flipped, so that +y in view space points up in the image
+	projection[2][2] = farZ / (nearZ - farZ);
+	projection[2][3] = -1.f;
+	projection[3][2] = (farZ * nearZ) / (nearZ - farZ);
+	return projection;
+}
+
+static Mat4 get_view(const Vector3 &camPos)
+{
+	Mat4 view {1.f};
+	view[3] = Vector4 {camPos * -1.f, 1.f};
+	return view;
+}
+
+// Unnormalized direction of the view ray through the center of the pixel, scaled so that its z component is -1
+static Vector3 get_ray_direction(float x, float y)
+{
+	auto aspectRatio = static_cast<float>(g_width) / static_cast<float>(g_height);
+	auto ndcX = (x + 0.5f) / g_width * 2.f - 1.f;
+	auto ndcY = (y + 0.5f) / g_height * 2.f - 1.f;
+	return {ndcX * aspectRatio * g_tanHalfFov, -ndcY * g_tanHalfFov, -1.f};
+}
+
+// Translates the camera between the frames and reconstructs the motion from the depth and the view and projection matrices.
+// If planarDepth is set, the depth is passed as view space z instead of the distance along the ray (i.e. the wrong convention).
+static CheckResult run_depth_check(const Vector3 &camTranslation, bool planarDepth, float noiseAmplitude, float historyWeight)
+{
+	// The pattern is linear in world space, which makes it linear in the pixel coordinates of the history as well
+	auto pattern = [](const Vector3 &pos) -> Vector3 { return {pos.x * 0.1f + 0.5f, pos.y * 0.15f + 0.5f, 1.f - (pos.x + pos.y) * 0.02f}; };
+	auto getSurfacePos = [](const Vector3 &camPos, float x, float y) { return camPos + get_ray_direction(x, y) * g_planeDistance; };
+	Vector3 historyCamPos {};
+	auto currentCamPos = historyCamPos + camTranslation;
+
+	auto history = create_image([&](float x, float y) { return pattern(getSurfacePos(historyCamPos, x, y)); });
+	auto current = create_image([&](float x, float y) { return pattern(getSurfacePos(currentCamPos, x, y)) + get_noise(x, y, noiseAmplitude); });
+	auto original = current->Copy();
+
+	pragma::modules::cycles::TemporalFrameInfo currentInfo {};
+	currentInfo.depth = create_image([&](float x, float y) {
+		auto depth = planarDepth ? g_planeDistance : glm::length(get_ray_direction(x, y)) * g_planeDistance;
+		return Vector3 {depth, depth, depth};
+	});
+	currentInfo.view = get_view(currentCamPos);
+	currentInfo.projection = get_projection();
+	pragma::modules::cycles::TemporalFrameInfo historyInfo {};
+	historyInfo.view = get_view(historyCamPos);
+	historyInfo.projection = get_projection();
+	pragma::modules::cycles::TemporalDenoiseSettings settings {};
+	settings.historyWeight = historyWeight;
+	settings.clampHistory = false;
+	if(!pragma::modules::cycles::apply_temporal_denoise(*current, *history, currentInfo, historyInfo, settings)) {
+		std::fprintf(stderr, "apply_temporal_denoise failed!\n");
+		std::exit(EXIT_FAILURE);
+	}
+
+	CheckResult result {};
+	auto *resultData = static_cast<const float *>(current->GetData());
+	auto *originalData = static_cast<const float *>(original->GetData());
+	auto aspectRatio = static_cast<float>(g_width) / static_cast<float>(g_height);
+	for(auto y = decltype(g_height) {0u}; y < g_height; ++y) {
+		for(auto x = decltype(g_width) {0u}; x < g_width; ++x) {
+			auto idx = (static_cast<size_t>(y) * g_width + x) * 3;
+			Vector3 color {resultData[idx], resultData[idx + 1], resultData[idx + 2]};
+			Vector3 currentColor {originalData[idx], originalData[idx + 1], originalData[idx + 2]};
+			// Where the history camera sees the surface point of this pixel
+			auto pos = getSurfacePos(currentCamPos, static_cast<float>(x), static_cast<float>(y)) - historyCamPos;
+			auto hx = (pos.x / (g_planeDistance * aspectRatio * g_tanHalfFov) + 1.f) * 0.5f * g_width - 0.5f;
+			auto hy = (-pos.y / (g_planeDistance * g_tanHalfFov) + 1.f) * 0.5f * g_height - 0.5f;
+			Vector3 expected;
+			if(hx >= 0.f && hy >= 0.f && hx <= g_width - 1 && hy <= g_height - 1)
+				expected = glm::mix(currentColor, pattern(pos + historyCamPos), historyWeight);
+			else if(hx < -0.5f || hy < -0.5f || hx > g_width - 0.5f || hy > g_height - 0.5f)
+				expected = currentColor;
+			else
+				continue;
+			auto diff = glm::abs(color - expected);
+			result.maxError = std::max({result.maxError, diff.x, diff.y, diff.z});
+			++result.numChecked;
+		}
+	}
+	return result;
+}
+
+int main()
+{
+	constexpr float tolerance = 1e-4f;
+	constexpr float noiseAmplitude = 0.1f;
+	constexpr float historyWeight = 0.8f;
+	auto smooth = [](float x, float y) -> Vector3 { return {std::sin(x * 0.3f) + 1.f, std::cos(y * 0.25f) + 1.f, (x + y) * 0.01f}; };
+	auto linear = [](float x, float y) -> Vector3 { return {x * 0.02f, y * 0.03f, 1.f - (x + y) * 0.005f}; };
+
+	auto success = true;
+	auto report = [&success](const char *name, const CheckResult &result, bool passed) {
+		std::printf("%-28s checked: %6zu, max error: %.6f, rms noise: %.6f  %s\n", name, result.numChecked, result.maxError, result.rmsNoise, passed ? "OK" : "FAILED");
+		success = success && passed;
+	};
+
+	// The noise of the current frame is scaled by (1 - historyWeight) wherever the history is available
+	auto integer = run_check(smooth, {3.f, 2.f}, {3.f, 2.f}, noiseAmplitude, historyWeight);
+	report("integer motion", integer, integer.numChecked > 0 && integer.maxError < tolerance);
+
+	auto fractional = run_check(linear, {2.5f, -1.25f}, {2.5f, -1.25f}, noiseAmplitude, historyWeight);
+	report("fractional motion", fractional, fractional.numChecked > 0 && fractional.maxError < tolerance);
+
+	// Without a history the frame has to be left untouched
+	auto outOfBounds = run_check(smooth, {static_cast<float>(g_width), 0.f}, {static_cast<float>(g_width), 0.f}, noiseAmplitude, historyWeight);
+	report("history out of bounds", outOfBounds, outOfBounds.numChecked == static_cast<size_t>(g_width) * g_height && outOfBounds.maxError < tolerance);
+
+	// Reprojecting with the wrong motion has to leave noticeably more error than the correct motion
+	auto noMotion = run_check(smooth, {3.f, 2.f}, {0.f, 0.f}, noiseAmplitude, historyWeight);
+	report("ignored motion", noMotion, noMotion.rmsNoise > integer.rmsNoise * 2.f);
+
+	// Moving the camera to the right and up moves the surface to the left and down in the image
+	auto depth = run_depth_check({1.f, 0.5f, 0.f}, false, noiseAmplitude, historyWeight);
+	report("depth and camera", depth, depth.numChecked > 0 && depth.maxError < 1e-3f);
+
+	// The depth has to be the distance along the ray, view space z reprojects to the wrong pixels away from the image center
+	auto planarDepth = run_depth_check({1.f, 0.5f, 0.f}, true, noiseAmplitude, historyWeight);
+	report("depth as view space z", planarDepth, planarDepth.maxError > 1e-2f);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,100 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_DENOISE_HPP__
+#define __PR_CYCLES_DENOISE_HPP__
+
+#include <sharedutils/util_parallel_job.hpp>
+#include <util_image_buffer.hpp>
+#include <mathutil/uvec.h>
+#include <cinttypes>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pragma::modules::cycles {
+	struct TiledDenoiseSettings {
+		uint32_t tileSize = 512;
+		// Number of pixels each tile is extended by on every side that isn't on the image border.
+		// The overlapping regions are cross-faded to hide seams between tiles.
+		uint32_t overlap = 32;
+		// Number of tiles that are denoised at once, each with its own denoiser. The denoiser is multi-threaded by itself,
+		// so a small number is usually best (0 = up to 2).
+		uint32_t numThreads = 0;
+	};
+
+	struct DenoiseTile {
+		// Region that is passed to the denoiser, including the overlap
+		uint32_t x = 0;
+		uint32_t y = 0;
+		uint32_t w = 0;
+		uint32_t h = 0;
+		// Overlap with the neighbouring tiles on the left, right, top and bottom
+		uint32_t overlapLeft = 0;
+		uint32_t overlapRight = 0;
+		uint32_t overlapTop = 0;
+		uint32_t overlapBottom = 0;
+	};
+	std::vector<DenoiseTile> get_denoise_tiles(uint32_t width, uint32_t height, const TiledDenoiseSettings &settings);
+	// Blend weight of the pixel at (x,y) (relative to the tile). Weights ramp up linearly across the overlapping regions,
+	// so the weights of all tiles covering a pixel sum up to 1.
+	float get_denoise_tile_weight(const DenoiseTile &tile, uint32_t x, uint32_t y);
+
+	// Denoises the image in overlapping tiles on multiple threads. The albedo and normal images are optional and have to have the same size as the image.
+	// The result is written back to imgBuffer.
+	util::ParallelJob<std::shared_ptr<uimg::ImageBuffer>> denoise_tiled(uimg::ImageBuffer &imgBuffer, const TiledDenoiseSettings &settings, uimg::ImageBuffer *optAlbedo = nullptr, uimg::ImageBuffer *optNormal = nullptr);
+
+	struct TemporalDenoiseSettings {
+		// Weight of the reprojected history in the exponential moving average, higher values reduce flickering but increase ghosting
+		float historyWeight = 0.8f;
+		// Clamps the history to the color range of the 3x3 neighbourhood in the current frame, which rejects most disoccluded history
+		bool clampHistory = true;
+	};
+	// Describes how the pixels of a frame map to the previous frame. Motion vectors take precedence over camera data.
+	// If neither is available, the camera is assumed to be static.
+	struct TemporalFrameInfo {
+		// Offset in pixels from a pixel in this frame to the same surface point in the previous frame (red and green channels),
+		// i.e. previous position = current position + motion. Vectors pointing from the previous to the current frame have to be negated.
+		std::shared_ptr<uimg::ImageBuffer> motionVectors = nullptr;
+		// Distance along the view ray from the camera to the surface (red channel), in the same units as the view matrix. This is what the
+		// depth pass of the pbr shader outputs, view space z (e.g. the depth pass of Cycles) has to be converted first.
+		std::shared_ptr<uimg::ImageBuffer> depth = nullptr;
+		// NDC y is expected to point down, i.e. the top row of the image is at y = -1 (Vulkan convention). Projection matrices with
+		// y pointing up have to be flipped.
+		std::optional<Mat4> view {};
+		std::optional<Mat4> projection {};
+	};
+	// Blends the history (the previous denoised frame) into the denoised current frame. Both images are expected to be RGB_FLOAT and the same size.
+	// Runs on the CPU, so it can be applied to saved frame sequences offline.
+	bool apply_temporal_denoise(uimg::ImageBuffer &current, const uimg::ImageBuffer &history, const TemporalFrameInfo &currentInfo, const TemporalFrameInfo &historyInfo, const TemporalDenoiseSettings &settings, uint32_t numThreads = 0);
+
+	struct SequenceDenoiseFrame {
+		// Either an image, which is denoised in place, or an image file, which is loaded, denoised and written to outputPath
+		std::shared_ptr<uimg::ImageBuffer> image = nullptr;
+		std::string inputPath;
+		std::string outputPath;
+		// Only used in temporal mode. Motion vectors and depth may also be loaded from files.
+		TemporalFrameInfo temporalInfo {};
+		std::string motionVectorsPath;
+		std::string depthPath;
+		// Position of the frame in the sequence, defaults to its position in the frame list. Only frames with consecutive indices
+		// are treated as adjacent in temporal mode, and in-memory frames are returned as "frame<index>".
+		std::optional<size_t> index {};
+	};
+	struct SequenceDenoiseSettings {
+		// Maximum number of frames waiting between two pipeline stages, which bounds the memory usage independently of the sequence length
+		uint32_t maxFramesInFlight = 4;
+		// If set, each denoised frame is blended with the reprojected result of the previous frame
+		std::optional<TemporalDenoiseSettings> temporal {};
+	};
+	// Denoises the frames in order with a single denoiser instance. Loading, denoising and writing run on separate threads, so
+	// frame I/O overlaps with the denoising of other frames. The result contains the in-memory frames as "frame<index>" (see SequenceDenoiseFrame::index).
+	util::ParallelJob<uimg::ImageLayerSet> denoise_sequence(std::vector<SequenceDenoiseFrame> frames, const SequenceDenoiseSettings &settings = {});
+};
+
+#endif
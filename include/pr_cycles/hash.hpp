@@ -0,0 +1,52 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_HASH_HPP__
+#define __PR_CYCLES_HASH_HPP__
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+namespace pragma::modules::cycles {
+	struct Hash128 {
+		uint64_t h1 = 0;
+		uint64_t h2 = 0;
+		std::string ToString() const;
+		bool operator==(const Hash128 &other) const { return h1 == other.h1 && h2 == other.h2; }
+		bool operator!=(const Hash128 &other) const { return !operator==(other); }
+	};
+	// MurmurHash3 (x64, 128 bit variant)
+	Hash128 murmur_hash3(const void *data, size_t size, const Hash128 &seed = {});
+
+	// Accumulates the hash of multiple data blocks, used for content-addressed cache keys
+	class Hasher {
+	  public:
+		Hasher &Add(const void *data, size_t size);
+		template<typename T>
+		Hasher &Add(const T &value)
+		{
+			return Add(&value, sizeof(value));
+		}
+		template<typename T>
+		Hasher &Add(const std::vector<T> &values)
+		{
+			Add<uint64_t>(values.size());
+			return Add(values.data(), values.size() * sizeof(T));
+		}
+		Hasher &Add(const std::string &str)
+		{
+			Add<uint64_t>(str.size());
+			return Add(str.data(), str.size());
+		}
+		const Hash128 &GetHash() const { return m_hash; }
+	  private:
+		Hash128 m_hash {};
+	};
+};
+
+#endif
@@ -0,0 +1,122 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_PARALLEL_HPP__
+#define __PR_CYCLES_PARALLEL_HPP__
+
+#include <cinttypes>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace pragma::modules::cycles {
+	inline uint32_t get_default_thread_count() { return std::max(std::thread::hardware_concurrency(), 1u); }
+
+	// Calls func(i) for every i in [0,count) on up to numThreads threads (including the calling thread).
+	// Indices are handed out one at a time, so uneven workloads are balanced between the threads.
+	// If numThreads is 0, the number of hardware threads is used.
+	template<typename TFunc>
+	void parallel_for(size_t count, const TFunc &func, uint32_t numThreads = 0)
+	{
+		if(numThreads == 0)
+			numThreads = get_default_thread_count();
+		numThreads = static_cast<uint32_t>(std::min<size_t>(numThreads, count));
+		if(numThreads <= 1) {
+			for(auto i = decltype(count) {0u}; i < count; ++i)
+				func(i);
+			return;
+		}
+		std::atomic<size_t> next {0};
+		auto worker = [&next, &func, count]() {
+			for(;;) {
+				auto i = next++;
+				if(i >= count)
+					break;
+				func(i);
+			}
+		};
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads - 1);
+		for(auto i = decltype(numThreads) {1u}; i < numThreads; ++i)
+			threads.emplace_back(worker);
+		worker();
+		for(auto &t : threads)
+			t.join();
+	}
+
+	// Blocking FIFO queue with a fixed capacity, used to connect the stages of a pipeline while keeping the number of items in flight bounded.
+	// Push blocks while the queue is full, Pop blocks while it is empty. After Close, Push fails and Pop drains the remaining items.
+	template<typename T>
+	class BoundedQueue {
+	  public:
+		BoundedQueue(size_t capacity) : m_capacity {std::max<size_t>(capacity, 1)} {}
+		bool Push(T item)
+		{
+			std::unique_lock lock {m_mutex};
+			m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+			if(m_closed)
+				return false;
+			m_items.push(std::move(item));
+			lock.unlock();
+			m_notEmpty.notify_one();
+			return true;
+		}
+		bool Pop(T &outItem)
+		{
+			std::unique_lock lock {m_mutex};
+			m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+			if(m_items.empty())
+				return false;
+			outItem = std::move(m_items.front());
+			m_items.pop();
+			lock.unlock();
+			m_notFull.notify_one();
+			return true;
+		}
+		void Close()
+		{
+			{
+				std::scoped_lock lock {m_mutex};
+				m_closed = true;
+			}
+			m_notEmpty.notify_all();
+			m_notFull.notify_all();
+		}
+	  private:
+		std::queue<T> m_items;
+		size_t m_capacity;
+		bool m_closed = false;
+		std::mutex m_mutex;
+		std::condition_variable m_notEmpty;
+		std::condition_variable m_notFull;
+	};
+
+	// Persistent set of worker threads for fire-and-forget background tasks.
+	// Pending tasks are still executed when the pool is destroyed.
+	class WorkerPool {
+	  public:
+		WorkerPool(uint32_t numThreads = 0);
+		~WorkerPool();
+		WorkerPool(const WorkerPool &) = delete;
+		WorkerPool &operator=(const WorkerPool &) = delete;
+		void Push(std::function<void()> task);
+	  private:
+		void Run();
+		std::vector<std::thread> m_threads;
+		std::queue<std::function<void()>> m_tasks;
+		std::mutex m_taskMutex;
+		std::condition_variable m_taskCondition;
+		bool m_running = true;
+	};
+};
+
+#endif
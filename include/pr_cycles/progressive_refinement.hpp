@@ -10,7 +10,15 @@
 
 #include <cinttypes>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <unordered_map>
 #include <sharedutils/functioncallback.h>
+#include "pr_cycles/staging_image_pool.hpp"
 #include <util_raytracing/scene.hpp>
 #include <util_raytracing/denoise.hpp>
 #include <util_raytracing/tilemanager.hpp>
@@ -26,6 +34,9 @@ namespace prosper {
 	class IFence;
 };
 namespace pragma::modules::cycles {
+	// Collects rendered tiles and denoises them on a worker thread. The thread only wakes up if there are new tiles or a denoise has been requested.
+	// If Denoise is called again while a denoise is running, the requests are coalesced into a single follow-up denoise and the state only
+	// changes to Complete once the most recent request has been served.
 	class DenoiseTexture {
 	  public:
 		enum class DenoisingState : uint8_t { Initial = 0, Denoising, Complete };
@@ -38,13 +49,16 @@ namespace pragma::modules::cycles {
 		void AppendTile(unirender::TileManager::TileData &&tileData);
 		std::shared_ptr<uimg::ImageBuffer> GetDenoisedImageData() const;
 	  private:
-		void UpdatePendingTiles();
+		void Run();
+		void CopyTileToInputImage(const unirender::TileManager::TileData &tileData);
 		void RunDenoise();
 
 		std::mutex m_tileMutex;
+		std::condition_variable m_tileCondition;
 		unirender::denoise::Denoiser m_denoiser;
-		std::atomic<bool> m_running = false;
-		std::atomic<bool> m_shouldDenoise = false;
+		bool m_running = false;
+		uint64_t m_requestedDenoiseId = 0; // Guarded by m_tileMutex
+		uint64_t m_completedDenoiseId = 0;
 		std::atomic<DenoisingState> m_denoisingState = DenoisingState::Initial;
 		std::shared_ptr<uimg::ImageBuffer> m_inputImage = nullptr;
 		std::shared_ptr<uimg::ImageBuffer> m_denoisedImage = nullptr;
@@ -53,20 +67,33 @@ namespace pragma::modules::cycles {
 		std::thread m_thread;
 	};
 
+	// Uploads rendered tiles to a device image from the engine's "Think" callback without ever waiting on the GPU.
+	// Uploads are recorded into a ring of command buffers, each with its own fence and staging images. If all of them are still in flight,
+	// the tiles are kept and merged with the tiles of later batches (newer data for the same tile replaces the old one).
 	class ProgressiveTexture {
 	  public:
+		static constexpr uint32_t UPLOAD_RING_SIZE = 3;
+		static constexpr uint32_t MAX_STAGING_IMAGES = 128;
 		~ProgressiveTexture();
 		void Initialize(unirender::Renderer &renderer);
 		void Update();
 		std::shared_ptr<prosper::Texture> GetTexture() const;
+		const StagingImagePool::Stats *GetStagingImagePoolStats() const;
 	  private:
+		struct UploadSlot {
+			std::shared_ptr<prosper::IPrimaryCommandBuffer> cmdBuffer = nullptr;
+			std::shared_ptr<prosper::IFence> fence = nullptr;
+			std::vector<std::shared_ptr<prosper::IImage>> stagingImages; // Acquired from the pool, released once the fence has been signalled
+		};
 		std::shared_ptr<prosper::IImage> CreateImage(uint32_t width, uint32_t height, bool onDevice) const;
+		UploadSlot *FindAvailableUploadSlot();
 		Vector2i m_tileSize;
-		std::shared_ptr<prosper::IPrimaryCommandBuffer> m_cmdBuffer = nullptr;
-		std::shared_ptr<prosper::IFence> m_fence = nullptr;
+		std::array<UploadSlot, UPLOAD_RING_SIZE> m_uploadSlots {};
+		uint32_t m_nextUploadSlot = 0;
+		std::unique_ptr<StagingImagePool> m_stagingImagePool = nullptr;
+		std::unordered_map<uint64_t, unirender::TileManager::TileData> m_pendingTiles;
 		std::shared_ptr<prosper::Texture> m_texture = nullptr;
 		std::shared_ptr<prosper::IImage> m_image = nullptr;
-		std::vector<std::shared_ptr<prosper::IImage>> m_mipImages;
 		std::shared_ptr<unirender::Renderer> m_renderer = nullptr;
 		CallbackHandle m_cbThink {};
 	};
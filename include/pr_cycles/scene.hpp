@@ -8,6 +8,7 @@
 #ifndef __PR_CYCLES_SCENE_HPP__
 #define __PR_CYCLES_SCENE_HPP__
 
+#include "pr_cycles/hash.hpp"
 #include <util_raytracing/scene.hpp>
 #include <util_raytracing/renderer.hpp>
 #include <sharedutils/util_weak_handle.hpp>
@@ -22,6 +23,8 @@
 #include <thread>
 #include <pragma/entities/baseentity_handle.h>
 #include <mathutil/vertex.hpp>
+#include <sharedutils/util_uuid.hpp>
+#include <unordered_map>
 
 #define ENABLE_TEST_AMBIENT_OCCLUSION
 
@@ -61,6 +64,13 @@ namespace util {
 namespace pragma::modules::cycles {
 	class Shader;
 	util::ParallelJob<std::shared_ptr<uimg::ImageBuffer>> denoise(uimg::ImageBuffer &imgBuffer);
+
+	// Subdivided meshes are cached on disk in "cache/unirender/subdivision/" (relative to the program directory). Once the cache grows beyond
+	// the size limit (2 GiB by default, 0 = unlimited), the least recently used files are removed.
+	void set_subdivision_cache_size_limit(uint64_t limit);
+	uint64_t get_subdivision_cache_size_limit();
+	void clear_subdivision_cache();
+
 	class Cache {
 	  public:
 		struct MeshData {
@@ -72,11 +82,38 @@ namespace pragma::modules::cycles {
 			std::optional<std::vector<float>> wrinkles {};
 
 			unirender::PShader shader = nullptr;
+			std::weak_ptr<ModelSubMesh> subMesh {}; // Only set for meshes of entities
+		};
+		struct ModelCacheStats {
+			uint32_t hits = 0;
+			uint32_t misses = 0;
+			uint64_t bytesSaved = 0;
+		};
+		struct AdaptiveSubdivisionSettings {
+			float targetEdgeLength = 8.f; // Target length of a subdivided edge on screen, in pixels
+			uint32_t maxLevel = 3;
+		};
+		struct ViewInfo {
+			Vector3 position {};
+			float fov = 0.f; // Horizontal field of view in degrees
+			uint32_t resolutionWidth = 0;
+		};
+		struct EntityInfo {
+			BaseEntity *entity = nullptr;
+			std::function<bool(ModelMesh &, const umath::ScaledTransform &)> meshFilter = nullptr;
 		};
 		Cache(unirender::Scene::RenderMode renderMode);
 		void AddParticleSystem(pragma::CParticleSystemComponent &ptc, const Vector3 &camPos, const Mat4 &vp, float nearZ, float farZ);
 		unirender::PObject AddEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes = nullptr, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter = nullptr,
 		  const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter = nullptr, const std::string &nameSuffix = "");
+		// Adds the entities in the specified order, same as calling AddEntity for each of them. Shaders are still created on the calling thread,
+		// but the mesh data is computed on up to numThreads threads (0 = number of hardware threads). The result does not depend on the number of threads.
+		std::vector<unirender::PObject> AddEntities(const std::vector<EntityInfo> &entities, uint32_t numThreads = 0);
+		// Recomputes the deformed vertices of an animated entity and writes them into its existing mesh (and the renderer's copy of it),
+		// which is then tagged for an update. Nothing is recomputed if the bone pose hasn't changed since the last update. No shaders are created.
+		// Fails if the mesh wasn't built for a deformable entity by this cache or if the topology no longer matches, in which case the mesh
+		// has to be rebuilt.
+		bool UpdateEntityMesh(BaseEntity &ent, unirender::Mesh &mesh, unirender::Scene &scene, unirender::Renderer &renderer);
 		std::vector<std::shared_ptr<MeshData>> AddEntityMesh(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes = nullptr, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter = nullptr,
 		  const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter = nullptr, const std::string &nameSuffix = "", const std::optional<umath::ScaledTransform> &pose = {});
 		std::vector<std::shared_ptr<MeshData>> AddModel(Model &mdl, const std::string &meshName, BaseEntity *optEnt = nullptr, const std::optional<umath::ScaledTransform> &pose = {}, uint32_t skinId = 0, CModelComponent *optMdlC = nullptr, CAnimatedComponent *optAnimC = nullptr,
@@ -87,14 +124,79 @@ namespace pragma::modules::cycles {
 		unirender::PMesh BuildMesh(const std::string &meshName, const std::vector<std::shared_ptr<MeshData>> &meshDatas, const std::optional<umath::ScaledTransform> &pose = {}) const;
 		void AddAOBakeTarget(BaseEntity &ent, uint32_t matIndex, std::shared_ptr<unirender::Object> &oAo, std::shared_ptr<unirender::Object> &oEnv);
 		void AddAOBakeTarget(Model &mdl, uint32_t matIndex, std::shared_ptr<unirender::Object> &oAo, std::shared_ptr<unirender::Object> &oEnv);
+		// Adds the object to the model cache. Objects have to be added through here (rather than to the chunks directly), so that they
+		// can be found by name and uuid. The name and uuid must not change after the object has been added.
+		void AddObject(unirender::Object &o);
+		unirender::Object *FindObject(const std::string &name) const;
+		unirender::Object *FindObjectByUuid(const util::Uuid &uuid) const;
 		unirender::ModelCache &GetModelCache() const { return *m_mdlCache; }
 		unirender::ShaderCache &GetShaderCache() const { return *m_shaderCache; }
 		std::unordered_map<unirender::Shader *, std::shared_ptr<Shader>> &GetRTShaderToShaderTable() const { return m_rtShaderToShader; }
+		// Re-translates the shader if its material or shader class has changed since it was created.
+		// Returns the new shader, or nullptr if the shader is still up-to-date.
+		unirender::PShader ReloadShader(unirender::Shader &rtShader);
+		const ModelCacheStats &GetModelCacheStats() const { return m_modelCacheStats; }
+
+		// If enabled, the subdivision level of meshes with subdivision enabled is derived from their projected size in the view,
+		// instead of the static level in the model's extension data.
+		void SetAdaptiveSubdivisionSettings(const std::optional<AdaptiveSubdivisionSettings> &settings) { m_adaptiveSubdivisionSettings = settings; }
+		const std::optional<AdaptiveSubdivisionSettings> &GetAdaptiveSubdivisionSettings() const { return m_adaptiveSubdivisionSettings; }
+		void SetViewInfo(const std::optional<ViewInfo> &viewInfo) { m_viewInfo = viewInfo; }
+		const std::optional<ViewInfo> &GetViewInfo() const { return m_viewInfo; }
+
+		enum class ShaderPass : uint8_t { None = 0u, Combined = 1u, Albedo = Combined << 1u, Normal = Albedo << 1u, Depth = Normal << 1u, All = Combined | Albedo | Normal | Depth };
+		static ShaderPass GetRequiredShaderPasses(unirender::Scene::RenderMode renderMode, unirender::Scene::DenoiseMode denoiseMode);
+		// Only these shader passes are translated for new materials. Passes are translated on demand if a later render requires them.
+		void SetRequiredShaderPasses(ShaderPass passes) { m_requiredShaderPasses = passes; }
+		ShaderPass GetRequiredShaderPasses() const { return m_requiredShaderPasses; }
 	  private:
 		void AddAOBakeTarget(BaseEntity *optEnt, Model &mdl, uint32_t matIndex, std::shared_ptr<unirender::Object> &oAo, std::shared_ptr<unirender::Object> &oEnv);
 		struct ModelCacheInstance {
+			// Sub-meshes and their resolved materials. This implicitly covers the skin, body groups and material overrides of the entity.
+			std::vector<std::pair<ModelSubMesh *, Material *>> subMeshes;
+			std::vector<ModelSubMesh *> targetMeshes;
 			unirender::PMesh mesh = nullptr;
 			uint32_t skin = 0;
+			uint64_t size = 0; // Size of the mesh data in bytes
+		};
+		struct PendingEntity {
+			BaseEntity *entity = nullptr;
+			std::string name;
+			std::optional<ModelCacheInstance> cacheInstance {};
+			bool useCachedMesh = false;
+			std::vector<std::shared_ptr<MeshData>> meshDatas;
+		};
+		// Engine data CalcMeshData depends on. It is gathered on the main thread, so the mesh data itself can be computed on worker threads
+		// without calling into the engine.
+		struct MeshDataInput {
+			struct VertexTransform {
+				Mat4 matrix {};
+				Vector3 normalOffset {};
+				float wrinkle = 0.f;
+				bool transformed = false;
+			};
+			std::vector<VertexTransform> vertexTransforms; // Empty if the mesh isn't animated or is skinned with the bone palette
+			std::shared_ptr<const std::vector<Mat4>> bonePalette = nullptr; // Set if the mesh has no flexes, shared between all meshes of the entity
+			uint32_t subdivisionLevel = 0;                 // Static level from the model's extension data
+			std::unique_ptr<util::HairStrandData> hairStrandData = nullptr;
+		};
+		// Sub-mesh a deformable mesh was built from, in the order of BuildMesh (see UpdateEntityMesh)
+		struct MeshSource {
+			std::weak_ptr<ModelSubMesh> subMesh {};
+			bool includeAlphas = false;
+			bool includeWrinkles = false;
+		};
+		struct MeshDataJob {
+			std::shared_ptr<MeshData> meshData = nullptr;
+			MeshDataInput input {};
+			Model *model = nullptr;
+			ModelSubMesh *subMesh = nullptr;
+			bool includeAlphas = false;
+			bool includeWrinkles = false;
+			pragma::CModelComponent *mdlC = nullptr;
+			pragma::CAnimatedComponent *animC = nullptr;
+			std::optional<umath::ScaledTransform> pose {};
+			std::optional<umath::ScaledTransform> worldPose {};
 		};
 		struct ShaderInfo {
 			ShaderInfo();
@@ -108,25 +210,55 @@ namespace pragma::modules::cycles {
 		Material *GetMaterial(Model &mdl, ModelSubMesh &subMesh, uint32_t skinId) const;
 		Material *GetMaterial(pragma::CModelComponent &mdlC, ModelSubMesh &subMesh, uint32_t skinId) const;
 		Material *GetMaterial(BaseEntity &ent, ModelSubMesh &subMesh, uint32_t skinId) const;
+		std::optional<ModelCacheInstance> GetModelCacheInstance(BaseEntity &ent) const;
+		ModelCacheInstance *FindModelCacheInstance(const std::string &mdlName, const ModelCacheInstance &instance);
+		bool PrepareEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter, const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter,
+		  const std::string &nameSuffix, PendingEntity &outEntity);
+		unirender::PObject FinalizeEntity(PendingEntity &entity);
+		void RunMeshDataJob(MeshDataJob &job, uint32_t numThreads = 0);
+		// Wrinkle factors and alphas are appended in bulk. unirender::Mesh has no bulk equivalent of AddVertex and AddTriangle (the vertex
+		// attributes are spread over several internal arrays and AddTriangle also fills the per-corner uvs), so vertices and triangles
+		// are still added one at a time. The storage for all of them is reserved up front by BuildMesh.
 		void AddMeshDataToMesh(unirender::Mesh &mesh, const MeshData &meshData, const std::optional<umath::ScaledTransform> &pose = {}) const;
 		void AddMesh(Model &mdl, unirender::Mesh &mesh, ModelSubMesh &mdlMesh, pragma::CModelComponent *optMdlC = nullptr, pragma::CAnimatedComponent *optAnimC = nullptr);
 		std::string GetUniqueName() { return "internal" + std::to_string(m_uniqueNameIndex++); };
-		std::shared_ptr<MeshData> CalcMeshData(Model &mdl, ModelSubMesh &mdlMesh, bool includeAlphas, bool includeWrinkles, pragma::CModelComponent *optMdlC = nullptr, pragma::CAnimatedComponent *optAnimC = nullptr);
+		std::shared_ptr<MeshData> CalcMeshData(Model &mdl, ModelSubMesh &mdlMesh, bool includeAlphas, bool includeWrinkles, pragma::CModelComponent *optMdlC = nullptr, pragma::CAnimatedComponent *optAnimC = nullptr,
+		  const std::optional<umath::ScaledTransform> &worldPose = {});
+		// Returns nullptr if the meshes of the model can't be skinned with the bone palette alone (e.g. because of flexes)
+		std::shared_ptr<const std::vector<Mat4>> GetBonePalette(Model &mdl, pragma::CAnimatedComponent *optAnimC) const;
+		MeshDataInput GatherMeshDataInput(Model &mdl, ModelSubMesh &mdlMesh, pragma::CAnimatedComponent *optAnimC, const std::shared_ptr<const std::vector<Mat4>> &bonePalette) const;
+		// Only reads the vertex, alpha and index data of mdlMesh, so it can run on any thread. numThreads is passed on to subdivide_mesh.
+		std::shared_ptr<MeshData> CalcMeshData(ModelSubMesh &mdlMesh, MeshDataInput &input, bool includeAlphas, bool includeWrinkles, const std::optional<umath::ScaledTransform> &worldPose, uint32_t numThreads) const;
+		uint32_t CalcSubdivisionLevel(uint32_t staticLevel, const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &indices, const std::optional<umath::ScaledTransform> &worldPose) const;
+		unirender::PShader TranslateShader(Material &mat, const std::string &shaderName, BaseEntity *optEnt, ModelSubMesh *optSubMesh) const;
 		unirender::PShader CreateShader(Material &mat, const std::string &meshName, const ShaderInfo &shaderInfo = {}) const;
 		unirender::PShader CreateShader(const std::string &meshName, Model &mdl, ModelSubMesh &subMesh, BaseEntity *optEnt = nullptr, uint32_t skinId = 0) const;
+		size_t AddShaderToShaderCache(const unirender::PShader &rtShader) const;
 		uint32_t m_uniqueNameIndex = 0;
 		std::unordered_map<std::string, std::vector<ModelCacheInstance>> m_modelCache;
+		std::unordered_map<const unirender::Mesh *, std::vector<MeshSource>> m_deformableMeshSources;
+		std::unordered_map<const unirender::Mesh *, Hash128> m_deformableMeshHashes; // Deformation of the last update (see UpdateEntityMesh)
+		ModelCacheStats m_modelCacheStats {};
+		std::vector<MeshDataJob> *m_deferredMeshDataJobs = nullptr; // If set, mesh data is computed later (see AddEntities)
+		std::optional<AdaptiveSubdivisionSettings> m_adaptiveSubdivisionSettings {};
+		std::optional<ViewInfo> m_viewInfo {};
+		std::unordered_map<std::string, unirender::Object *> m_objectsByName {};
+		std::unordered_map<util::Uuid, unirender::Object *, util::HashUuid> m_objectsByUuid {};
 		mutable std::unordered_map<Material *, size_t> m_materialToShader;
 		std::optional<std::string> m_sky {};
 		std::shared_ptr<unirender::ModelCache> m_mdlCache = nullptr;
 		std::shared_ptr<unirender::ShaderCache> m_shaderCache = nullptr;
 		mutable std::unordered_map<unirender::Shader *, std::shared_ptr<Shader>> m_rtShaderToShader {};
+		mutable std::unordered_map<unirender::Shader *, std::string> m_rtShaderCacheKeys {};
+		mutable std::unordered_map<unirender::PShader, size_t> m_rtShaderToShaderCacheIndex {};
 		unirender::Scene::RenderMode m_renderMode = unirender::Scene::RenderMode::RenderImage;
+		ShaderPass m_requiredShaderPasses = ShaderPass::All;
 	};
 
 	class Scene : public std::enable_shared_from_this<Scene> {
 	  public:
-		Scene(unirender::Scene &rtScene);
+		// If the denoise mode is known, only the shader passes required for the render are translated
+		Scene(unirender::Scene &rtScene, std::optional<unirender::Scene::DenoiseMode> denoiseMode = {});
 		void AddSkybox(const std::string &texture);
 		void Add3DSkybox(pragma::CSceneComponent &gameScene, pragma::CSkyCameraComponent &skyCam, const Vector3 &camPos);
 		void SetAOBakeTarget(Model &mdl, uint32_t matIndex);
@@ -135,8 +267,11 @@ namespace pragma::modules::cycles {
 		void SetLightmapDataCache(LightmapDataCache *cache);
 		void Finalize();
 
+		// See Cache::FindObject
 		unirender::Object *FindObject(const std::string &name);
 		const unirender::Object *FindObject(const std::string &name) const { return const_cast<Scene *>(this)->FindObject(name); }
+		unirender::Object *FindObjectByUuid(const util::Uuid &uuid);
+		const unirender::Object *FindObjectByUuid(const util::Uuid &uuid) const { return const_cast<Scene *>(this)->FindObjectByUuid(uuid); }
 
 		Cache &GetCache();
 
@@ -159,7 +294,10 @@ namespace pragma::modules::cycles {
 	class Renderer : public std::enable_shared_from_this<Renderer> {
 	  public:
 		Renderer(Scene &scene, unirender::Renderer &renderer);
-		void ReloadShaders();
+		// Re-translates the shaders of changed materials and swaps them on the affected meshes. The backend shaders aren't created here,
+		// the renderer creates them for the new shaders when the objects using the meshes are synced (SyncEditedActor).
+		// Returns false if the renderer couldn't sync all of them, in which case the render has to be restarted to pick up the changes.
+		bool ReloadShaders();
 
 		Scene &GetScene() { return *m_scene; }
 		const Scene &GetScene() const { return const_cast<Renderer *>(this)->GetScene(); }
@@ -175,4 +313,6 @@ namespace pragma::modules::cycles {
 	unirender::NodeManager &get_node_manager();
 };
 
+REGISTER_BASIC_BITWISE_OPERATORS(pragma::modules::cycles::Cache::ShaderPass)
+
 #endif
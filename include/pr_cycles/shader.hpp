@@ -49,6 +49,28 @@ namespace pragma::modules::cycles {
 		mutable std::shared_ptr<ModelSubMesh> m_mesh {};
 	};
 
+	// Native implementation of the default "pbr" shader. It is only used if no Lua "pbr" shader has been registered, unless
+	// enabled explicitly with ShaderManager::SetNativePbrShaderEnabled (unirender.set_native_pbr_shader_enabled in Lua).
+	class PbrShader : public Shader {
+	  public:
+		PbrShader() = default;
+		virtual std::shared_ptr<unirender::GroupNodeDesc> InitializeCombinedPass() override;
+		virtual std::shared_ptr<unirender::GroupNodeDesc> InitializeAlbedoPass() override;
+		virtual std::shared_ptr<unirender::GroupNodeDesc> InitializeNormalPass() override;
+		virtual std::shared_ptr<unirender::GroupNodeDesc> InitializeDepthPass() override;
+	  private:
+		struct AlbedoSockets {
+			unirender::Socket color;
+			std::optional<unirender::Socket> alpha {};
+		};
+		std::optional<std::string> GetTexturePath(TextureInfo *texInfo, const std::optional<std::string> &defaultTexture = {}, bool translucent = false) const;
+		AlbedoSockets AddAlbedo(unirender::GroupNodeDesc &desc, Material &mat) const;
+		// Alpha for the passes that don't need the albedo color, empty for opaque materials
+		std::optional<unirender::Socket> AddAlpha(unirender::GroupNodeDesc &desc, Material &mat) const;
+		std::optional<unirender::Socket> AddNormal(unirender::GroupNodeDesc &desc, Material &mat) const;
+		void LinkSurface(unirender::GroupNodeDesc &desc, unirender::NodeDesc &nodeOutput, const unirender::Socket &surface, const std::optional<unirender::Socket> &alpha) const;
+	};
+
 	class ShaderManager {
 	  public:
 		static std::shared_ptr<ShaderManager> Create();
@@ -60,11 +82,20 @@ namespace pragma::modules::cycles {
 		void RegisterShader(const std::string &name, luabind::object oClass);
 		bool IsShaderRegistered(const std::string &name) const { return m_shaders.find(name) != m_shaders.end(); }
 		std::shared_ptr<Shader> CreateShader(unirender::NodeManager &nodeManager, const std::string &name, BaseEntity *ent, ModelSubMesh *mesh, Material &mat);
+
+		// If enabled, the native "pbr" shader is used even if a Lua "pbr" shader has been registered
+		void SetNativePbrShaderEnabled(bool enabled);
+		bool IsNativePbrShaderEnabled() const { return m_nativePbrShaderEnabled; }
+		// Returns true if the shader is implemented in C++ rather than by a registered Lua class
+		bool IsNativeShader(const std::string &name) const;
 	  private:
 		ShaderManager() = default;
 		std::unordered_map<std::string, luabind::object> m_shaders;
+		bool m_nativePbrShaderEnabled = false;
 	};
 	pragma::modules::cycles::ShaderManager &get_shader_manager();
+	// Clears the shader translations shared between caches, has to be called if shader definitions have changed
+	void clear_shader_graph_cache();
 
 	class LuaShader : public LuaObjectBase, public Shader {
 	  public:
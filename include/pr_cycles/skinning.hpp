@@ -0,0 +1,29 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_SKINNING_HPP__
+#define __PR_CYCLES_SKINNING_HPP__
+
+#include <mathutil/vertex.hpp>
+#include <mathutil/uvec.h>
+#include <cinttypes>
+
+namespace pragma::modules::cycles {
+	// Transforms the vertices verts[indices[i]] by matrices[i] and writes the result to outVerts[indices[i]].
+	// Positions are transformed as points (including the perspective divide), normals and tangents as directions, offset by normalOffsets[i] and normalized.
+	// The matrix products are evaluated with SSE if available, the results are identical to the scalar path.
+	void transform_vertices(const umath::Vertex *verts, const uint32_t *indices, const Mat4 *matrices, const Vector3 *normalOffsets, size_t count, umath::Vertex *outVerts);
+
+	// Skins verts[i] with the bone palette and writes the result to outVerts[i]. The matrix of a vertex is the sum of palette[boneIds[j]] * weights[j].
+	// Bone ids outside of [0,numBones) don't contribute, vertices without any contributing bone are copied as-is.
+	// Blocks of eight vertices are skinned with AVX2 if the module was built with it and the CPU supports it, the results are identical to skin_vertices_scalar.
+	void skin_vertices(const umath::Vertex *verts, const umath::VertexWeight *weights, size_t count, const Mat4 *palette, uint32_t numBones, umath::Vertex *outVerts);
+	void skin_vertices_scalar(const umath::Vertex *verts, const umath::VertexWeight *weights, size_t count, const Mat4 *palette, uint32_t numBones, umath::Vertex *outVerts);
+	bool is_avx2_skinning_available();
+};
+
+#endif
@@ -0,0 +1,33 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_SKINNING_AVX2_HPP__
+#define __PR_CYCLES_SKINNING_AVX2_HPP__
+
+#include <cstddef>
+#include <cinttypes>
+
+// skinning_avx2.cpp is the only file compiled with AVX2 enabled. It must not include any engine or glm headers, otherwise the linker
+// may pick the AVX2 variant of an inline function that is also used by the rest of the module, so the data is passed as raw memory.
+namespace pragma::modules::cycles::detail {
+	struct SkinningLayout {
+		size_t vertexStride = 0;
+		size_t positionOffset = 0;
+		size_t normalOffset = 0;
+		size_t tangentOffset = 0;
+		size_t weightStride = 0;
+		size_t boneIdOffset = 0;
+		size_t weightOffset = 0;
+	};
+	// Returns whether the AVX2 path was compiled in
+	bool is_avx2_skinning_compiled();
+	// Skins as many blocks of eight vertices as possible and returns the number of vertices that were processed.
+	// Vertices without any contributing bone are copied as-is.
+	size_t skin_vertices_avx2(const uint8_t *verts, const uint8_t *weights, size_t count, const float *palette, uint32_t numBones, uint8_t *outVerts, const SkinningLayout &layout);
+};
+
+#endif
@@ -0,0 +1,63 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#ifndef __PR_CYCLES_STAGING_IMAGE_POOL_HPP__
+#define __PR_CYCLES_STAGING_IMAGE_POOL_HPP__
+
+#include <cinttypes>
+#include <memory>
+#include <functional>
+#include <vector>
+
+namespace prosper {
+	class IImage;
+};
+namespace pragma::modules::cycles {
+	// Bounded pool of host-visible staging images. Requested sizes are rounded up to a size class (next power of two per dimension), so
+	// tiles of similar size share images. If the pool is full, the least recently released image is evicted.
+	// Images are created through the factory, which allows using the pool without a GPU.
+	class StagingImagePool {
+	  public:
+		using ImageFactory = std::function<std::shared_ptr<prosper::IImage>(uint32_t width, uint32_t height)>;
+		struct Stats {
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+			uint64_t evictions = 0;
+			uint64_t failedRequests = 0; // Requests that couldn't be served because all images were in use
+			uint32_t imageCount = 0;
+			uint32_t imagesInUse = 0;
+			uint32_t peakImageCount = 0;
+		};
+		static constexpr uint32_t MIN_SIZE_CLASS = 16;
+		// Sizes above 2^31 are returned as they are
+		static uint32_t GetSizeClass(uint32_t size);
+
+		StagingImagePool(const ImageFactory &factory, uint32_t maxImages);
+		// Returns an image that is at least w x h pixels large, or nullptr if the pool is exhausted
+		std::shared_ptr<prosper::IImage> Acquire(uint32_t w, uint32_t h);
+		void Release(const std::shared_ptr<prosper::IImage> &img);
+		void Clear();
+
+		uint32_t GetMaxImageCount() const { return m_maxImages; }
+		const Stats &GetStats() const { return m_stats; }
+	  private:
+		struct Entry {
+			std::shared_ptr<prosper::IImage> image = nullptr;
+			uint32_t width = 0;
+			uint32_t height = 0;
+			bool inUse = false;
+			uint64_t lastUse = 0;
+		};
+		ImageFactory m_factory;
+		uint32_t m_maxImages = 0;
+		uint64_t m_useCounter = 0;
+		std::vector<Entry> m_entries;
+		Stats m_stats {};
+	};
+};
+
+#endif
@@ -11,33 +11,33 @@
 #include <mathutil/uvec.h>
 #include <vector>
 #include <functional>
+#include <type_traits>
 #include <memory>
 #include <opensubdiv/far/topologyDescriptor.h>
 #include <opensubdiv/far/primvarRefiner.h>
+#include <opensubdiv/far/topologyLevel.h>
+#include <opensubdiv/far/stencilTable.h>
+#include <opensubdiv/far/stencilTableFactory.h>
 
 namespace pragma::modules::cycles {
 	using FaceVertexIndex = uint32_t;
+	// Determines where the refined values of a channel end up. Custom channels are written to their own per face-vertex result buffer.
+	enum class ChannelTarget : uint8_t { Custom = 0u, Position, Uv, Normal };
 	struct BaseChannelData {
-		BaseChannelData(const std::function<void(BaseChannelData &, FaceVertexIndex, umath::Vertex &, int)> &fApply, const std::function<void(uint32_t)> &prepareResultData = nullptr) : m_apply {fApply}, m_prepareResultData {prepareResultData} {}
+		BaseChannelData(ChannelTarget target = ChannelTarget::Custom) : target {target} {}
+		virtual ~BaseChannelData() = default;
 		virtual void ResizeBuffer(size_t size) = 0;
 		virtual void ReserveBuffer(size_t size) = 0;
 		virtual void *GetDataPtr() = 0;
 		void *GetElementPtr(uint32_t idx) { return static_cast<uint8_t *>(GetDataPtr()) + (idx * GetElementSize()); }
 		virtual uint32_t GetElementSize() const = 0;
 		virtual void Interpolate(OpenSubdiv::Far::PrimvarRefiner &primvarRefiner, int32_t level, void *src, void *dst, int channel) = 0;
-		void Apply(FaceVertexIndex face, umath::Vertex &v, int idx)
-		{
-			if(m_apply)
-				m_apply(*this, face, v, idx);
-		}
-		void PrepareResultData(uint32_t numFaces)
-		{
-			if(m_prepareResultData)
-				m_prepareResultData(numFaces);
-		}
-	  private:
-		std::function<void(BaseChannelData &, FaceVertexIndex, umath::Vertex &, int)> m_apply = nullptr;
-		std::function<void(uint32_t)> m_prepareResultData = nullptr;
+		// Evaluates the stencils [start,end) of the table. The control values are expected at the beginning of the buffer, the results are written starting at firstResultValue.
+		virtual void UpdateValues(const OpenSubdiv::Far::StencilTable &stencilTable, int firstResultValue, int start, int end) = 0;
+		// Writes the refined values of the last level to outVerts (one vertex per face-vertex), or to the result buffer for custom channels.
+		// channel is the face-varying channel index, or -1 for the vertex channel.
+		virtual void WriteResult(const OpenSubdiv::Far::TopologyLevel &lastLevel, int channel, int firstValue, std::vector<umath::Vertex> &outVerts) = 0;
+		const ChannelTarget target;
 	};
 
 	template<typename T>
@@ -54,7 +54,8 @@ namespace pragma::modules::cycles {
 
 	template<class TOsdType>
 	struct ChannelData : public BaseChannelData {
-		ChannelData(const std::function<void(BaseChannelData &, FaceVertexIndex, umath::Vertex &, int)> &fApply, const std::function<void(uint32_t)> &prepareResultData = nullptr) : BaseChannelData {fApply, prepareResultData} {}
+		using ValueType = decltype(TOsdType::value);
+		ChannelData(ChannelTarget target = ChannelTarget::Custom) : BaseChannelData {target} {}
 		virtual void ResizeBuffer(size_t size) override { buffer.resize(size); }
 		virtual void ReserveBuffer(size_t size) override { buffer.reserve(size); }
 		virtual void *GetDataPtr() override { return buffer.data(); }
@@ -68,11 +69,41 @@ namespace pragma::modules::cycles {
 			else
 				primvarRefiner.InterpolateFaceVarying(level, src, dst, channel - 1);
 		}
+		virtual void UpdateValues(const OpenSubdiv::Far::StencilTable &stencilTable, int firstResultValue, int start, int end) override { stencilTable.UpdateValues(buffer.data(), buffer.data() + firstResultValue, start, end); }
+		virtual void WriteResult(const OpenSubdiv::Far::TopologyLevel &lastLevel, int channel, int firstValue, std::vector<umath::Vertex> &outVerts) override
+		{
+			if constexpr(std::is_same_v<ValueType, Vector3>) {
+				if(target == ChannelTarget::Position)
+					return WriteValues(lastLevel, channel, firstValue, [&outVerts](FaceVertexIndex idx, const Vector3 &value) { outVerts[idx].position = value; });
+				if(target == ChannelTarget::Normal)
+					return WriteValues(lastLevel, channel, firstValue, [&outVerts](FaceVertexIndex idx, const Vector3 &value) { outVerts[idx].normal = value; });
+			}
+			else if constexpr(std::is_same_v<ValueType, Vector2>) {
+				if(target == ChannelTarget::Uv)
+					return WriteValues(lastLevel, channel, firstValue, [&outVerts](FaceVertexIndex idx, const Vector2 &value) { outVerts[idx].uv = value; });
+			}
+			result.resize(outVerts.size());
+			WriteValues(lastLevel, channel, firstValue, [this](FaceVertexIndex idx, const ValueType &value) { result[idx] = value; });
+		}
 		std::vector<TOsdType> buffer {};
+		std::vector<ValueType> result {}; // Refined values per face-vertex (custom channels only)
+	  private:
+		template<typename TWrite>
+		void WriteValues(const OpenSubdiv::Far::TopologyLevel &lastLevel, int channel, int firstValue, const TWrite &write) const
+		{
+			auto numFaces = lastLevel.GetNumFaces();
+			for(auto face = decltype(numFaces) {0}; face < numFaces; ++face) {
+				auto indices = (channel < 0) ? lastLevel.GetFaceVertices(face) : lastLevel.GetFaceFVarValues(face, channel);
+				for(uint8_t i = 0; i < 3; ++i)
+					write(face * 3 + i, buffer[firstValue + indices[i]].value);
+			}
+		}
 	};
 	using OsdVertex = OsdGenericAttribute<Vector3>;
 	using OsdUV = OsdGenericAttribute<Vector2>;
 	using OsdFloatAttr = OsdGenericAttribute<float>;
-	void subdivide_mesh(const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &tris, std::vector<umath::Vertex> &outVerts, std::vector<int32_t> &outTris, uint32_t subDivLevel, const std::vector<std::shared_ptr<BaseChannelData>> &miscAttributes = {});
+	// Large meshes are refined on up to numThreads threads (0 = number of hardware threads). The result only depends on the mesh, not on numThreads.
+	void subdivide_mesh(const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &tris, std::vector<umath::Vertex> &outVerts, std::vector<int32_t> &outTris, uint32_t subDivLevel, const std::vector<std::shared_ptr<BaseChannelData>> &miscAttributes = {},
+	  uint32_t numThreads = 0);
 };
 #endif
@@ -5,9 +5,45 @@
 * Copyright (c) 2023 Silverlan
 */
 
+#ifndef __PR_CYCLES_TEXTURE_HPP__
+#define __PR_CYCLES_TEXTURE_HPP__
+
+#include <mathutil/umath.h>
+#include <cinttypes>
+#include <future>
+#include <memory>
 #include <optional>
 #include <string>
 
+class Texture;
 namespace pragma::modules::cycles {
+	enum class PreparedTextureInputFlags : uint8_t { None = 0u, CanBeEnvMap = 1u };
+	enum class PreparedTextureOutputFlags : uint8_t { None = 0u, Envmap = 1u };
+
+	struct PreparedTexture {
+		// Absolute path of the texture file. If the texture had to be converted, the file
+		// only exists once 'ready' has completed.
+		std::optional<std::string> path;
+		// Evaluates to false if the conversion has failed
+		std::shared_future<bool> ready;
+	};
+
+	// Returns the path of a texture file Cycles can read. If the original texture file is in a format OpenImageIO supports, it is used directly.
+	// Otherwise the texture is converted to DDS (or PNG for translucent textures), with the GPU readback happening on the calling thread and
+	// the encoding on a background thread. Conversions are cached in "addons/converted/" and are re-used for as long as the
+	// content of the source texture file and the output format stay the same.
+	PreparedTexture prepare_texture_async(std::shared_ptr<Texture> tex, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
+	PreparedTexture prepare_texture_async(const std::string &texPath, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
+
+	// Blocking variants, fall back to the error texture if the conversion has failed
+	std::optional<std::string> prepare_texture(std::shared_ptr<Texture> tex, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
 	std::optional<std::string> prepare_texture(const std::string &texPath, const std::optional<std::string> &defaultTexture = {}, bool translucent = false);
+
+	// Has to be called before the renderer accesses any texture paths returned by prepare_texture_async.
+	// The output files of failed conversions are replaced with the error texture.
+	void wait_for_pending_texture_conversions();
 };
+REGISTER_BASIC_BITWISE_OPERATORS(pragma::modules::cycles::PreparedTextureInputFlags)
+REGISTER_BASIC_BITWISE_OPERATORS(pragma::modules::cycles::PreparedTextureOutputFlags)
+
+#endif
@@ -8,6 +8,10 @@
 #undef __SCENE_H__
 #include "pr_cycles/scene.hpp"
 #include "pr_cycles/subdivision.hpp"
+#include "pr_cycles/parallel.hpp"
+#include "pr_cycles/skinning.hpp"
+#include "pr_cycles/hash.hpp"
+#include "pr_cycles/texture.hpp"
 #include <prosper_context.hpp>
 #include <prosper_util.hpp>
 #include <cmaterialmanager.h>
@@ -25,223 +29,30 @@
 #include <pragma/entities/components/c_animated_component.hpp>
 #include <pragma/entities/components/c_model_component.hpp>
 #include <pragma/entities/components/c_render_component.hpp>
+#include <pragma/entities/components/c_eye_component.hpp>
 #include <pragma/entities/c_skybox.h>
 #include <pragma/rendering/shaders/c_shader_cubemap_to_equirectangular.hpp>
 #include <cmaterialmanager.h>
 #include <cmaterial_manager2.hpp>
 #include <sharedutils/util_file.h>
+#include <sharedutils/util_path.hpp>
 #include <sharedutils/util_hair.hpp>
 #undef __UTIL_STRING_H__
 #include <sharedutils/util_string.h>
 #include <util_texture_info.hpp>
+#include <textureinfo.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <mutex>
+#include <unordered_set>
 
 extern DLLCLIENT CEngine *c_engine;
 extern DLLCLIENT ClientState *client;
 extern DLLCLIENT CGame *c_game;
 
-enum class PreparedTextureInputFlags : uint8_t { None = 0u, CanBeEnvMap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureInputFlags)
-enum class PreparedTextureOutputFlags : uint8_t { None = 0u, Envmap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureOutputFlags)
-
-static std::optional<std::string> get_abs_error_texture_path()
-{
-	std::string errTexPath = "materials\\error.dds";
-	std::string absPath;
-	if(FileManager::FindAbsolutePath(errTexPath, absPath) == false)
-		return absPath;
-	return {};
-}
-
-static std::optional<std::string> prepare_texture(TextureInfo *texInfo, bool &outSuccess, bool &outConverted, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {})
-{
-	if(optOutFlags)
-		*optOutFlags = PreparedTextureOutputFlags::None;
-
-	outSuccess = false;
-	outConverted = false;
-	if(texInfo == nullptr)
-		return {};
-	auto tex = texInfo ? std::static_pointer_cast<Texture>(texInfo->texture) : nullptr;
-	std::string texName {};
-	// Make sure texture has been fully loaded!
-	if(tex == nullptr || tex->IsLoaded() == false) {
-		tex = nullptr;
-		if(defaultTexture.has_value()) {
-			auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
-			auto ptrTex = texManager.LoadAsset(*defaultTexture);
-			if(ptrTex != nullptr) {
-				texName = *defaultTexture;
-				tex = ptrTex;
-				if(tex->IsLoaded() == false)
-					tex = nullptr;
-			}
-		}
-	}
-	else
-		texName = texInfo->name;
-	if(tex == nullptr || tex->IsError() || tex->HasValidVkTexture() == false)
-		return get_abs_error_texture_path();
-
-	/*if(tex->IsLoaded() == false)
-	{
-	TextureManager::LoadInfo loadInfo {};
-	loadInfo.flags = TextureLoadFlags::LoadInstantly;
-	static_cast<CMaterialManager&>(client->GetMaterialManager()).GetTextureManager().Load(*c_engine,texInfo->name,loadInfo);
-	if(tex->IsLoaded() == false)
-	return get_abs_error_texture_path();
-	}
-	*/
-	ufile::remove_extension_from_filename(texName); // DDS-writer will add the extension for us
-
-	auto vkTex = tex->GetVkTexture();
-	auto *img = &vkTex->GetImage();
-	auto isCubemap = img->IsCubemap();
-	if(isCubemap) {
-		if(umath::is_flag_set(inFlags, PreparedTextureInputFlags::CanBeEnvMap) == false)
-			return {};
-		// Image is a cubemap, which Cycles doesn't support! We'll have to convert it to a equirectangular image and use that instead.
-		auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
-		auto equiRectMap = shader.CubemapToEquirectangularTexture(*vkTex);
-		vkTex = equiRectMap;
-		img = &vkTex->GetImage();
-		texName += "_equirect";
-
-		if(optOutFlags)
-			*optOutFlags |= PreparedTextureOutputFlags::Envmap;
-	}
-
-	auto texPath = "materials\\" + texName;
-	texPath += ".dds";
-	// Check if DDS version of the texture already exists, in which case we can just use it directly!
-	std::string absPath;
-	if(FileManager::FindAbsolutePath(texPath, absPath)) {
-		outSuccess = true;
-		return absPath;
-	}
-
-	// Texture does not have the right format to begin with or does not exist on the local hard drive.
-	// We will have to create the texture file in the right format (if the texture object is valid).
-	if(tex == nullptr)
-		return get_abs_error_texture_path(); // Texture is not valid! Return error texture.
-
-	// Output path for the DDS-file we're about to create
-	auto ddsPath = "addons/converted/materials/" + texName;
-	uimg::TextureInfo imgWriteInfo {};
-	imgWriteInfo.containerFormat = uimg::TextureInfo::ContainerFormat::DDS; // Cycles doesn't support KTX
-	if(tex->HasFlag(Texture::Flags::SRGB))
-		imgWriteInfo.flags |= uimg::TextureInfo::Flags::SRGB;
-
-	// Try to determine appropriate formats
-	if(tex->HasFlag(Texture::Flags::NormalMap)) {
-		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-		imgWriteInfo.SetNormalMap();
-	}
-	else {
-		auto format = img->GetFormat();
-		if(prosper::util::is_16bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
-		}
-		else if(prosper::util::is_32bit_format(format) || prosper::util::is_64bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
-		}
-		else {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R8G8B8A8_UInt;
-			// TODO: Check the alpha channel values to determine whether we actually need a full alpha channel?
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::ColorMapSmoothAlpha;
-		}
-		switch(format) {
-		case prosper::Format::BC1_RGBA_SRGB_Block:
-		case prosper::Format::BC1_RGBA_UNorm_Block:
-		case prosper::Format::BC1_RGB_SRGB_Block:
-		case prosper::Format::BC1_RGB_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC1;
-			break;
-		case prosper::Format::BC2_SRGB_Block:
-		case prosper::Format::BC2_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC2;
-			break;
-		case prosper::Format::BC3_SRGB_Block:
-		case prosper::Format::BC3_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC3;
-			break;
-		case prosper::Format::BC4_SNorm_Block:
-		case prosper::Format::BC4_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC4;
-			break;
-		case prosper::Format::BC5_SNorm_Block:
-		case prosper::Format::BC5_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC5;
-			break;
-		case prosper::Format::BC6H_SFloat_Block:
-		case prosper::Format::BC6H_UFloat_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC6, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC6;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT5;
-			break;
-		case prosper::Format::BC7_SRGB_Block:
-		case prosper::Format::BC7_UNorm_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC7, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC7;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT1;
-			break;
-		}
-	}
-	absPath = "";
-	// Save the DDS image and make sure the file exists
-	if(c_game->SaveImage(*img, ddsPath, imgWriteInfo) && FileManager::FindAbsolutePath(ddsPath + ".dds", absPath)) {
-		outSuccess = true;
-		outConverted = true;
-		return absPath;
-	}
-	// Something went wrong, fall back to error texture!
-	return get_abs_error_texture_path();
-}
-
-static std::optional<std::string> prepare_texture(TextureInfo *texInfo, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags = nullptr, const std::optional<std::string> &defaultTexture = {})
-{
-	if(optOutFlags)
-		*optOutFlags = PreparedTextureOutputFlags::None;
-	if(texInfo == nullptr)
-		return {};
-	auto success = false;
-	auto converted = false;
-	auto result = prepare_texture(texInfo, success, converted, inFlags, optOutFlags, defaultTexture);
-	if(success == false) {
-		Con::cwar << "WARNING: Unable to prepare texture '";
-		if(texInfo)
-			Con::cwar << texInfo->name;
-		else
-			Con::cwar << "Unknown";
-		Con::cwar << "'! Using error texture instead..." << Con::endl;
-	}
-	else {
-		if(converted)
-			Con::cout << "Converted texture '" << texInfo->name << "' to DDS!" << Con::endl;
-#if 0
-		ccl::ImageMetaData metaData;
-		if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-		{
-			Con::cwar<<"WARNING: Texture '"<<texInfo->name<<"' has format which is incompatible with cycles! Falling back to error texture..."<<Con::endl;
-			result = get_abs_error_texture_path();
-			if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-			{
-				Con::cwar<<"WARNING: Error texture also not compatible! Falling back to untextured!"<<Con::endl;
-				result = {};
-			}
-		}
-#endif
-	}
-
-	return result;
-}
-
 pragma::modules::cycles::Cache::Cache(unirender::Scene::RenderMode renderMode) : m_renderMode {renderMode}
 {
 	m_shaderCache = unirender::ShaderCache::Create();
@@ -258,6 +69,7 @@ std::vector<std::shared_ptr<pragma::modules::cycles::Cache::MeshData>> pragma::m
 	auto hasWrinkles = (mdl.GetVertexAnimations().empty() == false); // TODO: Not the best way to determine if the entity uses wrinkles
 	std::vector<std::shared_ptr<MeshData>> meshDatas {};
 	meshDatas.reserve(meshList.size());
+	auto bonePalette = GetBonePalette(mdl, optAnimC);
 	for(auto &mesh : meshList) {
 		if(optMeshFilter != nullptr && optMeshFilter(*mesh, pose) == false)
 			continue;
@@ -266,24 +78,52 @@ std::vector<std::shared_ptr<pragma::modules::cycles::Cache::MeshData>> pragma::m
 				continue;
 			hasAlphas = hasAlphas || (subMesh->GetAlphaCount() > 0);
 
-			auto meshData = CalcMeshData(mdl, *subMesh, hasAlphas, hasWrinkles, optMdlC, optAnimC);
-			if(opose.has_value()) {
-				for(auto &v : meshData->vertices) {
-					v.position = *opose * v.position;
-					uvec::rotate(&v.normal, opose->GetRotation());
-					uvec::normalize(&v.normal);
-				}
-			}
-			meshData->shader = CreateShader(GetUniqueName(), mdl, *subMesh, optEnt, skinId);
-			if(meshData->shader) {
-				meshDatas.push_back(meshData);
+			MeshDataJob job {};
+			job.model = &mdl;
+			job.subMesh = subMesh.get();
+			job.includeAlphas = hasAlphas;
+			job.includeWrinkles = hasWrinkles;
+			job.mdlC = optMdlC;
+			job.animC = optAnimC;
+			job.pose = opose;
+			if(opose.has_value())
+				job.worldPose = opose;
+			else if(optEnt)
+				job.worldPose = optEnt->GetPose();
+			auto shader = CreateShader(GetUniqueName(), mdl, *subMesh, optEnt, skinId);
+			if(shader == nullptr)
+				continue;
+			job.input = GatherMeshDataInput(mdl, *subMesh, optAnimC, bonePalette);
+			job.meshData = std::make_shared<MeshData>();
+			job.meshData->shader = shader;
+			job.meshData->subMesh = subMesh;
+			meshDatas.push_back(job.meshData);
+			if(m_deferredMeshDataJobs)
+				m_deferredMeshDataJobs->push_back(std::move(job));
+			else
+				RunMeshDataJob(job);
+			if(optOnMeshAdded)
 				optOnMeshAdded(*subMesh);
-			}
 		}
 	}
 	return meshDatas;
 }
 
+void pragma::modules::cycles::Cache::RunMeshDataJob(MeshDataJob &job, uint32_t numThreads)
+{
+	auto meshData = CalcMeshData(*job.subMesh, job.input, job.includeAlphas, job.includeWrinkles, job.worldPose, numThreads);
+	if(job.pose.has_value()) {
+		for(auto &v : meshData->vertices) {
+			v.position = *job.pose * v.position;
+			uvec::rotate(&v.normal, job.pose->GetRotation());
+			uvec::normalize(&v.normal);
+		}
+	}
+	meshData->shader = job.meshData->shader;
+	meshData->subMesh = job.meshData->subMesh;
+	*job.meshData = std::move(*meshData);
+}
+
 std::vector<std::shared_ptr<pragma::modules::cycles::Cache::MeshData>> pragma::modules::cycles::Cache::AddModel(Model &mdl, const std::string &meshName, BaseEntity *optEnt, const std::optional<umath::ScaledTransform> &pose, uint32_t skinId, pragma::CModelComponent *optMdlC,
   pragma::CAnimatedComponent *optAnimC, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &optMeshFilter, const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &optSubMeshFilter, const std::function<void(ModelSubMesh &)> &optOnMeshAdded)
 {
@@ -311,103 +151,291 @@ std::vector<std::shared_ptr<pragma::modules::cycles::Cache::MeshData>> pragma::m
 	mdlC->UpdateLOD(0u);
 	auto animC = ent.GetComponent<CAnimatedComponent>();
 
-	unirender::PMesh mesh = nullptr;
-	auto &mdlName = mdl->GetName();
-	auto shouldCache = false; //true;
-	if(ent.IsWorld())
-		shouldCache = false;
-	if(mdlC->GetMaterialOverrides().empty() == false)
-		shouldCache = false; // Don't use cache if the entity uses material overrides
-	if(animC.valid() && animC->GetAnimation() != -1)
-		shouldCache = false; // Don't use cache if the entity is animated
-
-	auto skin = mdlC->GetSkin();
-	if(shouldCache) {
-		auto it = m_modelCache.find(mdlName);
-		if(it != m_modelCache.end()) {
-			auto itInstance = std::find_if(it->second.begin(), it->second.end(), [skin](const ModelCacheInstance &instance) { return instance.skin == skin; });
-			if(itInstance != it->second.end())
-				mesh = itInstance->mesh;
+	std::string name = "ent" + nameSuffix + "_" + std::to_string(ent.GetLocalIndex());
+	std::vector<ModelSubMesh *> tmpTargetMeshes {};
+	auto *targetMeshes = (optOutTargetMeshes != nullptr) ? optOutTargetMeshes : &tmpTargetMeshes;
+	targetMeshes->reserve(targetMeshes->size() + mdl->GetSubMeshCount());
+
+	auto skyC = ent.GetComponent<CSkyboxComponent>();
+	if(skyC.valid()) {
+		// Special case
+		auto &pose = ent.GetPose();
+		AddModel(*mdl, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, [&targetMeshes, &subMeshFilter](ModelSubMesh &mesh, const umath::ScaledTransform &pose) -> bool {
+			if(subMeshFilter && subMeshFilter(mesh, pose) == false)
+				return false;
+			targetMeshes->push_back(&mesh);
+			return false;
+		});
+
+		std::optional<std::string> skyboxTexture {};
+		for(auto &mesh : *targetMeshes) {
+			auto *mat = mdlC->GetRenderMaterial(mesh->GetSkinTextureIndex(), ent.GetSkin());
+			if(mat == nullptr || (ustring::compare<std::string>(mat->GetShaderIdentifier(), "skybox", false) == false && ustring::compare<std::string>(mat->GetShaderIdentifier(), "skybox_equirect", false) == false))
+				continue;
+			auto *diffuseMap = mat->GetTextureInfo("skybox");
+			auto tex = diffuseMap ? diffuseMap->texture : nullptr;
+			auto vkTex = tex ? std::static_pointer_cast<Texture>(tex)->GetVkTexture() : nullptr;
+			if(vkTex == nullptr || vkTex->GetImage().IsCubemap() == false)
+				continue;
+			PreparedTextureOutputFlags flags;
+			auto diffuseTexPath = prepare_texture(std::static_pointer_cast<Texture>(tex), PreparedTextureInputFlags::CanBeEnvMap, &flags);
+			if(diffuseTexPath.has_value() == false || umath::is_flag_set(flags, PreparedTextureOutputFlags::Envmap) == false)
+				continue;
+			skyboxTexture = diffuseTexPath;
 		}
+		if(skyboxTexture.has_value())
+			m_sky = *skyboxTexture;
+		return {};
 	}
+
+	auto fFilterMesh = [&subMeshFilter](ModelSubMesh &mesh, const umath::ScaledTransform &pose) -> bool { return !subMeshFilter || subMeshFilter(mesh, pose); };
+	auto fOnMeshAdded = [&targetMeshes](ModelSubMesh &mesh) { targetMeshes->push_back(&mesh); };
+
 	std::vector<std::shared_ptr<MeshData>> meshDatas;
-	if(mesh == nullptr) {
-		std::string name = "ent" + nameSuffix + "_" + std::to_string(ent.GetLocalIndex());
-		std::vector<ModelSubMesh *> tmpTargetMeshes {};
-		auto *targetMeshes = (optOutTargetMeshes != nullptr) ? optOutTargetMeshes : &tmpTargetMeshes;
-		targetMeshes->reserve(targetMeshes->size() + mdl->GetSubMeshCount());
-
-		auto skyC = ent.GetComponent<CSkyboxComponent>();
-		if(skyC.valid()) {
-			// Special case
-			auto &pose = ent.GetPose();
-			AddModel(*mdl, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, [&targetMeshes, &subMeshFilter](ModelSubMesh &mesh, const umath::ScaledTransform &pose) -> bool {
-				if(subMeshFilter && subMeshFilter(mesh, pose) == false)
-					return false;
-				targetMeshes->push_back(&mesh);
-				return false;
-			});
-
-			std::optional<std::string> skyboxTexture {};
-			for(auto &mesh : *targetMeshes) {
-				auto *mat = mdlC->GetRenderMaterial(mesh->GetSkinTextureIndex(), ent.GetSkin());
-				if(mat == nullptr || (ustring::compare<std::string>(mat->GetShaderIdentifier(), "skybox", false) == false && ustring::compare<std::string>(mat->GetShaderIdentifier(), "skybox_equirect", false) == false))
-					continue;
-				auto *diffuseMap = mat->GetTextureInfo("skybox");
-				auto tex = diffuseMap ? diffuseMap->texture : nullptr;
-				auto vkTex = tex ? std::static_pointer_cast<Texture>(tex)->GetVkTexture() : nullptr;
-				if(vkTex == nullptr || vkTex->GetImage().IsCubemap() == false)
-					continue;
-				PreparedTextureOutputFlags flags;
-				auto diffuseTexPath = prepare_texture(diffuseMap, PreparedTextureInputFlags::CanBeEnvMap, &flags);
-				if(diffuseTexPath.has_value() == false || umath::is_flag_set(flags, PreparedTextureOutputFlags::Envmap) == false)
-					continue;
-				skyboxTexture = diffuseTexPath;
-			}
-			if(skyboxTexture.has_value())
-				m_sky = *skyboxTexture;
-			return {};
-		}
+	auto renderC = ent.GetComponent<pragma::CRenderComponent>();
+	if(renderC.valid()) {
+		auto &lodGroup = renderC->GetLodMeshGroup(0);
+		auto &lodMeshes = renderC->GetLODMeshes();
+		std::vector<std::shared_ptr<ModelMesh>> meshes;
+		meshes.reserve(lodGroup.second);
+		for(auto meshIdx = lodGroup.first; meshIdx < lodGroup.first + lodGroup.second; ++meshIdx)
+			meshes.push_back(lodMeshes.at(meshIdx));
+		meshDatas = AddMeshList(*mdl, lodMeshes, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, fFilterMesh, fOnMeshAdded);
+	}
+	else
+		meshDatas = AddModel(*mdl, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, fFilterMesh, fOnMeshAdded);
+	return meshDatas;
+}
 
-		auto fFilterMesh = [&subMeshFilter](ModelSubMesh &mesh, const umath::ScaledTransform &pose) -> bool { return !subMeshFilter || subMeshFilter(mesh, pose); };
-		auto fOnMeshAdded = [&targetMeshes](ModelSubMesh &mesh) { targetMeshes->push_back(&mesh); };
-
-		auto renderC = ent.GetComponent<pragma::CRenderComponent>();
-		if(renderC.valid()) {
-			auto &lodGroup = renderC->GetLodMeshGroup(0);
-			auto &lodMeshes = renderC->GetLODMeshes();
-			std::vector<std::shared_ptr<ModelMesh>> meshes;
-			meshes.reserve(lodGroup.second);
-			for(auto meshIdx = lodGroup.first; meshIdx < lodGroup.first + lodGroup.second; ++meshIdx)
-				meshes.push_back(lodMeshes.at(meshIdx));
-			meshDatas = AddMeshList(*mdl, lodMeshes, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, fFilterMesh, fOnMeshAdded);
-		}
-		else
-			meshDatas = AddModel(*mdl, name, &ent, pose, ent.GetSkin(), mdlC, animC.get(), meshFilter, fFilterMesh, fOnMeshAdded);
-		if(meshDatas.empty())
-			return meshDatas;
+std::optional<pragma::modules::cycles::Cache::ModelCacheInstance> pragma::modules::cycles::Cache::GetModelCacheInstance(BaseEntity &ent) const
+{
+	if(ent.IsWorld() || ent.GetComponent<CSkyboxComponent>().valid() || ent.GetComponent<CEyeComponent>().valid())
+		return {};
+	auto *mdlC = static_cast<pragma::CModelComponent *>(ent.GetModelComponent());
+	auto mdl = mdlC ? mdlC->GetModel() : nullptr;
+	if(mdl == nullptr || mdl->GetName().empty())
+		return {};
+	if(mdl->GetVertexAnimations().empty() == false)
+		return {}; // Flexes may deform the mesh
+	if(m_adaptiveSubdivisionSettings.has_value()) {
+		uint32_t subdivLevel = 0;
+		mdl->GetExtensionData().GetFromPath("unirender/subdivision/level")(subdivLevel);
+		if(subdivLevel > 0)
+			return {}; // The subdivision level depends on the distance to the camera
+	}
+	auto animC = ent.GetComponent<CAnimatedComponent>();
+	if(animC.valid() && (animC->GetAnimation() != -1 || mdl->GetSkeleton().GetBoneCount() > 1))
+		return {}; // The mesh depends on the pose of the entity
+
+	// Collect the same meshes AddEntityMesh would use for this entity
+	mdlC->UpdateLOD(0u);
+	std::vector<std::shared_ptr<ModelMesh>> bodyGroupMeshes {};
+	const std::vector<std::shared_ptr<ModelMesh>> *meshes = &bodyGroupMeshes;
+	auto renderC = ent.GetComponent<pragma::CRenderComponent>();
+	if(renderC.valid())
+		meshes = &renderC->GetLODMeshes();
+	else {
+		std::vector<uint32_t> bodyGroups {};
+		bodyGroups.resize(mdl->GetBodyGroupCount());
+		mdl->GetBodyGroupMeshes(bodyGroups, 0, bodyGroupMeshes);
 	}
 
-	if(mdlName.empty() == false) {
-		if(shouldCache) {
-			auto it = m_modelCache.find(mdlName);
-			if(it == m_modelCache.end())
-				it = m_modelCache.insert(std::make_pair(mdlName, std::vector<ModelCacheInstance> {})).first;
-			it->second.push_back({mesh, skin});
+	ModelCacheInstance instance {};
+	instance.skin = ent.GetSkin();
+	for(auto &mesh : *meshes) {
+		for(auto &subMesh : mesh->GetSubMeshes()) {
+			if(subMesh->GetGeometryType() != ModelSubMesh::GeometryType::Triangles || subMesh->GetTriangleCount() == 0)
+				continue;
+			instance.subMeshes.push_back({subMesh.get(), GetMaterial(*mdlC, *subMesh, instance.skin)});
 		}
 	}
-	return meshDatas;
+	return instance;
 }
-unirender::PObject pragma::modules::cycles::Cache::AddEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter,
-  const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter, const std::string &nameSuffix)
+
+pragma::modules::cycles::Cache::ModelCacheInstance *pragma::modules::cycles::Cache::FindModelCacheInstance(const std::string &mdlName, const ModelCacheInstance &instance)
 {
-	auto meshDatas = AddEntityMesh(ent, optOutTargetMeshes, meshFilter, subMeshFilter, nameSuffix);
-	if(meshDatas.empty())
-		return nullptr;
-	std::string name = "ent" + nameSuffix + "_" + std::to_string(ent.GetLocalIndex());
-	auto mesh = BuildMesh(name, meshDatas);
-	if(mesh == nullptr)
+	auto it = m_modelCache.find(mdlName);
+	if(it == m_modelCache.end())
 		return nullptr;
+	auto itInstance = std::find_if(it->second.begin(), it->second.end(), [&instance](const ModelCacheInstance &other) { return other.skin == instance.skin && other.subMeshes == instance.subMeshes; });
+	return (itInstance != it->second.end()) ? &*itInstance : nullptr;
+}
+
+static uint64_t get_mesh_data_size(const pragma::modules::cycles::Cache::MeshData &meshData)
+{
+	auto size = meshData.vertices.size() * sizeof(umath::Vertex) + meshData.triangles.size() * sizeof(int32_t);
+	if(meshData.alphas.has_value())
+		size += meshData.alphas->size() * sizeof(float);
+	if(meshData.wrinkles.has_value())
+		size += meshData.wrinkles->size() * sizeof(float);
+	return size;
+}
+
+bool pragma::modules::cycles::Cache::PrepareEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter,
+  const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter, const std::string &nameSuffix, PendingEntity &outEntity)
+{
+	outEntity.entity = &ent;
+	outEntity.name = "ent" + nameSuffix + "_" + std::to_string(ent.GetLocalIndex());
+
+	// Entities with the same model, skin, body groups and materials share the same mesh
+	outEntity.cacheInstance = (meshFilter == nullptr && subMeshFilter == nullptr) ? GetModelCacheInstance(ent) : std::optional<ModelCacheInstance> {};
+	if(outEntity.cacheInstance.has_value() == false) {
+		outEntity.meshDatas = AddEntityMesh(ent, optOutTargetMeshes, meshFilter, subMeshFilter, nameSuffix);
+		return !outEntity.meshDatas.empty();
+	}
+	auto mdlName = ent.GetModel()->GetName();
+	auto *cached = FindModelCacheInstance(mdlName, *outEntity.cacheInstance);
+	if(cached) {
+		// The mesh may not have been built yet if the instance was registered by an entity of the same batch, but it will be by the time this entity is finalized
+		outEntity.useCachedMesh = true;
+		if(optOutTargetMeshes)
+			optOutTargetMeshes->insert(optOutTargetMeshes->end(), cached->targetMeshes.begin(), cached->targetMeshes.end());
+		return true;
+	}
+	auto &instance = *outEntity.cacheInstance;
+	outEntity.meshDatas = AddEntityMesh(ent, &instance.targetMeshes, meshFilter, subMeshFilter, nameSuffix);
+	if(outEntity.meshDatas.empty())
+		return false;
+	if(optOutTargetMeshes)
+		optOutTargetMeshes->insert(optOutTargetMeshes->end(), instance.targetMeshes.begin(), instance.targetMeshes.end());
+	m_modelCache[mdlName].push_back(instance);
+	return true;
+}
+
+static bool is_deformable_model(Model &mdl) { return mdl.GetVertexAnimations().empty() == false || mdl.GetSkeleton().GetBoneCount() > 1; }
+
+bool pragma::modules::cycles::Cache::UpdateEntityMesh(BaseEntity &ent, unirender::Mesh &mesh, unirender::Scene &scene, unirender::Renderer &renderer)
+{
+	// Only meshes of animated entities are deformed, all other meshes may be shared between entities (see GetModelCacheInstance)
+	auto itSources = m_deformableMeshSources.find(&mesh);
+	if(itSources == m_deformableMeshSources.end())
+		return false;
+	auto *mdlC = static_cast<pragma::CModelComponent *>(ent.GetModelComponent());
+	auto mdl = mdlC ? mdlC->GetModel() : nullptr;
+	if(mdl == nullptr)
+		return false;
+	auto animC = ent.GetComponent<CAnimatedComponent>();
+	auto bonePalette = GetBonePalette(*mdl, animC.get());
+	auto worldPose = ent.GetPose();
+
+	auto &sources = itSources->second;
+	std::vector<MeshDataInput> inputs;
+	std::vector<ModelSubMesh *> subMeshes;
+	inputs.reserve(sources.size());
+	subMeshes.reserve(sources.size());
+	for(auto &source : sources) {
+		auto subMesh = source.subMesh.lock();
+		if(subMesh == nullptr)
+			return false;
+		inputs.push_back(GatherMeshDataInput(*mdl, *subMesh, animC.get(), bonePalette));
+		subMeshes.push_back(subMesh.get());
+	}
+	// Moving the entity only changes the object transform, so the vertices only have to be recomputed if the pose of the bones
+	// (or the flexes) has changed. The deformation at build time is unknown, so the first update always recomputes them.
+	Hasher hasher {};
+	if(bonePalette)
+		hasher.Add(*bonePalette);
+	for(auto &input : inputs) {
+		hasher.Add<uint64_t>(input.vertexTransforms.size());
+		// The members are added one by one, since the padding of the struct is undefined
+		for(auto &t : input.vertexTransforms)
+			hasher.Add(t.matrix).Add(t.normalOffset).Add(t.wrinkle).Add(t.transformed);
+	}
+	auto &deformationHash = hasher.GetHash();
+	auto itHash = m_deformableMeshHashes.find(&mesh);
+	if(itHash != m_deformableMeshHashes.end() && itHash->second == deformationHash)
+		return true;
+
+	std::vector<std::shared_ptr<MeshData>> meshDatas;
+	meshDatas.reserve(sources.size());
+	uint64_t numVerts = 0;
+	uint64_t numTris = 0;
+	uint64_t numAlphas = 0;
+	uint64_t numWrinkles = 0;
+	for(auto i = decltype(sources.size()) {0u}; i < sources.size(); ++i) {
+		auto &source = sources[i];
+		auto meshData = CalcMeshData(*subMeshes[i], inputs[i], source.includeAlphas, source.includeWrinkles, worldPose, 0);
+		numVerts += meshData->vertices.size();
+		numTris += meshData->triangles.size() / 3;
+		numAlphas += meshData->alphas.has_value() ? meshData->alphas->size() : 0;
+		numWrinkles += meshData->wrinkles.has_value() ? meshData->wrinkles->size() : 0;
+		meshDatas.push_back(meshData);
+	}
+	auto matchesTopology = [numVerts, numTris, numAlphas, numWrinkles](unirender::Mesh &mesh) {
+		return numVerts == mesh.GetVertexCount() && numTris == mesh.GetTriangleCount() && numAlphas == mesh.GetAlphas().size() && numWrinkles == mesh.GetWrinkleFactors().size();
+	};
+	// The renderer keeps its own copy of the mesh, which is what it actually renders (see Renderer::ReloadShaders)
+	unirender::Mesh *renderMesh = nullptr;
+	if(auto rtRenderMesh = renderer.FindRenderMeshByHash(mesh.GetHash()); rtRenderMesh != nullptr && &*rtRenderMesh != &mesh)
+		renderMesh = &*rtRenderMesh;
+	if(matchesTopology(mesh) == false || (renderMesh != nullptr && matchesTopology(*renderMesh) == false))
+		return false;
+
+	// Same order as AddMeshDataToMesh, the triangles, uvs and shaders stay untouched
+	auto writeMeshData = [&meshDatas](unirender::Mesh &mesh) {
+		auto &verts = mesh.GetVertices();
+		auto &normals = mesh.GetVertexNormals();
+		auto &tangents = mesh.GetVertexTangents();
+		auto &tangentSigns = mesh.GetVertexTangentSigns();
+		size_t vertIdx = 0;
+		auto itAlpha = mesh.GetAlphas().begin();
+		auto itWrinkle = mesh.GetWrinkleFactors().begin();
+		for(auto &meshData : meshDatas) {
+			for(auto &v : meshData->vertices) {
+				verts[vertIdx] = v.position;
+				normals[vertIdx] = v.normal;
+				tangents[vertIdx] = Vector3 {v.tangent};
+				tangentSigns[vertIdx] = v.tangent.w;
+				++vertIdx;
+			}
+			if(meshData->alphas.has_value())
+				itAlpha = std::copy(meshData->alphas->begin(), meshData->alphas->end(), itAlpha);
+			if(meshData->wrinkles.has_value())
+				itWrinkle = std::copy(meshData->wrinkles->begin(), meshData->wrinkles->end(), itWrinkle);
+		}
+	};
+	writeMeshData(mesh);
+	if(renderMesh != nullptr)
+		writeMeshData(*renderMesh);
+	m_deformableMeshHashes[&mesh] = deformationHash;
+
+	// Tags the mesh as modified. Only the vertex attributes have changed (the triangles are never touched and the counts were
+	// verified above), which is the case in which the renderer refits the BVH of the mesh with the next sync instead of rebuilding it.
+	mesh.Finalize(scene, true);
+	if(renderMesh != nullptr)
+		renderMesh->Finalize(scene, true);
+	return true;
+}
+
+unirender::PObject pragma::modules::cycles::Cache::FinalizeEntity(PendingEntity &entity)
+{
+	auto &ent = *entity.entity;
+	unirender::PMesh mesh = nullptr;
+	auto *cached = entity.cacheInstance.has_value() ? FindModelCacheInstance(ent.GetModel()->GetName(), *entity.cacheInstance) : nullptr;
+	if(entity.useCachedMesh) {
+		if(cached == nullptr || cached->mesh == nullptr)
+			return nullptr;
+		mesh = cached->mesh;
+		++m_modelCacheStats.hits;
+		m_modelCacheStats.bytesSaved += cached->size;
+	}
+	else {
+		mesh = BuildMesh(entity.name, entity.meshDatas);
+		if(mesh == nullptr)
+			return nullptr;
+		if(is_deformable_model(*ent.GetModel())) {
+			auto &sources = m_deformableMeshSources[mesh.get()];
+			sources.reserve(entity.meshDatas.size());
+			for(auto &meshData : entity.meshDatas)
+				sources.push_back({meshData->subMesh, meshData->alphas.has_value(), meshData->wrinkles.has_value()});
+		}
+		if(cached) {
+			cached->mesh = mesh;
+			for(auto &meshData : entity.meshDatas)
+				cached->size += get_mesh_data_size(*meshData);
+			++m_modelCacheStats.misses;
+		}
+	}
 	auto renderMode = m_renderMode;
 	// Create the object using the mesh
 	auto &t = ent.GetPose();
@@ -419,10 +447,76 @@ unirender::PObject pragma::modules::cycles::Cache::AddEntity(BaseEntity &ent, st
 	}
 	o->SetUuid(ent.GetUuid());
 	o->SetName(util::uuid_to_string(ent.GetUuid()));
-	m_mdlCache->GetChunks().front().AddObject(*o);
+	AddObject(*o);
 	return o;
 }
 
+void pragma::modules::cycles::Cache::AddObject(unirender::Object &o)
+{
+	m_mdlCache->GetChunks().front().AddObject(o);
+	// If multiple objects share a name or uuid, the first one wins, same as the previous linear search
+	m_objectsByName.insert(std::make_pair(o.GetName(), &o));
+	m_objectsByUuid.insert(std::make_pair(o.GetUuid(), &o));
+}
+
+unirender::Object *pragma::modules::cycles::Cache::FindObject(const std::string &name) const
+{
+	auto it = m_objectsByName.find(name);
+	return (it != m_objectsByName.end()) ? it->second : nullptr;
+}
+
+unirender::Object *pragma::modules::cycles::Cache::FindObjectByUuid(const util::Uuid &uuid) const
+{
+	auto it = m_objectsByUuid.find(uuid);
+	return (it != m_objectsByUuid.end()) ? it->second : nullptr;
+}
+
+unirender::PObject pragma::modules::cycles::Cache::AddEntity(BaseEntity &ent, std::vector<ModelSubMesh *> *optOutTargetMeshes, const std::function<bool(ModelMesh &, const umath::ScaledTransform &)> &meshFilter,
+  const std::function<bool(ModelSubMesh &, const umath::ScaledTransform &)> &subMeshFilter, const std::string &nameSuffix)
+{
+	PendingEntity entity {};
+	if(PrepareEntity(ent, optOutTargetMeshes, meshFilter, subMeshFilter, nameSuffix, entity) == false)
+		return nullptr;
+	return FinalizeEntity(entity);
+}
+
+std::vector<unirender::PObject> pragma::modules::cycles::Cache::AddEntities(const std::vector<EntityInfo> &entities, uint32_t numThreads)
+{
+	// Shader creation may call into Lua, so everything except for the mesh data has to be prepared
+	// on this thread. The expensive mesh data calculations are deferred and run in parallel afterwards.
+	std::vector<PendingEntity> pendingEntities;
+	pendingEntities.reserve(entities.size());
+	std::vector<MeshDataJob> jobs;
+	m_deferredMeshDataJobs = &jobs;
+	for(auto &entInfo : entities) {
+		pendingEntities.push_back({});
+		if(PrepareEntity(*entInfo.entity, nullptr, entInfo.meshFilter, nullptr, "", pendingEntities.back()) == false)
+			pendingEntities.pop_back();
+	}
+	m_deferredMeshDataJobs = nullptr;
+
+	// All engine data the jobs depend on has been gathered above (see GatherMeshDataInput). The jobs only read the vertex and index
+	// buffers of the sub-meshes, which don't change while the calling thread is blocked here.
+	// Meshes that are large enough are subdivided on multiple threads as well, so every job only gets its share of the threads
+	// to avoid running numThreads^2 threads at once. The thread budget only affects the speed, subdivide_mesh picks its refinement
+	// path from the mesh alone, so the result is the same as with AddEntity.
+	if(numThreads == 0)
+		numThreads = get_default_thread_count();
+	auto numPoolThreads = static_cast<uint32_t>(std::max<size_t>(std::min<size_t>(numThreads, jobs.size()), 1));
+	auto numThreadsPerJob = std::max(numThreads / numPoolThreads, 1u);
+	parallel_for(jobs.size(), [this, &jobs, numThreadsPerJob](size_t i) { RunMeshDataJob(jobs[i], numThreadsPerJob); }, numPoolThreads);
+
+	// Meshes and objects are added in the original order to keep the scene deterministic
+	std::vector<unirender::PObject> objects;
+	objects.reserve(pendingEntities.size());
+	for(auto &entity : pendingEntities) {
+		auto o = FinalizeEntity(entity);
+		if(o)
+			objects.push_back(o);
+	}
+	return objects;
+}
+
 static bool load_hair_strand_data(util::HairStrandData &strandData, const udm::LinkedPropertyWrapper &data, std::string &outErr)
 {
 	//if(data.GetAssetType() != "PHD" || data.GetAssetVersion() < 1)
@@ -438,23 +532,285 @@ static bool load_hair_strand_data(util::HairStrandData &strandData, const udm::L
 	return true;
 }
 
-std::shared_ptr<pragma::modules::cycles::Cache::MeshData> pragma::modules::cycles::Cache::CalcMeshData(Model &mdl, ModelSubMesh &mdlMesh, bool includeAlphas, bool includeWrinkles, pragma::CModelComponent *optMdlC, pragma::CAnimatedComponent *optAnimC)
+// Subdivided meshes are stored as a fixed-size header followed by the raw vertex, index, alpha and wrinkle arrays,
+// so the data can be read (or memory-mapped) without any parsing.
+enum class SubdivisionCacheFlags : uint32_t { None = 0u, HasAlphas = 1u, HasWrinkles = HasAlphas << 1u };
+REGISTER_BASIC_BITWISE_OPERATORS(SubdivisionCacheFlags)
+struct SubdivisionCacheHeader {
+	std::array<char, 4> magic;
+	uint32_t version;
+	uint64_t numVertices;
+	uint64_t numIndices;
+	SubdivisionCacheFlags flags;
+	uint32_t reserved;
+};
+static_assert(sizeof(SubdivisionCacheHeader) == 32);
+static constexpr std::array<char, 4> SUBDIVISION_CACHE_MAGIC = {'P', 'S', 'D', 'C'};
+static constexpr uint32_t SUBDIVISION_CACHE_VERSION = 1;
+static std::mutex g_subdivisionCacheMutex;
+static std::unordered_set<std::string> g_subdivisionCacheFilesInUse;
+
+static constexpr const char *SUBDIVISION_CACHE_PATH = "cache/unirender/subdivision/";
+static std::atomic<uint64_t> g_subdivisionCacheSizeLimit = 2'147'483'648; // 2 GiB
+static std::mutex g_subdivisionCacheTrimMutex;
+
+static std::string get_subdivision_cache_path(const pragma::modules::cycles::Hash128 &hash) { return SUBDIVISION_CACHE_PATH + hash.ToString() + ".bin"; }
+static std::string get_subdivision_cache_abs_path(const std::string &path) { return util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + path; }
+
+// Claims a cache file for the lifetime of the object. The mutex is only held to claim and release the file, not during the file I/O,
+// so mesh data jobs only wait on each other if they access the same file, in which case the file is treated as a cache miss instead.
+class SubdivisionCacheFileClaim {
+  public:
+	SubdivisionCacheFileClaim(const std::string &path) : m_path {path}
+	{
+		std::scoped_lock lock {g_subdivisionCacheMutex};
+		m_claimed = g_subdivisionCacheFilesInUse.insert(m_path).second;
+	}
+	~SubdivisionCacheFileClaim()
+	{
+		if(!m_claimed)
+			return;
+		std::scoped_lock lock {g_subdivisionCacheMutex};
+		g_subdivisionCacheFilesInUse.erase(m_path);
+	}
+	bool IsClaimed() const { return m_claimed; }
+  private:
+	std::string m_path;
+	bool m_claimed = false;
+};
+
+static bool load_cached_subdivision(const pragma::modules::cycles::Hash128 &hash, pragma::modules::cycles::Cache::MeshData &meshData, bool hasAlphas, bool hasWrinkles)
 {
-	auto meshData = std::make_shared<MeshData>();
-	auto &meshVerts = mdlMesh.GetVertices();
-	auto &meshAlphas = mdlMesh.GetAlphas();
+	auto path = get_subdivision_cache_path(hash);
+	SubdivisionCacheFileClaim claim {path};
+	if(!claim.IsClaimed())
+		return false;
+	auto f = FileManager::OpenFile(path.c_str(), "rb");
+	if(f == nullptr)
+		return false;
+	SubdivisionCacheHeader header {};
+	if(f->Read(&header, sizeof(header)) != sizeof(header) || header.magic != SUBDIVISION_CACHE_MAGIC || header.version != SUBDIVISION_CACHE_VERSION)
+		return false;
+	if(umath::is_flag_set(header.flags, SubdivisionCacheFlags::HasAlphas) != hasAlphas || umath::is_flag_set(header.flags, SubdivisionCacheFlags::HasWrinkles) != hasWrinkles)
+		return false;
+	auto expectedSize = sizeof(header) + header.numVertices * sizeof(umath::Vertex) + header.numIndices * sizeof(int32_t);
+	if(hasAlphas)
+		expectedSize += header.numVertices * sizeof(float);
+	if(hasWrinkles)
+		expectedSize += header.numVertices * sizeof(float);
+	if(f->GetSize() != expectedSize)
+		return false; // Incomplete or corrupt file
+	meshData.vertices.resize(header.numVertices);
+	f->Read(meshData.vertices.data(), meshData.vertices.size() * sizeof(meshData.vertices.front()));
+	meshData.triangles.resize(header.numIndices);
+	f->Read(meshData.triangles.data(), meshData.triangles.size() * sizeof(meshData.triangles.front()));
+	if(hasAlphas) {
+		meshData.alphas = std::vector<float>(header.numVertices);
+		f->Read(meshData.alphas->data(), meshData.alphas->size() * sizeof(float));
+	}
+	if(hasWrinkles) {
+		meshData.wrinkles = std::vector<float>(header.numVertices);
+		f->Read(meshData.wrinkles->data(), meshData.wrinkles->size() * sizeof(float));
+	}
+	f = nullptr;
+	// The write time doubles as the time of the last use, which determines the order in which files are removed (see trim_subdivision_cache)
+	std::error_code ec;
+	std::filesystem::last_write_time(get_subdivision_cache_abs_path(path), std::filesystem::file_time_type::clock::now(), ec);
+	return true;
+}
+
+static void save_cached_subdivision(const pragma::modules::cycles::Hash128 &hash, const pragma::modules::cycles::Cache::MeshData &meshData)
+{
+	SubdivisionCacheHeader header {};
+	header.magic = SUBDIVISION_CACHE_MAGIC;
+	header.version = SUBDIVISION_CACHE_VERSION;
+	header.numVertices = meshData.vertices.size();
+	header.numIndices = meshData.triangles.size();
+	header.flags = SubdivisionCacheFlags::None;
+	if(meshData.alphas.has_value()) {
+		if(meshData.alphas->size() != meshData.vertices.size())
+			return;
+		header.flags |= SubdivisionCacheFlags::HasAlphas;
+	}
+	if(meshData.wrinkles.has_value()) {
+		if(meshData.wrinkles->size() != meshData.vertices.size())
+			return;
+		header.flags |= SubdivisionCacheFlags::HasWrinkles;
+	}
+
+	auto path = get_subdivision_cache_path(hash);
+	SubdivisionCacheFileClaim claim {path};
+	if(!claim.IsClaimed())
+		return;
+	FileManager::CreatePath(ufile::get_path_from_filename(path).c_str());
+	auto f = FileManager::OpenFile<VFilePtrReal>(path.c_str(), "wb");
+	if(f == nullptr)
+		return;
+	f->Write(&header, sizeof(header));
+	f->Write(meshData.vertices.data(), meshData.vertices.size() * sizeof(meshData.vertices.front()));
+	f->Write(meshData.triangles.data(), meshData.triangles.size() * sizeof(meshData.triangles.front()));
+	if(meshData.alphas.has_value())
+		f->Write(meshData.alphas->data(), meshData.alphas->size() * sizeof(float));
+	if(meshData.wrinkles.has_value())
+		f->Write(meshData.wrinkles->data(), meshData.wrinkles->size() * sizeof(float));
+}
+
+// Removes the least recently used cache files until the cache is no larger than maxSize. Files that are currently being read or written are kept.
+static void trim_subdivision_cache(uint64_t maxSize)
+{
+	std::scoped_lock trimLock {g_subdivisionCacheTrimMutex};
+	struct CacheFile {
+		std::string fileName;
+		uint64_t size = 0;
+		std::filesystem::file_time_type lastUse {};
+	};
+	std::vector<CacheFile> files;
+	uint64_t totalSize = 0;
+	std::error_code ec;
+	auto absPath = get_subdivision_cache_abs_path(SUBDIVISION_CACHE_PATH);
+	for(std::filesystem::directory_iterator it {absPath, ec}, end; !ec && it != end; it.increment(ec)) {
+		auto &entry = *it;
+		if(entry.path().extension() != ".bin" || !entry.is_regular_file(ec))
+			continue;
+		CacheFile file {};
+		file.fileName = entry.path().filename().string();
+		file.size = entry.file_size(ec);
+		if(ec)
+			continue;
+		file.lastUse = entry.last_write_time(ec);
+		if(ec)
+			continue;
+		totalSize += file.size;
+		files.push_back(std::move(file));
+	}
+	if(totalSize <= maxSize)
+		return;
+	std::sort(files.begin(), files.end(), [](const CacheFile &a, const CacheFile &b) { return a.lastUse < b.lastUse; });
+	for(auto &file : files) {
+		if(totalSize <= maxSize)
+			break;
+		auto path = SUBDIVISION_CACHE_PATH + file.fileName;
+		SubdivisionCacheFileClaim claim {path};
+		if(!claim.IsClaimed())
+			continue;
+		if(std::filesystem::remove(get_subdivision_cache_abs_path(path), ec))
+			totalSize -= file.size;
+	}
+}
+
+void pragma::modules::cycles::set_subdivision_cache_size_limit(uint64_t limit)
+{
+	g_subdivisionCacheSizeLimit = limit;
+	if(limit > 0)
+		trim_subdivision_cache(limit);
+}
+uint64_t pragma::modules::cycles::get_subdivision_cache_size_limit() { return g_subdivisionCacheSizeLimit; }
+void pragma::modules::cycles::clear_subdivision_cache() { trim_subdivision_cache(0); }
+
+uint32_t pragma::modules::cycles::Cache::CalcSubdivisionLevel(uint32_t staticLevel, const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &indices, const std::optional<umath::ScaledTransform> &worldPose) const
+{
+	auto subdivLevel = staticLevel;
+	if(subdivLevel == 0 || m_adaptiveSubdivisionSettings.has_value() == false || m_viewInfo.has_value() == false || m_viewInfo->resolutionWidth == 0 || indices.size() < 3)
+		return subdivLevel;
+	auto &settings = *m_adaptiveSubdivisionSettings;
+	auto &viewInfo = *m_viewInfo;
+
+	// Mean edge length and bounding sphere of the mesh in world space
+	double edgeLengthSum = 0.0;
+	for(auto i = decltype(indices.size()) {0u}; i + 2 < indices.size(); i += 3) {
+		auto &v0 = verts[indices[i]].position;
+		auto &v1 = verts[indices[i + 1]].position;
+		auto &v2 = verts[indices[i + 2]].position;
+		edgeLengthSum += uvec::distance(v0, v1) + uvec::distance(v1, v2) + uvec::distance(v2, v0);
+	}
+	auto meanEdgeLength = static_cast<float>(edgeLengthSum / static_cast<double>(indices.size() - (indices.size() % 3)));
+	Vector3 min {std::numeric_limits<float>::max()};
+	Vector3 max {std::numeric_limits<float>::lowest()};
+	for(auto &v : verts) {
+		min = glm::min(min, v.position);
+		max = glm::max(max, v.position);
+	}
+	auto center = (min + max) * 0.5f;
+	auto radius = uvec::length(max - center);
+	if(worldPose.has_value()) {
+		auto &scale = worldPose->GetScale();
+		auto maxScale = umath::max(umath::abs(scale.x), umath::abs(scale.y), umath::abs(scale.z));
+		meanEdgeLength *= maxScale;
+		radius *= maxScale;
+		center = *worldPose * center;
+	}
+
+	// Projected length of an edge in pixels; Every subdivision level halves the edge length
+	auto distance = umath::max(uvec::distance(viewInfo.position, center) - radius, 1.f);
+	auto pixelsPerUnit = viewInfo.resolutionWidth / (2.f * distance * std::tan(umath::deg_to_rad(viewInfo.fov) * 0.5f));
+	auto edgeLengthPixels = meanEdgeLength * pixelsPerUnit;
+	if(edgeLengthPixels <= settings.targetEdgeLength)
+		return 0;
+	auto level = static_cast<uint32_t>(std::ceil(std::log2(edgeLengthPixels / settings.targetEdgeLength)));
+	return std::min(level, settings.maxLevel);
+}
+
+std::shared_ptr<const std::vector<Mat4>> pragma::modules::cycles::Cache::GetBonePalette(Model &mdl, pragma::CAnimatedComponent *optAnimC) const
+{
+	if(optAnimC == nullptr || unirender::Scene::IsRenderSceneMode(m_renderMode) == false)
+		return nullptr;
+	// Flexes are only applied by GetVertexTransformMatrix
+	if(mdl.GetVertexAnimations().empty() == false)
+		return nullptr;
+	return std::make_shared<const std::vector<Mat4>>(optAnimC->GetBoneMatrices());
+}
+
+pragma::modules::cycles::Cache::MeshDataInput pragma::modules::cycles::Cache::GatherMeshDataInput(Model &mdl, ModelSubMesh &mdlMesh, pragma::CAnimatedComponent *optAnimC, const std::shared_ptr<const std::vector<Mat4>> &bonePalette) const
+{
+	MeshDataInput input {};
+	mdl.GetExtensionData().GetFromPath("unirender/subdivision/level")(input.subdivisionLevel);
 
 	auto extData = mdlMesh.GetExtensionData();
 	auto udmHair = extData["hair"]["strandData"]["assetData"];
 	if(udmHair) {
-		meshData->hairStrandData = std::make_unique<util::HairStrandData>();
+		input.hairStrandData = std::make_unique<util::HairStrandData>();
 		std::string err;
-		if(!load_hair_strand_data(*meshData->hairStrandData, udmHair, err))
-			meshData->hairStrandData = nullptr;
+		if(!load_hair_strand_data(*input.hairStrandData, udmHair, err))
+			input.hairStrandData = nullptr;
+	}
+
+	// If we're baking something (e.g. ao map), we don't want to include the entity's animated pose
+	if(optAnimC == nullptr || unirender::Scene::IsRenderSceneMode(m_renderMode) == false)
+		return input;
+	auto numVerts = mdlMesh.GetVertices().size();
+	if(bonePalette && mdlMesh.GetExtendedVertexWeights().empty() && mdlMesh.GetVertexWeights().size() == numVerts) {
+		input.bonePalette = bonePalette;
+		return input;
+	}
+	// The vertex matrices (including animations, flexes, etc.) have to be queried per vertex
+	input.vertexTransforms.resize(numVerts);
+	for(auto vertIdx = decltype(numVerts) {0u}; vertIdx < numVerts; ++vertIdx) {
+		auto &t = input.vertexTransforms[vertIdx];
+		auto transformMat = optAnimC->GetVertexTransformMatrix(mdlMesh, vertIdx, &t.normalOffset, &t.wrinkle);
+		if(transformMat.has_value() == false)
+			continue;
+		t.matrix = *transformMat;
+		t.transformed = true;
 	}
+	return input;
+}
+
+std::shared_ptr<pragma::modules::cycles::Cache::MeshData> pragma::modules::cycles::Cache::CalcMeshData(Model &mdl, ModelSubMesh &mdlMesh, bool includeAlphas, bool includeWrinkles, pragma::CModelComponent *optMdlC, pragma::CAnimatedComponent *optAnimC,
+  const std::optional<umath::ScaledTransform> &worldPose)
+{
+	auto input = GatherMeshDataInput(mdl, mdlMesh, optAnimC, GetBonePalette(mdl, optAnimC));
+	return CalcMeshData(mdlMesh, input, includeAlphas, includeWrinkles, worldPose, 0);
+}
+
+std::shared_ptr<pragma::modules::cycles::Cache::MeshData> pragma::modules::cycles::Cache::CalcMeshData(ModelSubMesh &mdlMesh, MeshDataInput &input, bool includeAlphas, bool includeWrinkles, const std::optional<umath::ScaledTransform> &worldPose, uint32_t numThreads) const
+{
+	auto meshData = std::make_shared<MeshData>();
+	auto &meshVerts = mdlMesh.GetVertices();
+	auto &meshAlphas = mdlMesh.GetAlphas();
+	meshData->hairStrandData = std::move(input.hairStrandData);
 
 	std::vector<umath::Vertex> transformedVerts {};
-	transformedVerts.reserve(meshVerts.size());
+	transformedVerts.resize(meshVerts.size());
 
 	std::optional<std::vector<float>> alphas {};
 	if(includeAlphas) {
@@ -463,57 +819,53 @@ std::shared_ptr<pragma::modules::cycles::Cache::MeshData> pragma::modules::cycle
 	}
 
 	std::optional<std::vector<float>> wrinkles {};
-	if(includeWrinkles) {
+	if(includeWrinkles)
 		wrinkles = std::vector<float> {};
-		wrinkles->reserve(meshVerts.size());
-	}
-
-	for(auto vertIdx = decltype(meshVerts.size()) {0u}; vertIdx < meshVerts.size(); ++vertIdx) {
-		auto &v = meshVerts.at(vertIdx);
-		if(unirender::Scene::IsRenderSceneMode(m_renderMode)) {
-			// TODO: Do we really need the tangent?
-			Vector3 normalOffset {};
-			float wrinkle = 0.f;
-			auto transformMat = optAnimC ? optAnimC->GetVertexTransformMatrix(mdlMesh, vertIdx, &normalOffset, &wrinkle) : std::optional<Mat4> {};
-			if(transformMat.has_value()) {
-				// Apply vertex matrix (including animations, flexes, etc.)
-				auto vpos = *transformMat * Vector4 {v.position.x, v.position.y, v.position.z, 1.f};
-				auto vn = *transformMat * Vector4 {v.normal.x, v.normal.y, v.normal.z, 0.f};
-				auto vt = *transformMat * Vector4 {v.tangent.x, v.tangent.y, v.tangent.z, 0.f};
-
-				transformedVerts.push_back({});
-				auto &vTransformed = transformedVerts.back();
-
-				auto &pos = vTransformed.position;
-				pos = {vpos.x, vpos.y, vpos.z};
-				pos /= vpos.w;
-
-				auto &n = vTransformed.normal;
-				n = {vn.x, vn.y, vn.z};
-				n += normalOffset;
-				uvec::normalize(&n);
-
-				auto &t = vTransformed.tangent;
-				Vector3 nt = {vt.x, vt.y, vt.z};
-				nt += normalOffset;
-				uvec::normalize(&nt);
-				t = {nt, t.w};
-
-				vTransformed.uv = v.uv;
-			}
-			else
-				transformedVerts.push_back(v);
-			if(includeWrinkles)
-				wrinkles->push_back(wrinkle);
+
+	if(unirender::Scene::IsRenderSceneMode(m_renderMode)) {
+		if(includeWrinkles)
+			wrinkles->resize(meshVerts.size(), 0.f);
+		if(input.bonePalette) {
+			auto &palette = *input.bonePalette;
+			skin_vertices(meshVerts.data(), mdlMesh.GetVertexWeights().data(), meshVerts.size(), palette.data(), static_cast<uint32_t>(palette.size()), transformedVerts.data());
 		}
-		else {
-			// We're probably baking something (e.g. ao map), so we don't want to include the entity's animated pose.
-			transformedVerts.push_back(v);
+		else if(input.vertexTransforms.size() == meshVerts.size()) {
+			// The transformations are applied in blocks to keep the batched path busy
+			constexpr size_t blockSize = 256;
+			std::vector<Mat4> matrices(blockSize);
+			std::vector<Vector3> normalOffsets(blockSize);
+			std::vector<uint32_t> blockIndices(blockSize);
+			for(auto blockStart = decltype(meshVerts.size()) {0u}; blockStart < meshVerts.size(); blockStart += blockSize) {
+				auto blockEnd = std::min(blockStart + blockSize, meshVerts.size());
+				size_t numTransformed = 0;
+				for(auto vertIdx = blockStart; vertIdx < blockEnd; ++vertIdx) {
+					auto &t = input.vertexTransforms[vertIdx];
+					if(includeWrinkles)
+						(*wrinkles)[vertIdx] = t.wrinkle;
+					if(t.transformed == false) {
+						transformedVerts[vertIdx] = meshVerts[vertIdx];
+						continue;
+					}
+					matrices[numTransformed] = t.matrix;
+					normalOffsets[numTransformed] = t.normalOffset;
+					blockIndices[numTransformed] = vertIdx;
+					++numTransformed;
+				}
+				transform_vertices(meshVerts.data(), blockIndices.data(), matrices.data(), normalOffsets.data(), numTransformed, transformedVerts.data());
+			}
 		}
+		else
+			std::copy(meshVerts.begin(), meshVerts.end(), transformedVerts.begin());
+	}
+	else {
+		// We're probably baking something (e.g. ao map), so we don't want to include the entity's animated pose.
+		std::copy(meshVerts.begin(), meshVerts.end(), transformedVerts.begin());
+	}
 
-		if(includeAlphas) {
+	if(includeAlphas) {
+		for(auto vertIdx = decltype(meshVerts.size()) {0u}; vertIdx < meshVerts.size(); ++vertIdx) {
 			auto alpha = (vertIdx < meshAlphas.size()) ? meshAlphas.at(vertIdx).x : 0.f;
-			meshData->alphas->push_back(alpha);
+			alphas->push_back(alpha);
 		}
 	}
 
@@ -525,51 +877,56 @@ std::shared_ptr<pragma::modules::cycles::Cache::MeshData> pragma::modules::cycle
 	});
 
 	// Subdivision
-	auto udmExtData = mdl.GetExtensionData();
-	uint32_t subdivLevel = 0;
-	udmExtData.GetFromPath("unirender/subdivision/level")(subdivLevel);
+	auto subdivLevel = CalcSubdivisionLevel(input.subdivisionLevel, transformedVerts, indices, worldPose);
+	std::optional<Hash128> subdivHash {};
+	// Subdivision is expensive, so the result is cached on disk, keyed by the input data. Deformed meshes are not cached, since their
+	// vertices change with every pose and the cache would grow without bound. For all other meshes the vertices are the rest pose.
+	auto isDeformed = (input.bonePalette != nullptr || input.vertexTransforms.empty() == false);
+	if(subdivLevel > 0 && !isDeformed) {
+		Hasher hasher {};
+		hasher.Add(SUBDIVISION_CACHE_VERSION).Add(subdivLevel).Add(transformedVerts).Add(indices);
+		hasher.Add<uint8_t>(alphas.has_value()).Add<uint8_t>(wrinkles.has_value());
+		if(alphas.has_value())
+			hasher.Add(*alphas);
+		if(wrinkles.has_value())
+			hasher.Add(*wrinkles);
+		subdivHash = hasher.GetHash();
+		if(load_cached_subdivision(*subdivHash, *meshData, alphas.has_value(), wrinkles.has_value()))
+			return meshData;
+	}
 	if(subdivLevel > 0) {
 		std::vector<std::shared_ptr<BaseChannelData>> customAttributes {};
 		customAttributes.reserve(2);
 
-		std::vector<float> perFaceAlphaData {};
+		std::shared_ptr<ChannelData<OsdFloatAttr>> alphaData = nullptr;
 		if(alphas.has_value()) {
-			auto alphaData = std::make_shared<ChannelData<OsdFloatAttr>>([&perFaceAlphaData](BaseChannelData &cd, FaceVertexIndex faceVertexIndex, umath::Vertex &v, int idx) { perFaceAlphaData.at(faceVertexIndex) = static_cast<OsdFloatAttr *>(cd.GetElementPtr(idx))->value; },
-			  [&perFaceAlphaData](uint32_t numFaces) { perFaceAlphaData.resize(numFaces * 3); });
-			alphaData->ReserveBuffer(meshData->vertices.size());
-
+			alphaData = std::make_shared<ChannelData<OsdFloatAttr>>();
+			alphaData->ReserveBuffer(alphas->size());
 			for(auto alpha : *alphas)
 				alphaData->buffer.push_back(alpha);
 			customAttributes.push_back(alphaData);
 		}
 
-		std::vector<float> perFaceWrinkleData {};
+		std::shared_ptr<ChannelData<OsdFloatAttr>> wrinkleData = nullptr;
 		if(wrinkles.has_value()) {
-			auto wrinkleData = std::make_shared<ChannelData<OsdFloatAttr>>([&perFaceWrinkleData](BaseChannelData &cd, FaceVertexIndex faceVertexIndex, umath::Vertex &v, int idx) { perFaceWrinkleData.at(faceVertexIndex) = static_cast<OsdFloatAttr *>(cd.GetElementPtr(idx))->value; },
-			  [&perFaceWrinkleData](uint32_t numFaces) { perFaceWrinkleData.resize(numFaces * 3); });
-			wrinkleData->ReserveBuffer(meshData->vertices.size());
-
+			wrinkleData = std::make_shared<ChannelData<OsdFloatAttr>>();
+			wrinkleData->ReserveBuffer(wrinkles->size());
 			for(auto wrinkle : *wrinkles)
 				wrinkleData->buffer.push_back(wrinkle);
 			customAttributes.push_back(wrinkleData);
 		}
-		subdivide_mesh(transformedVerts, indices, meshData->vertices, meshData->triangles, subdivLevel, customAttributes);
-
-		if(alphas.has_value()) {
-			meshData->alphas = std::vector<float> {};
-			meshData->alphas->resize(meshData->vertices.size());
-			for(auto i = decltype(meshData->triangles.size()) {0u}; i < meshData->triangles.size(); ++i) {
-				auto idx = meshData->triangles.at(i);
-				meshData->alphas->at(idx) = perFaceAlphaData.at(i);
-			}
-		}
-		if(wrinkles.has_value()) {
-			meshData->wrinkles = std::vector<float> {};
-			meshData->wrinkles->resize(meshData->vertices.size());
-			for(auto i = decltype(meshData->triangles.size()) {0u}; i < meshData->triangles.size(); ++i) {
-				auto idx = meshData->triangles.at(i);
-				meshData->wrinkles->at(idx) = perFaceWrinkleData.at(i);
-			}
+		subdivide_mesh(transformedVerts, indices, meshData->vertices, meshData->triangles, subdivLevel, customAttributes, numThreads);
+
+		// The subdivided mesh has one vertex per face-vertex, so the per face-vertex results can be used as-is
+		if(alphaData)
+			meshData->alphas = std::move(alphaData->result);
+		if(wrinkleData)
+			meshData->wrinkles = std::move(wrinkleData->result);
+		if(subdivHash.has_value()) {
+			save_cached_subdivision(*subdivHash, *meshData);
+			auto sizeLimit = g_subdivisionCacheSizeLimit.load();
+			if(sizeLimit > 0)
+				trim_subdivision_cache(sizeLimit);
 		}
 	}
 	else {
@@ -604,14 +961,37 @@ Material *pragma::modules::cycles::Cache::GetMaterial(pragma::CModelComponent &m
 	return mdlC.GetRenderMaterial(baseTexIdx, skinId);
 }
 
-unirender::PShader pragma::modules::cycles::Cache::CreateShader(const std::string &meshName, Model &mdl, ModelSubMesh &subMesh, BaseEntity *optEnt, uint32_t skinId) const
+static void wait_for_textures(msys::TextureManager &texManager, const ds::Block &block)
 {
-	// Make sure all textures have finished loading
-	static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager().WaitForAllPendingCompleted();
+	auto *data = block.GetData();
+	if(data == nullptr)
+		return;
+	for(auto &[key, val] : *data) {
+		if(val == nullptr)
+			continue;
+		if(val->IsBlock()) {
+			wait_for_textures(texManager, static_cast<const ds::Block &>(*val));
+			continue;
+		}
+		if(typeid(*val) != typeid(ds::Texture))
+			continue;
+		auto &texInfo = static_cast<const ds::Texture &>(*val).GetValue();
+		auto tex = std::static_pointer_cast<Texture>(texInfo.texture);
+		if(tex && tex->IsLoaded())
+			continue;
+		// Loads the texture immediately, or waits for it if it's already being loaded in the background
+		texManager.LoadAsset(texInfo.name);
+	}
+}
 
+unirender::PShader pragma::modules::cycles::Cache::CreateShader(const std::string &meshName, Model &mdl, ModelSubMesh &subMesh, BaseEntity *optEnt, uint32_t skinId) const
+{
 	auto *mat = optEnt ? GetMaterial(*optEnt, subMesh, skinId) : GetMaterial(mdl, subMesh, skinId);
 	if(mat == nullptr)
 		return nullptr;
+	// Make sure the textures of this material have finished loading. Other pending texture loads don't concern us.
+	if(m_materialToShader.find(mat) == m_materialToShader.end())
+		wait_for_textures(static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager(), *mat->GetDataBlock());
 	ShaderInfo shaderInfo {};
 	if(optEnt)
 		shaderInfo.entity = optEnt;
@@ -646,33 +1026,54 @@ unirender::PMesh pragma::modules::cycles::Cache::BuildMesh(const std::string &me
 	if(hasWrinkles)
 		flags |= unirender::Mesh::Flags::HasWrinkles;
 	auto mesh = unirender::Mesh::Create(meshName, numVerts, numTris / 3, flags);
+	if(hasAlphas)
+		mesh->GetAlphas().reserve(numVerts);
+	if(hasWrinkles)
+		mesh->GetWrinkleFactors().reserve(numVerts);
 	m_mdlCache->GetChunks().front().AddMesh(*mesh);
 	for(auto &meshData : meshDatas)
 		AddMeshDataToMesh(*mesh, *meshData, pose);
 	return mesh;
 }
 
+static void add_vertices(unirender::Mesh &mesh, const umath::Vertex *verts, size_t numVerts, const std::optional<umath::ScaledTransform> &pose)
+{
+	if(pose.has_value() == false) {
+		for(auto *v = verts, *vEnd = verts + numVerts; v != vEnd; ++v)
+			mesh.AddVertex(v->position, v->normal, v->tangent, v->uv);
+		return;
+	}
+	// Collapse the pose into a single matrix instead of applying scale, rotation and translation separately per vertex
+	auto m = glm::mat3_cast(pose->GetRotation());
+	auto &scale = pose->GetScale();
+	m[0] *= scale.x;
+	m[1] *= scale.y;
+	m[2] *= scale.z;
+	auto &origin = pose->GetOrigin();
+	for(auto *v = verts, *vEnd = verts + numVerts; v != vEnd; ++v)
+		mesh.AddVertex(m * v->position + origin, v->normal, v->tangent, v->uv);
+}
+
+static void add_triangles(unirender::Mesh &mesh, const int32_t *indices, size_t numIndices, uint32_t vertexOffset, uint32_t shaderIdx)
+{
+	for(auto *idx = indices, *idxEnd = indices + numIndices; idx != idxEnd; idx += 3)
+		mesh.AddTriangle(vertexOffset + idx[0], vertexOffset + idx[1], vertexOffset + idx[2], shaderIdx);
+}
+
 void pragma::modules::cycles::Cache::AddMeshDataToMesh(unirender::Mesh &mesh, const MeshData &meshData, const std::optional<umath::ScaledTransform> &pose) const
 {
 	auto triIndexVertexOffset = mesh.GetVertexOffset();
 	auto shaderIdx = mesh.AddSubMeshShader(*meshData.shader);
-	for(auto &v : meshData.vertices) {
-		auto pos = v.position;
-		if(pose.has_value())
-			pos = *pose * pos;
-		mesh.AddVertex(pos, v.normal, v.tangent, v.uv);
-	}
-
-	for(auto i = decltype(meshData.triangles.size()) {0u}; i < meshData.triangles.size(); i += 3)
-		mesh.AddTriangle(triIndexVertexOffset + meshData.triangles.at(i), triIndexVertexOffset + meshData.triangles.at(i + 1), triIndexVertexOffset + meshData.triangles.at(i + 2), shaderIdx);
+	add_vertices(mesh, meshData.vertices.data(), meshData.vertices.size(), pose);
+	add_triangles(mesh, meshData.triangles.data(), meshData.triangles.size() - (meshData.triangles.size() % 3), triIndexVertexOffset, shaderIdx);
 
 	if(meshData.wrinkles.has_value()) {
-		for(auto wrinkle : *meshData.wrinkles)
-			mesh.AddWrinkleFactor(wrinkle);
+		auto &wrinkles = mesh.GetWrinkleFactors();
+		wrinkles.insert(wrinkles.end(), meshData.wrinkles->begin(), meshData.wrinkles->end());
 	}
 	if(meshData.alphas.has_value()) {
-		for(auto alpha : *meshData.alphas)
-			mesh.AddAlpha(alpha);
+		auto &alphas = mesh.GetAlphas();
+		alphas.insert(alphas.end(), meshData.alphas->begin(), meshData.alphas->end());
 	}
 	if(meshData.hairStrandData)
 		mesh.AddHairStrandData(*meshData.hairStrandData, shaderIdx);
@@ -702,7 +1103,7 @@ void pragma::modules::cycles::Cache::AddAOBakeTarget(BaseEntity *optEnt, Model &
 	// This way we can map the uv coordinates to the ao output texture more easily.
 	auto mesh = BuildMesh("ao_target", materialMeshes);
 	oAo = unirender::Object::Create(*mesh);
-	m_mdlCache->GetChunks().front().AddObject(*oAo);
+	AddObject(*oAo);
 
 	oEnv = nullptr;
 	if(envMeshes.empty())
@@ -715,7 +1116,7 @@ void pragma::modules::cycles::Cache::AddAOBakeTarget(BaseEntity *optEnt, Model &
 	// The reason for this is currently unknown.
 	auto meshEnv = BuildMesh("ao_mesh", envMeshes);
 	oEnv = unirender::Object::Create(*meshEnv);
-	m_mdlCache->GetChunks().front().AddObject(*oEnv);
+	AddObject(*oEnv);
 }
 
 void pragma::modules::cycles::Cache::AddAOBakeTarget(BaseEntity &ent, uint32_t matIndex, std::shared_ptr<unirender::Object> &oAo, std::shared_ptr<unirender::Object> &oEnv)
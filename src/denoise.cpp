@@ -9,6 +9,18 @@
 #include <util_image_buffer.hpp>
 #include <sharedutils/util_parallel_job.hpp>
 #include "pr_cycles/scene.hpp"
+#include "pr_cycles/denoise.hpp"
+#include "pr_cycles/parallel.hpp"
+#include <sharedutils/util_file.h>
+#include <util_image.hpp>
+#include <fsys/filesystem.h>
+#include <fsys/ifile.hpp>
+#include <mutex>
+#include <cstring>
+
+// ccl happens to have the same include guard name as sharedutils, so we have to undef it here
+#undef __UTIL_STRING_H__
+#include <sharedutils/util_string.h>
 
 class DenoiseWorker : public util::ParallelWorker<std::shared_ptr<uimg::ImageBuffer>> {
   public:
@@ -37,3 +49,435 @@ DenoiseWorker::DenoiseWorker(uimg::ImageBuffer &imgBuffer) : m_imgBuffer {imgBuf
 std::shared_ptr<uimg::ImageBuffer> DenoiseWorker::GetResult() { return m_imgBuffer; }
 
 util::ParallelJob<std::shared_ptr<uimg::ImageBuffer>> pragma::modules::cycles::denoise(uimg::ImageBuffer &imgBuffer) { return util::create_parallel_job<DenoiseWorker>(imgBuffer); }
+
+static std::vector<std::pair<uint32_t, uint32_t>> get_tile_spans(uint32_t size, uint32_t tileSize)
+{
+	// Core spans partition the image, each boundary is then extended by the same amount on both sides
+	std::vector<std::pair<uint32_t, uint32_t>> cores;
+	for(uint32_t start = 0; start < size; start += tileSize)
+		cores.push_back({start, std::min(start + tileSize, size)});
+	return cores;
+}
+
+std::vector<pragma::modules::cycles::DenoiseTile> pragma::modules::cycles::get_denoise_tiles(uint32_t width, uint32_t height, const TiledDenoiseSettings &settings)
+{
+	auto tileSize = std::max(settings.tileSize, 1u);
+	// The overlap regions of the two sides of a tile must not intersect
+	auto overlap = std::min(settings.overlap, tileSize / 2);
+	auto coresX = get_tile_spans(width, tileSize);
+	auto coresY = get_tile_spans(height, tileSize);
+	auto getExtent = [overlap](const std::vector<std::pair<uint32_t, uint32_t>> &cores, size_t i0, size_t i1) -> uint32_t {
+		return std::min({overlap, cores[i0].second - cores[i0].first, cores[i1].second - cores[i1].first});
+	};
+	std::vector<DenoiseTile> tiles;
+	tiles.reserve(coresX.size() * coresY.size());
+	for(auto y = decltype(coresY.size()) {0u}; y < coresY.size(); ++y) {
+		auto top = (y > 0) ? getExtent(coresY, y - 1, y) : 0u;
+		auto bottom = (y < coresY.size() - 1) ? getExtent(coresY, y, y + 1) : 0u;
+		for(auto x = decltype(coresX.size()) {0u}; x < coresX.size(); ++x) {
+			auto left = (x > 0) ? getExtent(coresX, x - 1, x) : 0u;
+			auto right = (x < coresX.size() - 1) ? getExtent(coresX, x, x + 1) : 0u;
+			DenoiseTile tile {};
+			tile.x = coresX[x].first - left;
+			tile.y = coresY[y].first - top;
+			tile.w = coresX[x].second + right - tile.x;
+			tile.h = coresY[y].second + bottom - tile.y;
+			tile.overlapLeft = left * 2;
+			tile.overlapRight = right * 2;
+			tile.overlapTop = top * 2;
+			tile.overlapBottom = bottom * 2;
+			tiles.push_back(tile);
+		}
+	}
+	return tiles;
+}
+
+static float get_ramp_weight(uint32_t pos, uint32_t size, uint32_t overlapStart, uint32_t overlapEnd)
+{
+	if(pos < overlapStart)
+		return (pos + 0.5f) / overlapStart;
+	if(pos >= size - overlapEnd)
+		return (size - pos - 0.5f) / overlapEnd;
+	return 1.f;
+}
+
+float pragma::modules::cycles::get_denoise_tile_weight(const DenoiseTile &tile, uint32_t x, uint32_t y) { return get_ramp_weight(x, tile.w, tile.overlapLeft, tile.overlapRight) * get_ramp_weight(y, tile.h, tile.overlapTop, tile.overlapBottom); }
+
+static bool is_hdr_format(uimg::Format format) { return format != uimg::Format::RGBA8 && format != uimg::Format::RGB8; }
+
+static unirender::denoise::ImageData get_denoise_image_data(uimg::ImageBuffer &img)
+{
+	unirender::denoise::ImageData data {};
+	data.data = static_cast<uint8_t *>(img.GetData());
+	data.format = img.GetFormat();
+	return data;
+}
+
+// All images are expected to be RGB_FLOAT and of the same size. The albedo and normal images are optional.
+static bool denoise_image(unirender::denoise::Denoiser &denoiser, uimg::ImageBuffer &input, uimg::ImageBuffer &output, bool hdr, uimg::ImageBuffer *optAlbedo = nullptr, uimg::ImageBuffer *optNormal = nullptr)
+{
+	unirender::denoise::Info denoiseInfo {};
+	denoiseInfo.hdr = hdr;
+	denoiseInfo.width = input.GetWidth();
+	denoiseInfo.height = input.GetHeight();
+
+	unirender::denoise::ImageInputs inputs {};
+	inputs.beautyImage = get_denoise_image_data(input);
+	if(optAlbedo)
+		inputs.albedoImage = get_denoise_image_data(*optAlbedo);
+	if(optNormal)
+		inputs.normalImage = get_denoise_image_data(*optNormal);
+	auto outputData = get_denoise_image_data(output);
+	return denoiser.Denoise(denoiseInfo, inputs, outputData);
+}
+
+// Every denoiser keeps its device alive, so denoisers are only created for threads that don't have one yet and are reused afterwards
+class DenoiserPool {
+  public:
+	unirender::denoise::Denoiser &Acquire()
+	{
+		std::scoped_lock lock {m_mutex};
+		if(m_available.empty()) {
+			m_denoisers.push_back(std::make_unique<unirender::denoise::Denoiser>());
+			return *m_denoisers.back();
+		}
+		auto *denoiser = m_available.back();
+		m_available.pop_back();
+		return *denoiser;
+	}
+	void Release(unirender::denoise::Denoiser &denoiser)
+	{
+		std::scoped_lock lock {m_mutex};
+		m_available.push_back(&denoiser);
+	}
+  private:
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<unirender::denoise::Denoiser>> m_denoisers;
+	std::vector<unirender::denoise::Denoiser *> m_available;
+};
+
+class TiledDenoiseWorker : public util::ParallelWorker<std::shared_ptr<uimg::ImageBuffer>> {
+  public:
+	TiledDenoiseWorker(uimg::ImageBuffer &imgBuffer, const pragma::modules::cycles::TiledDenoiseSettings &settings, uimg::ImageBuffer *optAlbedo, uimg::ImageBuffer *optNormal);
+	using util::ParallelWorker<std::shared_ptr<uimg::ImageBuffer>>::Cancel;
+	virtual std::shared_ptr<uimg::ImageBuffer> GetResult() override;
+  private:
+	void Run();
+	std::shared_ptr<uimg::ImageBuffer> m_imgBuffer = nullptr;
+	std::shared_ptr<uimg::ImageBuffer> m_albedo = nullptr;
+	std::shared_ptr<uimg::ImageBuffer> m_normal = nullptr;
+	pragma::modules::cycles::TiledDenoiseSettings m_settings;
+	template<typename TJob, typename... TARGS>
+	friend util::ParallelJob<typename TJob::RESULT_TYPE> util::create_parallel_job(TARGS &&...args);
+};
+
+TiledDenoiseWorker::TiledDenoiseWorker(uimg::ImageBuffer &imgBuffer, const pragma::modules::cycles::TiledDenoiseSettings &settings, uimg::ImageBuffer *optAlbedo, uimg::ImageBuffer *optNormal)
+    : m_imgBuffer {imgBuffer.shared_from_this()}, m_albedo {optAlbedo ? optAlbedo->shared_from_this() : nullptr}, m_normal {optNormal ? optNormal->shared_from_this() : nullptr}, m_settings {settings}
+{
+	AddThread([this]() { Run(); });
+}
+
+static std::shared_ptr<uimg::ImageBuffer> to_float_image(const std::shared_ptr<uimg::ImageBuffer> &img, uimg::Format format)
+{
+	if(!img)
+		return nullptr;
+	auto copy = img->Copy();
+	copy->Convert(format);
+	return copy;
+}
+
+static std::shared_ptr<uimg::ImageBuffer> get_tile_image(const std::shared_ptr<uimg::ImageBuffer> &img, const pragma::modules::cycles::DenoiseTile &tile)
+{
+	if(!img)
+		return nullptr;
+	auto tileImg = uimg::ImageBuffer::Create(tile.w, tile.h, img->GetFormat());
+	img->Copy(*tileImg, tile.x, tile.y, 0, 0, tile.w, tile.h);
+	return tileImg;
+}
+
+void TiledDenoiseWorker::Run()
+{
+	auto w = m_imgBuffer->GetWidth();
+	auto h = m_imgBuffer->GetHeight();
+	if((m_albedo && (m_albedo->GetWidth() != w || m_albedo->GetHeight() != h)) || (m_normal && (m_normal->GetWidth() != w || m_normal->GetHeight() != h))) {
+		SetStatus(util::JobStatus::Failed, "Albedo and normal images must have the same size as the image!");
+		return;
+	}
+	// The color is denoised as RGB, the alpha channel of the image is left untouched
+	auto color = to_float_image(m_imgBuffer, uimg::Format::RGB_FLOAT);
+	auto albedo = to_float_image(m_albedo, uimg::Format::RGB_FLOAT);
+	auto normal = to_float_image(m_normal, uimg::Format::RGB_FLOAT);
+	auto hdr = is_hdr_format(m_imgBuffer->GetFormat());
+	auto tiles = pragma::modules::cycles::get_denoise_tiles(w, h, m_settings);
+	// Each thread needs its own denoiser, which already runs on multiple threads by itself. Only a few tiles are denoised at once,
+	// which is enough to overlap the tile copies with the denoising.
+	auto numThreads = (m_settings.numThreads > 0) ? m_settings.numThreads : std::min(pragma::modules::cycles::get_default_thread_count(), 2u);
+	DenoiserPool denoisers;
+
+	// Denoised tiles are accumulated with their blend weights, which sum up to 1 for every pixel
+	auto result = uimg::ImageBuffer::Create(w, h, uimg::Format::RGB_FLOAT);
+	auto *resultData = static_cast<float *>(result->GetData());
+	std::fill(resultData, resultData + static_cast<size_t>(w) * h * 3, 0.f);
+	std::mutex resultMutex;
+	size_t numTilesComplete = 0;
+	std::atomic<bool> failed = false;
+	pragma::modules::cycles::parallel_for(
+	  tiles.size(),
+	  [&](size_t i) {
+		  if(IsCancelled() || failed)
+			  return;
+		  auto &tile = tiles[i];
+		  auto tileImg = get_tile_image(color, tile);
+		  auto tileAlbedo = get_tile_image(albedo, tile);
+		  auto tileNormal = get_tile_image(normal, tile);
+		  auto tileResult = uimg::ImageBuffer::Create(tile.w, tile.h, uimg::Format::RGB_FLOAT);
+		  auto &denoiser = denoisers.Acquire();
+		  auto success = denoise_image(denoiser, *tileImg, *tileResult, hdr, tileAlbedo.get(), tileNormal.get());
+		  denoisers.Release(denoiser);
+		  if(!success) {
+			  failed = true;
+			  return;
+		  }
+		  auto *tileData = static_cast<const float *>(tileResult->GetData());
+
+		  std::scoped_lock lock {resultMutex};
+		  for(auto y = decltype(tile.h) {0u}; y < tile.h; ++y) {
+			  for(auto x = decltype(tile.w) {0u}; x < tile.w; ++x) {
+				  auto weight = pragma::modules::cycles::get_denoise_tile_weight(tile, x, y);
+				  auto *src = tileData + (static_cast<size_t>(y) * tile.w + x) * 3;
+				  auto *dst = resultData + (static_cast<size_t>(tile.y + y) * w + tile.x + x) * 3;
+				  for(uint8_t c = 0; c < 3; ++c)
+					  dst[c] += src[c] * weight;
+			  }
+		  }
+		  UpdateProgress(static_cast<float>(++numTilesComplete) / static_cast<float>(tiles.size()));
+	  },
+	  numThreads);
+	if(IsCancelled())
+		return;
+	if(failed) {
+		SetStatus(util::JobStatus::Failed);
+		return;
+	}
+
+	// The tile inputs aren't needed anymore, which keeps the peak memory usage down for large images
+	color = nullptr;
+	albedo = nullptr;
+	normal = nullptr;
+	result->Convert(m_imgBuffer->GetFormat());
+	if(!m_imgBuffer->HasAlphaChannel())
+		result->Copy(*m_imgBuffer, 0, 0, 0, 0, w, h);
+	else {
+		// Alpha is not denoised, so only the color channels are written back (alpha is always the last channel)
+		auto pixelSize = m_imgBuffer->GetPixelSize();
+		auto colorSize = pixelSize - m_imgBuffer->GetChannelSize();
+		auto *srcData = static_cast<const uint8_t *>(result->GetData());
+		auto *dstData = static_cast<uint8_t *>(m_imgBuffer->GetData());
+		for(size_t i = 0, n = static_cast<size_t>(w) * h; i < n; ++i)
+			std::memcpy(dstData + i * pixelSize, srcData + i * pixelSize, colorSize);
+	}
+	SetStatus(util::JobStatus::Successful);
+}
+std::shared_ptr<uimg::ImageBuffer> TiledDenoiseWorker::GetResult() { return m_imgBuffer; }
+
+util::ParallelJob<std::shared_ptr<uimg::ImageBuffer>> pragma::modules::cycles::denoise_tiled(uimg::ImageBuffer &imgBuffer, const TiledDenoiseSettings &settings, uimg::ImageBuffer *optAlbedo, uimg::ImageBuffer *optNormal)
+{
+	return util::create_parallel_job<TiledDenoiseWorker>(imgBuffer, settings, optAlbedo, optNormal);
+}
+
+static std::shared_ptr<uimg::ImageBuffer> load_image_file(const std::string &path)
+{
+	auto f = filemanager::open_file(path, filemanager::FileMode::Read | filemanager::FileMode::Binary);
+	if(!f)
+		return nullptr;
+	fsys::File fp {f};
+	return uimg::load_image(fp, uimg::PixelFormat::Float);
+}
+
+static bool save_image_file(const std::string &path, uimg::ImageBuffer &imgBuf)
+{
+	std::string ext;
+	if(ufile::get_extension(path, &ext) == false)
+		return false;
+	ustring::to_lower(ext);
+	uimg::ImageFormat format;
+	if(ext == "png")
+		format = uimg::ImageFormat::PNG;
+	else if(ext == "hdr")
+		format = uimg::ImageFormat::HDR;
+	else if(ext == "tga")
+		format = uimg::ImageFormat::TGA;
+	else if(ext == "bmp")
+		format = uimg::ImageFormat::BMP;
+	else if(ext == "jpg" || ext == "jpeg")
+		format = uimg::ImageFormat::JPG;
+	else
+		return false;
+	FileManager::CreatePath(ufile::get_path_from_filename(path).c_str());
+	auto f = filemanager::open_file(path, filemanager::FileMode::Write | filemanager::FileMode::Binary);
+	if(!f)
+		return false;
+	fsys::File fp {f};
+	return uimg::save_image(fp, imgBuf, format);
+}
+
+// The denoiser only processes the color, so the alpha channel of the original image is copied into the denoised RGB_FLOAT image
+static void restore_alpha(uimg::ImageBuffer &denoised, const uimg::ImageBuffer &original)
+{
+	if(!original.HasAlphaChannel())
+		return;
+	auto alpha = original.Copy();
+	alpha->Convert(uimg::Format::RGBA_FLOAT);
+	denoised.Convert(uimg::Format::RGBA_FLOAT);
+	auto *srcData = static_cast<const float *>(alpha->GetData());
+	auto *dstData = static_cast<float *>(denoised.GetData());
+	for(size_t i = 0, n = static_cast<size_t>(denoised.GetWidth()) * denoised.GetHeight(); i < n; ++i)
+		dstData[i * 4 + 3] = srcData[i * 4 + 3];
+}
+
+class SequenceDenoiseWorker : public util::ParallelWorker<uimg::ImageLayerSet> {
+  public:
+	SequenceDenoiseWorker(std::vector<pragma::modules::cycles::SequenceDenoiseFrame> &&frames, const pragma::modules::cycles::SequenceDenoiseSettings &settings);
+	using util::ParallelWorker<uimg::ImageLayerSet>::Cancel;
+	virtual uimg::ImageLayerSet GetResult() override;
+  private:
+	struct PendingFrame {
+		size_t index = 0;         // Index in m_frames
+		size_t sequenceIndex = 0; // See SequenceDenoiseFrame::index
+		std::shared_ptr<uimg::ImageBuffer> image = nullptr;
+		std::shared_ptr<uimg::ImageBuffer> denoisedImage = nullptr;
+		pragma::modules::cycles::TemporalFrameInfo temporalInfo {};
+	};
+	void Run();
+	bool DenoiseFrame(PendingFrame &frame);
+	std::vector<pragma::modules::cycles::SequenceDenoiseFrame> m_frames;
+	pragma::modules::cycles::SequenceDenoiseSettings m_settings;
+	// Kept alive for the entire sequence, so the denoiser state is only initialized once
+	unirender::denoise::Denoiser m_denoiser;
+	uimg::ImageLayerSet m_result;
+	template<typename TJob, typename... TARGS>
+	friend util::ParallelJob<typename TJob::RESULT_TYPE> util::create_parallel_job(TARGS &&...args);
+};
+
+SequenceDenoiseWorker::SequenceDenoiseWorker(std::vector<pragma::modules::cycles::SequenceDenoiseFrame> &&frames, const pragma::modules::cycles::SequenceDenoiseSettings &settings) : m_frames {std::move(frames)}, m_settings {settings}
+{
+	AddThread([this]() { Run(); });
+}
+
+bool SequenceDenoiseWorker::DenoiseFrame(PendingFrame &frame)
+{
+	auto &img = *frame.image;
+	auto input = img.Copy();
+	input->Convert(uimg::Format::RGB_FLOAT);
+	frame.denoisedImage = uimg::ImageBuffer::Create(img.GetWidth(), img.GetHeight(), uimg::Format::RGB_FLOAT);
+	return denoise_image(m_denoiser, *input, *frame.denoisedImage, is_hdr_format(img.GetFormat()));
+}
+
+void SequenceDenoiseWorker::Run()
+{
+	auto numFrames = m_frames.size();
+	pragma::modules::cycles::BoundedQueue<PendingFrame> loadedFrames {m_settings.maxFramesInFlight};
+	pragma::modules::cycles::BoundedQueue<PendingFrame> denoisedFrames {m_settings.maxFramesInFlight};
+	std::atomic<size_t> numFailed = 0;
+	// Every frame counts towards the progress once, regardless of which stage it finished or failed in
+	std::mutex progressMutex;
+	size_t numProcessed = 0;
+	auto onFrameProcessed = [&]() {
+		std::scoped_lock lock {progressMutex};
+		UpdateProgress(static_cast<float>(++numProcessed) / static_cast<float>(numFrames));
+	};
+
+	std::thread loader {[&]() {
+		for(auto i = decltype(numFrames) {0u}; i < numFrames && !IsCancelled(); ++i) {
+			auto &frame = m_frames[i];
+			PendingFrame pending {};
+			pending.index = i;
+			pending.sequenceIndex = frame.index.value_or(i);
+			pending.image = frame.image ? frame.image : load_image_file(frame.inputPath);
+			if(!pending.image) {
+				++numFailed;
+				onFrameProcessed();
+				continue;
+			}
+			pending.temporalInfo = frame.temporalInfo;
+			if(m_settings.temporal.has_value()) {
+				if(!pending.temporalInfo.motionVectors && !frame.motionVectorsPath.empty())
+					pending.temporalInfo.motionVectors = load_image_file(frame.motionVectorsPath);
+				if(!pending.temporalInfo.depth && !frame.depthPath.empty())
+					pending.temporalInfo.depth = load_image_file(frame.depthPath);
+			}
+			if(!loadedFrames.Push(std::move(pending)))
+				break;
+		}
+		loadedFrames.Close();
+	}};
+
+	std::mutex resultMutex;
+	std::thread writer {[&]() {
+		PendingFrame pending;
+		while(denoisedFrames.Pop(pending)) {
+			auto &frame = m_frames[pending.index];
+			auto success = true;
+			if(frame.image) {
+				auto &denoised = *pending.denoisedImage;
+				denoised.Convert(frame.image->GetFormat());
+				denoised.Copy(*frame.image, 0, 0, 0, 0, denoised.GetWidth(), denoised.GetHeight());
+				std::scoped_lock lock {resultMutex};
+				m_result.images["frame" + std::to_string(pending.sequenceIndex)] = frame.image;
+			}
+			else
+				success = save_image_file(frame.outputPath, *pending.denoisedImage);
+			if(!success)
+				++numFailed;
+			onFrameProcessed();
+		}
+	}};
+
+	// Frames are denoised in order, so the previous denoised frame can be used as history in temporal mode
+	std::shared_ptr<uimg::ImageBuffer> history = nullptr;
+	pragma::modules::cycles::TemporalFrameInfo historyInfo {};
+	size_t historyIndex = 0;
+	PendingFrame pending;
+	while(loadedFrames.Pop(pending)) {
+		if(IsCancelled())
+			break;
+		if(!DenoiseFrame(pending)) {
+			++numFailed;
+			onFrameProcessed();
+			history = nullptr;
+			continue;
+		}
+		if(m_settings.temporal.has_value()) {
+			// Frames that failed to load break the sequence, in which case the history is discarded
+			if(history && pending.sequenceIndex == historyIndex + 1)
+				pragma::modules::cycles::apply_temporal_denoise(*pending.denoisedImage, *history, pending.temporalInfo, historyInfo, *m_settings.temporal);
+			// The writer may convert the denoised image, so the history needs its own copy
+			history = pending.denoisedImage->Copy();
+			historyInfo = std::move(pending.temporalInfo);
+			historyInfo.motionVectors = nullptr;
+			historyInfo.depth = nullptr;
+			historyIndex = pending.sequenceIndex;
+		}
+		restore_alpha(*pending.denoisedImage, *pending.image);
+		pending.image = nullptr; // The writer only needs the original image for in-memory frames, which are kept alive by m_frames
+		if(!denoisedFrames.Push(std::move(pending)))
+			break;
+	}
+	loadedFrames.Close();
+	denoisedFrames.Close();
+	loader.join();
+	writer.join();
+	if(IsCancelled())
+		return;
+	if(numFailed > 0) {
+		SetStatus(util::JobStatus::Failed, std::to_string(numFailed) + " of " + std::to_string(numFrames) + " frames could not be denoised!");
+		return;
+	}
+	SetStatus(util::JobStatus::Successful);
+}
+uimg::ImageLayerSet SequenceDenoiseWorker::GetResult() { return m_result; }
+
+util::ParallelJob<uimg::ImageLayerSet> pragma::modules::cycles::denoise_sequence(std::vector<SequenceDenoiseFrame> frames, const SequenceDenoiseSettings &settings)
+{
+	return util::create_parallel_job<SequenceDenoiseWorker>(std::move(frames), settings);
+}
@@ -0,0 +1,142 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/hash.hpp"
+#include <cstring>
+#include <cstdio>
+
+// Based on the public domain MurmurHash3 implementation by Austin Appleby
+static inline uint64_t rotl64(uint64_t x, int8_t r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdull;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ull;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline uint64_t get_block(const uint8_t *p, size_t i)
+{
+	uint64_t block;
+	memcpy(&block, p + i * sizeof(uint64_t), sizeof(block));
+	return block;
+}
+
+pragma::modules::cycles::Hash128 pragma::modules::cycles::murmur_hash3(const void *data, size_t size, const Hash128 &seed)
+{
+	auto *bytes = static_cast<const uint8_t *>(data);
+	auto numBlocks = size / 16;
+	auto h1 = seed.h1;
+	auto h2 = seed.h2;
+	constexpr uint64_t c1 = 0x87c37b91114253d5ull;
+	constexpr uint64_t c2 = 0x4cf5ad432745937full;
+
+	for(auto i = decltype(numBlocks) {0u}; i < numBlocks; ++i) {
+		auto k1 = get_block(bytes, i * 2);
+		auto k2 = get_block(bytes, i * 2 + 1);
+
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	auto *tail = bytes + numBlocks * 16;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+	switch(size & 15) {
+	case 15:
+		k2 ^= static_cast<uint64_t>(tail[14]) << 48;
+		[[fallthrough]];
+	case 14:
+		k2 ^= static_cast<uint64_t>(tail[13]) << 40;
+		[[fallthrough]];
+	case 13:
+		k2 ^= static_cast<uint64_t>(tail[12]) << 32;
+		[[fallthrough]];
+	case 12:
+		k2 ^= static_cast<uint64_t>(tail[11]) << 24;
+		[[fallthrough]];
+	case 11:
+		k2 ^= static_cast<uint64_t>(tail[10]) << 16;
+		[[fallthrough]];
+	case 10:
+		k2 ^= static_cast<uint64_t>(tail[9]) << 8;
+		[[fallthrough]];
+	case 9:
+		k2 ^= static_cast<uint64_t>(tail[8]);
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		[[fallthrough]];
+	case 8:
+		k1 ^= static_cast<uint64_t>(tail[7]) << 56;
+		[[fallthrough]];
+	case 7:
+		k1 ^= static_cast<uint64_t>(tail[6]) << 48;
+		[[fallthrough]];
+	case 6:
+		k1 ^= static_cast<uint64_t>(tail[5]) << 40;
+		[[fallthrough]];
+	case 5:
+		k1 ^= static_cast<uint64_t>(tail[4]) << 32;
+		[[fallthrough]];
+	case 4:
+		k1 ^= static_cast<uint64_t>(tail[3]) << 24;
+		[[fallthrough]];
+	case 3:
+		k1 ^= static_cast<uint64_t>(tail[2]) << 16;
+		[[fallthrough]];
+	case 2:
+		k1 ^= static_cast<uint64_t>(tail[1]) << 8;
+		[[fallthrough]];
+	case 1:
+		k1 ^= static_cast<uint64_t>(tail[0]);
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	};
+
+	h1 ^= size;
+	h2 ^= size;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	return {h1, h2};
+}
+
+std::string pragma::modules::cycles::Hash128::ToString() const
+{
+	char buf[33];
+	snprintf(buf, sizeof(buf), "%016llx%016llx", static_cast<unsigned long long>(h1), static_cast<unsigned long long>(h2));
+	return buf;
+}
+
+pragma::modules::cycles::Hasher &pragma::modules::cycles::Hasher::Add(const void *data, size_t size)
+{
+	m_hash = murmur_hash3(data, size, m_hash);
+	return *this;
+}
@@ -0,0 +1,53 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/parallel.hpp"
+
+pragma::modules::cycles::WorkerPool::WorkerPool(uint32_t numThreads)
+{
+	if(numThreads == 0)
+		numThreads = get_default_thread_count();
+	m_threads.reserve(numThreads);
+	for(auto i = decltype(numThreads) {0u}; i < numThreads; ++i)
+		m_threads.emplace_back([this]() { Run(); });
+}
+
+pragma::modules::cycles::WorkerPool::~WorkerPool()
+{
+	{
+		std::scoped_lock lock {m_taskMutex};
+		m_running = false;
+	}
+	m_taskCondition.notify_all();
+	for(auto &t : m_threads)
+		t.join();
+}
+
+void pragma::modules::cycles::WorkerPool::Push(std::function<void()> task)
+{
+	{
+		std::scoped_lock lock {m_taskMutex};
+		m_tasks.push(std::move(task));
+	}
+	m_taskCondition.notify_one();
+}
+
+void pragma::modules::cycles::WorkerPool::Run()
+{
+	for(;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock {m_taskMutex};
+			m_taskCondition.wait(lock, [this]() { return !m_tasks.empty() || !m_running; });
+			if(m_tasks.empty())
+				return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop();
+		}
+		task();
+	}
+}
@@ -9,6 +9,7 @@
 #include "pr_cycles/shader.hpp"
 #include "pr_cycles/texture.hpp"
 #include "pr_cycles/progressive_refinement.hpp"
+#include "pr_cycles/denoise.hpp"
 #include <util_raytracing/renderer.hpp>
 
 namespace pragma::asset {
@@ -78,6 +79,7 @@ namespace pragma::asset {
 #include <util_raytracing/model_cache.hpp>
 #include <util_raytracing/color_management.hpp>
 #include <sharedutils/util_path.hpp>
+#include <unordered_set>
 #include <luabind/copy_policy.hpp>
 
 #define ENABLE_BAKE_DEBUGGING_INTERFACE 0
@@ -181,10 +183,10 @@ static std::shared_ptr<cycles::Scene> setup_scene(unirender::Scene::RenderMode r
 #endif
 	auto &cam = scene->GetCamera();
 	cam.SetResolution(width, height);
-	return std::make_shared<cycles::Scene>(*scene);
+	return std::make_shared<cycles::Scene>(*scene, denoiseMode);
 }
 
-enum class SceneFlags : uint8_t { None = 0u, CullObjectsOutsidePvs = 1u, CullObjectsOutsideCameraFrustum = CullObjectsOutsidePvs << 1u };
+enum class SceneFlags : uint8_t { None = 0u, CullObjectsOutsidePvs = 1u, CullObjectsOutsideCameraFrustum = CullObjectsOutsidePvs << 1u, ParallelPopulation = CullObjectsOutsideCameraFrustum << 1u };
 REGISTER_BASIC_BITWISE_OPERATORS(SceneFlags)
 
 struct CameraData {
@@ -195,13 +197,18 @@ struct CameraData {
 	float farZ = 0.f;
 	float fov = 0.f;
 	float aspectRatio = 0.f;
+	uint32_t resolutionWidth = 0;
+	bool equirect = false;
 };
 static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragma::modules::cycles::Cache &cache, const std::optional<CameraData> &camData, SceneFlags sceneFlags, const std::function<bool(BaseEntity &)> &entFilter = nullptr,
   const std::vector<BaseEntity *> *entityList = nullptr)
 {
 	auto enableFrustumCulling = umath::is_flag_set(sceneFlags, SceneFlags::CullObjectsOutsideCameraFrustum);
 	auto cullObjectsOutsidePvs = umath::is_flag_set(sceneFlags, SceneFlags::CullObjectsOutsidePvs);
+	auto parallelPopulation = umath::is_flag_set(sceneFlags, SceneFlags::ParallelPopulation);
 	std::vector<umath::Plane> planes {};
+	if(camData.has_value() && camData->equirect == false)
+		cache.SetViewInfo(pragma::modules::cycles::Cache::ViewInfo {camData->position, camData->fov, camData->resolutionWidth});
 	if(camData.has_value()) {
 		auto forward = uquat::forward(camData->rotation);
 		auto up = uquat::up(camData->rotation);
@@ -248,7 +255,8 @@ static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragm
 		}
 	}
 
-	auto fAddEntity = [enableFrustumCulling, &planes, node, &bspTree, &cache](BaseEntity *ent) {
+	std::vector<pragma::modules::cycles::Cache::EntityInfo> pendingEntities {};
+	auto fAddEntity = [enableFrustumCulling, &planes, node, &bspTree, &cache, parallelPopulation, &pendingEntities](BaseEntity *ent) {
 		auto renderC = ent->GetComponent<pragma::CRenderComponent>();
 		if(renderC.expired())
 			return;
@@ -304,6 +312,10 @@ static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragm
 				}
 			}
 		}
+		if(parallelPopulation) {
+			pendingEntities.push_back({ent, meshFilter});
+			return;
+		}
 		cache.AddEntity(*ent, nullptr, meshFilter);
 	};
 
@@ -325,6 +337,8 @@ static void initialize_cycles_geometry(pragma::CSceneComponent &gameScene, pragm
 			fAddEntity(ent);
 		}
 	}
+	if(parallelPopulation)
+		cache.AddEntities(pendingEntities);
 
 	// Particle Systems
 #if 0
@@ -350,6 +364,47 @@ static void sync_camera(BaseEntity &ent, unirender::Camera &cam)
 	cam.SetFarZ(util::pragma::units_to_metres(hCam->GetFarZ()));
 	cam.SetFOV(hCam->GetFOV());
 }
+static unirender::WorldObject *sync_actor(pragma::modules::cycles::Renderer &renderer, BaseEntity &ent)
+{
+	auto uuid = ent.GetUuid();
+	auto *o = renderer->FindActor(uuid);
+	if(!o) {
+		/*
+		auto skyboxC = ent.GetComponent<pragma::CSkyboxComponent>();
+		if(skyboxC.valid()) {
+			auto &scene = renderer->GetScene();
+			scene.SetSkyStrength(skyboxC->GetStrength());
+			return true;
+		}
+		*/
+
+		auto lightC = ent.GetComponent<pragma::CLightComponent>();
+		if(lightC.expired())
+			return nullptr;
+		auto light = unirender::Light::Create();
+		if(!light)
+			return nullptr;
+		sync_light(ent, *light);
+		light->SetUuid(ent.GetUuid());
+		renderer->AddLiveActor(*light);
+		o = light.get();
+	}
+	if(typeid(*o) == typeid(unirender::Light))
+		sync_light(ent, static_cast<unirender::Light &>(*o));
+	else if(typeid(*o) == typeid(unirender::Camera))
+		sync_camera(ent, static_cast<unirender::Camera &>(*o));
+	else {
+		o->SetPos(ent.GetPosition());
+		o->SetRotation(ent.GetRotation());
+		o->SetScale(ent.GetScale());
+		// Deformed meshes only get new vertex positions, so the renderer can refit the BVH instead of rebuilding it
+		if(typeid(*o) == typeid(unirender::Object)) {
+			auto &scene = renderer.GetScene();
+			scene.GetCache().UpdateEntityMesh(ent, static_cast<unirender::Object &>(*o).GetMesh(), *scene, *renderer);
+		}
+	}
+	return o;
+}
 static void initialize_cycles_scene_from_game_scene(pragma::CSceneComponent &gameScene, pragma::modules::cycles::Scene &scene, const Vector3 &camPos, const Quat &camRot, bool equirect, const Mat4 &vp, float nearZ, float farZ, float fov, float aspectRatio, SceneFlags sceneFlags,
   const std::function<bool(BaseEntity &)> &entFilter = nullptr, const std::function<bool(BaseEntity &)> &lightFilter = nullptr, const std::vector<BaseEntity *> *entityList = nullptr)
 {
@@ -361,6 +416,8 @@ static void initialize_cycles_scene_from_game_scene(pragma::CSceneComponent &gam
 	camData.farZ = farZ;
 	camData.fov = fov;
 	camData.aspectRatio = aspectRatio;
+	camData.resolutionWidth = scene->GetResolution().x;
+	camData.equirect = equirect;
 	initialize_cycles_geometry(gameScene, scene.GetCache(), camData, sceneFlags, entFilter, entityList);
 	setup_light_sources(scene, [&gameScene, &lightFilter](BaseEntity &ent) -> bool {
 		if(static_cast<CBaseEntity &>(ent).IsInScene(gameScene) == false)
@@ -748,6 +805,7 @@ PRAGMA_EXPORT void pr_cycles_render_image(const pragma::rendering::cycles::Scene
 	auto renderer = unirender::Renderer::Create(**scene, renderImageSettings.renderer, err);
 	if(renderer == nullptr)
 		return;
+	pragma::modules::cycles::wait_for_pending_texture_conversions();
 	outJob = renderer->StartRender();
 }
 PRAGMA_EXPORT void pr_cycles_bake_ao(const pragma::rendering::cycles::SceneInfo &renderImageSettings, Model &mdl, uint32_t materialIndex, util::ParallelJob<uimg::ImageLayerSet> &outJob)
@@ -774,6 +832,7 @@ PRAGMA_EXPORT void pr_cycles_bake_ao(const pragma::rendering::cycles::SceneInfo
 		el->SetName("bake_feedback");
 	}
 #endif
+	pragma::modules::cycles::wait_for_pending_texture_conversions();
 	outJob = renderer->StartRender();
 }
 PRAGMA_EXPORT void pr_cycles_bake_ao_ent(const pragma::rendering::cycles::SceneInfo &renderImageSettings, BaseEntity &ent, uint32_t materialIndex, util::ParallelJob<uimg::ImageLayerSet> &outJob)
@@ -788,6 +847,7 @@ PRAGMA_EXPORT void pr_cycles_bake_ao_ent(const pragma::rendering::cycles::SceneI
 	auto renderer = unirender::Renderer::Create(**scene, "cycles", err, unirender::Renderer::Flags::None);
 	if(renderer == nullptr)
 		return;
+	pragma::modules::cycles::wait_for_pending_texture_conversions();
 	outJob = renderer->StartRender();
 }
 PRAGMA_EXPORT void pr_cycles_bake_lightmaps(const pragma::rendering::cycles::SceneInfo &renderImageSettings, util::ParallelJob<uimg::ImageLayerSet> &outJob)
@@ -811,6 +871,7 @@ PRAGMA_EXPORT void pr_cycles_bake_lightmaps(const pragma::rendering::cycles::Sce
 		unirender::Scene::SerializationData serializationData {};
 		serializationData.outputFileName = fileName;
 		DataStream ds {};
+		pragma::modules::cycles::wait_for_pending_texture_conversions();
 		(*scene)->Save(ds, rootPath, serializationData);
 		FileManager::CreatePath(path.c_str());
 		auto f = FileManager::OpenFile<VFilePtrReal>(fileName.c_str(), "wb");
@@ -836,6 +897,7 @@ PRAGMA_EXPORT void pr_cycles_bake_lightmaps(const pragma::rendering::cycles::Sce
 			el->SetName("bake_feedback");
 		}
 #endif
+		pragma::modules::cycles::wait_for_pending_texture_conversions();
 		outJob = renderer->StartRender();
 	}
 }
@@ -848,9 +910,20 @@ bool PRAGMA_EXPORT pragma_attach(std::string &errMsg)
 
 void PRAGMA_EXPORT pragma_detach(std::string &errMsg) { unirender::set_log_handler(); }
 
+static luabind::object get_model_cache_stats(lua_State *l, const pragma::modules::cycles::Cache &cache)
+{
+	auto &stats = cache.GetModelCacheStats();
+	auto t = luabind::newtable(l);
+	t["hits"] = stats.hits;
+	t["misses"] = stats.misses;
+	t["bytesSaved"] = stats.bytesSaved;
+	return t;
+}
+
 static luabind::object g_compileCallback {};
 void PRAGMA_EXPORT pragma_terminate_lua(Lua::Interface &l)
 {
+	pragma::modules::cycles::clear_shader_graph_cache();
 	g_nodeManager = nullptr;
 	g_shaderManager = nullptr;
 	unirender::set_logger(nullptr);
@@ -893,7 +966,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 #ifdef ENABLE_MOTION_BLUR_TEST
 		                                                              scene->SetMotionBlurStrength(1.f);
 #endif
-		                                                              auto cyclesScene = std::make_shared<cycles::Scene>(*scene);
+		                                                              auto cyclesScene = std::make_shared<cycles::Scene>(*scene, createInfo.denoiseMode);
 		                                                              Lua::Push(l, cyclesScene);
 		                                                              return 1;
 	                                                              })},
@@ -924,6 +997,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     auto renderer = unirender::Renderer::Create(**scene, "cycles", err, unirender::Renderer::Flags::None);
 		     if(renderer == nullptr)
 			     return 0;
+		     pragma::modules::cycles::wait_for_pending_texture_conversions();
 		     auto job = renderer->StartRender();
 		     Lua::Push(l, job);
 		     return 1;
@@ -944,7 +1018,80 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	     })},
 	    {"denoise_image", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
 		     auto &imgBuf = Lua::Check<uimg::ImageBuffer>(l, 1);
-		     Lua::Push(l, pragma::modules::cycles::denoise(imgBuf));
+		     if(Lua::IsSet(l, 2) == false) {
+			     Lua::Push(l, pragma::modules::cycles::denoise(imgBuf));
+			     return 1;
+		     }
+		     // Tiled mode: {tileSize = 512, overlap = 32, threadCount = 0, albedo = imgBuf, normal = imgBuf}
+		     Lua::CheckTable(l, 2);
+		     luabind::object t {luabind::from_stack(l, 2)};
+		     pragma::modules::cycles::TiledDenoiseSettings settings {};
+		     settings.tileSize = luabind::object_cast_nothrow<uint32_t>(t["tileSize"], settings.tileSize);
+		     settings.overlap = luabind::object_cast_nothrow<uint32_t>(t["overlap"], settings.overlap);
+		     settings.numThreads = luabind::object_cast_nothrow<uint32_t>(t["threadCount"], settings.numThreads);
+		     auto *albedo = luabind::object_cast_nothrow<uimg::ImageBuffer *>(t["albedo"], static_cast<uimg::ImageBuffer *>(nullptr));
+		     auto *normal = luabind::object_cast_nothrow<uimg::ImageBuffer *>(t["normal"], static_cast<uimg::ImageBuffer *>(nullptr));
+		     Lua::Push(l, pragma::modules::cycles::denoise_tiled(imgBuf, settings, albedo, normal));
+		     return 1;
+	     })},
+	    {"denoise_image_sequence", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
+		     // Frames are either image buffers (denoised in place) or {input = path, output = path} tables.
+		     // Tables may specify an image instead of the input path, as well as the motion vectors, depth, view and projection used by the temporal mode.
+		     // Denoised image buffers are returned as "frame<i>", where i is the index of the frame in the table.
+		     Lua::CheckTable(l, 1);
+		     luabind::object tFrames {luabind::from_stack(l, 1)};
+		     // The frames are read in sequence order. Invalid entries raise an error, since skipping them would make the neighboring frames adjacent in temporal mode.
+		     auto numFrames = Lua::GetObjectLength(l, 1);
+		     std::vector<pragma::modules::cycles::SequenceDenoiseFrame> frames;
+		     frames.reserve(numFrames);
+		     for(auto i = decltype(numFrames) {1u}; i <= numFrames; ++i) {
+			     luabind::object tFrame = tFrames[i];
+			     pragma::modules::cycles::SequenceDenoiseFrame frame {};
+			     frame.index = i;
+			     auto *imgBuf = luabind::object_cast_nothrow<uimg::ImageBuffer *>(tFrame, static_cast<uimg::ImageBuffer *>(nullptr));
+			     if(imgBuf)
+				     frame.image = imgBuf->shared_from_this();
+			     else {
+				     if(luabind::type(tFrame) != LUA_TTABLE)
+					     Lua::Error(l, "Frame " + std::to_string(i) + " is neither an image nor a table!");
+				     auto getImage = [&tFrame](const char *key, std::string &outPath) -> std::shared_ptr<uimg::ImageBuffer> {
+					     auto *img = luabind::object_cast_nothrow<uimg::ImageBuffer *>(tFrame[key], static_cast<uimg::ImageBuffer *>(nullptr));
+					     if(img)
+						     return img->shared_from_this();
+					     outPath = luabind::object_cast_nothrow<std::string>(tFrame[key], std::string {});
+					     return nullptr;
+				     };
+				     frame.image = getImage("image", frame.inputPath);
+				     if(frame.inputPath.empty())
+					     frame.inputPath = luabind::object_cast_nothrow<std::string>(tFrame["input"], std::string {});
+				     frame.outputPath = luabind::object_cast_nothrow<std::string>(tFrame["output"], std::string {});
+				     if(!frame.image && (frame.inputPath.empty() || frame.outputPath.empty()))
+					     Lua::Error(l, "Frame " + std::to_string(i) + " has neither an image nor both an input and an output path!");
+				     frame.temporalInfo.motionVectors = getImage("motionVectors", frame.motionVectorsPath);
+				     frame.temporalInfo.depth = getImage("depth", frame.depthPath);
+				     auto *view = luabind::object_cast_nothrow<Mat4 *>(tFrame["view"], static_cast<Mat4 *>(nullptr));
+				     if(view)
+					     frame.temporalInfo.view = *view;
+				     auto *projection = luabind::object_cast_nothrow<Mat4 *>(tFrame["projection"], static_cast<Mat4 *>(nullptr));
+				     if(projection)
+					     frame.temporalInfo.projection = *projection;
+			     }
+			     frames.push_back(std::move(frame));
+		     }
+		     pragma::modules::cycles::SequenceDenoiseSettings settings {};
+		     if(Lua::IsSet(l, 2)) {
+			     Lua::CheckTable(l, 2);
+			     luabind::object t {luabind::from_stack(l, 2)};
+			     settings.maxFramesInFlight = luabind::object_cast_nothrow<uint32_t>(t["maxFramesInFlight"], settings.maxFramesInFlight);
+			     luabind::object tTemporal = t["temporal"];
+			     if(luabind::type(tTemporal) == LUA_TTABLE) {
+				     pragma::modules::cycles::TemporalDenoiseSettings temporal {};
+				     temporal.historyWeight = luabind::object_cast_nothrow<float>(tTemporal["historyWeight"], temporal.historyWeight);
+				     temporal.clampHistory = luabind::object_cast_nothrow<bool>(tTemporal["clampHistory"], temporal.clampHistory);
+				     settings.temporal = temporal;
+			     }
+		     }
+		     Lua::Push(l, pragma::modules::cycles::denoise_sequence(std::move(frames), settings));
 		     return 1;
 	     })},
 	    {"create_renderer", static_cast<int32_t (*)(lua_State *)>([](lua_State *l) -> int32_t {
@@ -979,6 +1126,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		     unirender::Scene::SerializationData serializationData {};
 		     serializationData.outputFileName = fileName;
 		     DataStream ds {};
+		     pragma::modules::cycles::wait_for_pending_texture_conversions();
 		     scene->Save(ds, rootPath, serializationData);
 		     FileManager::CreatePath(path.c_str());
 		     auto f = FileManager::OpenFile<VFilePtrReal>(fileName.c_str(), "wb");
@@ -1011,7 +1159,8 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 			     else
 				     translucent = Lua::CheckBool(l, 2);
 		     }
-		     auto res = pragma::modules::cycles::prepare_texture(texturePath, defaultTexture, translucent);
+		     // The conversion (if required) runs in the background and is waited for before the render starts
+		     auto res = pragma::modules::cycles::prepare_texture_async(texturePath, defaultTexture, translucent).path;
 		     auto o = res.has_value() ? luabind::object {l, *res} : luabind::object {};
 		     o.push(l);
 		     return 1;
@@ -1051,7 +1200,12 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	  luabind::def("register_shader", static_cast<void (*)(lua_State *, const std::string &, luabind::object)>([](lua_State *l, const std::string &className, luabind::object shaderClass) {
 		  Lua::CheckUserData(l, 2);
 		  register_shader(l, className, shaderClass);
-	  }))];
+	  })),
+	  luabind::def("set_native_pbr_shader_enabled", static_cast<void (*)(bool)>([](bool enabled) { pragma::modules::cycles::get_shader_manager().SetNativePbrShaderEnabled(enabled); })),
+	  luabind::def("set_subdivision_cache_size_limit", static_cast<void (*)(uint64_t)>([](uint64_t limit) { pragma::modules::cycles::set_subdivision_cache_size_limit(limit); })),
+	  luabind::def("get_subdivision_cache_size_limit", static_cast<uint64_t (*)()>([]() -> uint64_t { return pragma::modules::cycles::get_subdivision_cache_size_limit(); })),
+	  luabind::def("clear_subdivision_cache", static_cast<void (*)()>([]() { pragma::modules::cycles::clear_subdivision_cache(); })),
+	  luabind::def("is_native_pbr_shader_enabled", static_cast<bool (*)()>([]() -> bool { return pragma::modules::cycles::get_shader_manager().IsNativePbrShaderEnabled(); }))];
 #if 0
 		modCycles[
 			luabind::def("subdivision",static_cast<luabind::object(*)(lua_State*,luabind::table<>,luabind::table<>,uint32_t)>([](lua_State *l,luabind::table<> tVerts,luabind::table<> tTris,uint32_t subDivLevel) -> luabind::object {
@@ -1077,6 +1231,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 
 	auto defRenderer = luabind::class_<pragma::modules::cycles::Renderer>("Renderer");
 	defRenderer.def("StartRender", static_cast<void (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) {
+		pragma::modules::cycles::wait_for_pending_texture_conversions();
 		auto job = renderer->StartRender();
 		if(job.IsValid() == false)
 			return;
@@ -1093,45 +1248,35 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	defRenderer.def("Restart", static_cast<void (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) { renderer->Restart(); }));
 	defRenderer.def("Reset", static_cast<void (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) { renderer->Reset(); }));
 	defRenderer.def("StopRendering", static_cast<void (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) { renderer->StopRendering(); }));
-	defRenderer.def("ReloadShaders", static_cast<void (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) { renderer.ReloadShaders(); }));
+	defRenderer.def("ReloadShaders", static_cast<bool (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) -> bool { return renderer.ReloadShaders(); }));
 	defRenderer.def(
 	  "GetApiData", +[](lua_State *l, pragma::modules::cycles::Renderer &renderer) { return renderer->GetApiData(); });
 	defRenderer.def("BeginSceneEdit", static_cast<bool (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) -> bool { return renderer->BeginSceneEdit(); }));
 	defRenderer.def("EndSceneEdit", static_cast<bool (*)(lua_State *, pragma::modules::cycles::Renderer &)>([](lua_State *l, pragma::modules::cycles::Renderer &renderer) -> bool { return renderer->EndSceneEdit(); }));
 	defRenderer.def(
 	  "SyncActor", +[](lua_State *l, pragma::modules::cycles::Renderer &renderer, BaseEntity &ent) -> bool {
-		  auto uuid = ent.GetUuid();
-		  auto *o = renderer->FindActor(uuid);
-		  if(!o) {
-			  /*
-			  auto skyboxC = ent.GetComponent<pragma::CSkyboxComponent>();
-			  if(skyboxC.valid()) {
-				  auto &scene = renderer->GetScene();
-				  scene.SetSkyStrength(skyboxC->GetStrength());
-				  return true;
-			  }
-			  */
-
-			  auto lightC = ent.GetComponent<pragma::CLightComponent>();
-			  if(lightC.expired())
-				  return false;
-			  auto light = unirender::Light::Create();
-			  if(!light)
-				  return false;
-			  sync_light(ent, *light);
-			  light->SetUuid(ent.GetUuid());
-			  renderer->AddLiveActor(*light);
-			  o = light.get();
-		  }
-		  if(typeid(*o) == typeid(unirender::Light))
-			  sync_light(ent, static_cast<unirender::Light &>(*o));
-		  else if(typeid(*o) == typeid(unirender::Camera))
-			  sync_camera(ent, static_cast<unirender::Camera &>(*o));
-		  else {
-			  o->SetPos(ent.GetPosition());
-			  o->SetRotation(ent.GetRotation());
+		  if(!sync_actor(renderer, ent))
+			  return false;
+		  return renderer->SyncEditedActor(ent.GetUuid());
+	  });
+	defRenderer.def(
+	  "SyncActors", +[](lua_State *l, pragma::modules::cycles::Renderer &renderer, luabind::table<> tEnts) -> uint32_t {
+		  // All actors are pushed to the renderer with a single scene edit, duplicates are only synced once
+		  std::unordered_set<util::Uuid, util::HashUuid> syncedActors;
+		  if(!renderer->BeginSceneEdit())
+			  return 0;
+		  for(luabind::iterator it {tEnts}, end; it != end; ++it) {
+			  auto *ent = luabind::object_cast_nothrow<BaseEntity *>(*it, static_cast<BaseEntity *>(nullptr));
+			  if(!ent)
+				  continue;
+			  auto uuid = ent->GetUuid();
+			  if(syncedActors.find(uuid) != syncedActors.end() || !sync_actor(renderer, *ent))
+				  continue;
+			  if(renderer->SyncEditedActor(uuid))
+				  syncedActors.insert(uuid);
 		  }
-		  return renderer->SyncEditedActor(uuid);
+		  renderer->EndSceneEdit();
+		  return static_cast<uint32_t>(syncedActors.size());
 	  });
 	defRenderer.def(
 	  "FindActor", +[](lua_State *l, pragma::modules::cycles::Renderer &renderer, const Lua::util::Uuid &uuid) -> unirender::WorldObject * { return renderer->FindActor(uuid.value); });
@@ -2357,6 +2502,21 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 
 	auto defProgressiveRefine = luabind::class_<pragma::modules::cycles::ProgressiveTexture>("ProgressiveTexture");
 	defProgressiveRefine.def("GetTexture", &pragma::modules::cycles::ProgressiveTexture::GetTexture);
+	defProgressiveRefine.def(
+	  "GetStagingImagePoolStatistics", +[](lua_State *l, pragma::modules::cycles::ProgressiveTexture &prt) -> luabind::object {
+		  auto *stats = prt.GetStagingImagePoolStats();
+		  if(!stats)
+			  return luabind::object {};
+		  auto t = luabind::newtable(l);
+		  t["hits"] = stats->hits;
+		  t["misses"] = stats->misses;
+		  t["evictions"] = stats->evictions;
+		  t["failedRequests"] = stats->failedRequests;
+		  t["imageCount"] = stats->imageCount;
+		  t["imagesInUse"] = stats->imagesInUse;
+		  t["peakImageCount"] = stats->peakImageCount;
+		  return t;
+	  });
 	modCycles[defProgressiveRefine];
 
 	auto defCache = luabind::class_<pragma::modules::cycles::Cache>("Cache");
@@ -2368,6 +2528,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	}));
 	defCache.def("InitializeFromGameScene",
 	  static_cast<void (*)(lua_State *, pragma::modules::cycles::Cache &, pragma::CSceneComponent &)>([](lua_State *l, pragma::modules::cycles::Cache &cache, pragma::CSceneComponent &gameScene) { initialize_cycles_geometry(gameScene, cache, {}, SceneFlags::None, nullptr, nullptr); }));
+	defCache.def("GetModelCacheStatistics", &get_model_cache_stats);
 	modCycles[defCache];
 
 	auto defObj = luabind::class_<unirender::Object>("Object");
@@ -2423,6 +2584,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 	defScene.add_static_constant("SCENE_FLAG_NONE", umath::to_integral(SceneFlags::None));
 	defScene.add_static_constant("SCENE_FLAG_BIT_CULL_OBJECTS_OUTSIDE_CAMERA_FRUSTUM", umath::to_integral(SceneFlags::CullObjectsOutsideCameraFrustum));
 	defScene.add_static_constant("SCENE_FLAG_BIT_CULL_OBJECTS_OUTSIDE_PVS", umath::to_integral(SceneFlags::CullObjectsOutsidePvs));
+	defScene.add_static_constant("SCENE_FLAG_BIT_PARALLEL_POPULATION", umath::to_integral(SceneFlags::ParallelPopulation));
 
 	defScene.add_static_constant("DENOISE_MODE_NONE", umath::to_integral(unirender::Scene::DenoiseMode::None));
 	defScene.add_static_constant("DENOISE_MODE_AUTO_FAST", umath::to_integral(unirender::Scene::DenoiseMode::AutoFast));
@@ -2461,7 +2623,13 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		  auto aspectRatio = gameScene.GetWidth() / static_cast<float>(gameScene.GetHeight());
 		  initialize_cycles_geometry(gameScene, scene.GetCache(), {}, static_cast<SceneFlags>(sceneFlags), entFilter);
 	  });
+	defScene.def(
+	  "SetAdaptiveSubdivision", +[](lua_State *l, cycles::Scene &scene, float targetEdgeLength, uint32_t maxLevel) { scene.GetCache().SetAdaptiveSubdivisionSettings(pragma::modules::cycles::Cache::AdaptiveSubdivisionSettings {targetEdgeLength, maxLevel}); });
+	defScene.def("ClearAdaptiveSubdivision", +[](lua_State *l, cycles::Scene &scene) { scene.GetCache().SetAdaptiveSubdivisionSettings({}); });
+	defScene.def("GetModelCacheStatistics", +[](lua_State *l, cycles::Scene &scene) -> luabind::object { return get_model_cache_stats(l, scene.GetCache()); });
 	defScene.def("FindObjectByName", static_cast<unirender::Object *(cycles::Scene::*)(const std::string &)>(&cycles::Scene::FindObject));
+	defScene.def(
+	  "FindObjectByUuid", +[](lua_State *l, cycles::Scene &scene, const Lua::util::Uuid &uuid) -> unirender::Object * { return scene.FindObjectByUuid(uuid.value); });
 	defScene.def("SetSky", static_cast<void (*)(lua_State *, cycles::Scene &, const std::string &)>([](lua_State *l, cycles::Scene &scene, const std::string &skyPath) { scene->SetSky(skyPath); }));
 	defScene.def("SetSkyTransparent", static_cast<void (*)(lua_State *, cycles::Scene &, bool)>([](lua_State *l, cycles::Scene &scene, bool transparent) { scene->GetSceneInfo().transparentSky = transparent; }));
 	defScene.def("SetSkyAngles", static_cast<void (*)(lua_State *, cycles::Scene &, const EulerAngles &)>([](lua_State *l, cycles::Scene &scene, const EulerAngles &skyAngles) { scene->SetSkyAngles(skyAngles); }));
@@ -2505,6 +2673,7 @@ void PRAGMA_EXPORT pragma_initialize_lua(Lua::Interface &l)
 		  auto path = rootDir;
 		  if(Lua::file::validate_write_operation(l, path) == false)
 			  return;
+		  pragma::modules::cycles::wait_for_pending_texture_conversions();
 		  scene->Save(ds, path, serializationData);
 	  }));
 	defScene.def("Load", static_cast<void (*)(lua_State *, cycles::Scene &, DataStream &, const std::string &)>([](lua_State *l, cycles::Scene &scene, DataStream &ds, const std::string &rootDir) {
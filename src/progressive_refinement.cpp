@@ -22,42 +22,84 @@ DenoiseTexture::DenoiseTexture(uint32_t w, uint32_t h)
 	m_denoisedImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGB_FLOAT);
 	m_outputImage = uimg::ImageBuffer::Create(w, h, uimg::Format::RGBA_HDR);
 	m_running = true;
-	m_thread = std::thread {[this]() {
-		while(m_running)
-			UpdatePendingTiles();
-	}};
+	m_thread = std::thread {[this]() { Run(); }};
 }
 
-void DenoiseTexture::UpdatePendingTiles()
+void DenoiseTexture::Run()
 {
-	m_tileMutex.lock();
-	auto tiles = std::move(m_pendingTiles);
-	m_pendingTiles = {};
-	m_tileMutex.unlock();
-	while(tiles.empty() == false) {
-		auto &tileData = tiles.front();
-		// TODO
-		//tileData.image->Copy(*m_inputImage,0,0,tileData.x,tileData.y,tileData.image->GetWidth(),tileData.image->GetHeight());
-		tiles.pop();
+	std::unique_lock<std::mutex> lock {m_tileMutex};
+	for(;;) {
+		m_tileCondition.wait(lock, [this]() { return !m_running || !m_pendingTiles.empty() || m_requestedDenoiseId != m_completedDenoiseId; });
+		if(!m_running)
+			break;
+		auto tiles = std::move(m_pendingTiles);
+		m_pendingTiles = {};
+		auto denoiseId = m_requestedDenoiseId;
+		lock.unlock();
+
+		// Tiles are only written on this thread, so the input image can't change during a denoise
+		while(tiles.empty() == false) {
+			CopyTileToInputImage(tiles.front());
+			tiles.pop();
+		}
+		if(denoiseId != m_completedDenoiseId) {
+			m_denoisingState = DenoisingState::Denoising;
+			RunDenoise();
+		}
+
+		lock.lock();
+		if(denoiseId != m_completedDenoiseId) {
+			m_completedDenoiseId = denoiseId;
+			// If another denoise has been requested in the meantime, the result is already outdated
+			if(m_requestedDenoiseId == denoiseId)
+				m_denoisingState = DenoisingState::Complete;
+		}
 	}
+}
 
-	if(m_shouldDenoise) {
-		m_shouldDenoise = false;
-		m_denoisingState = DenoisingState::Denoising;
-		RunDenoise();
-		m_denoisingState = DenoisingState::Complete;
+void DenoiseTexture::CopyTileToInputImage(const unirender::TileManager::TileData &tileData)
+{
+	auto numPixels = static_cast<size_t>(tileData.w) * tileData.h;
+	if(numPixels == 0)
+		return;
+	auto size = tileData.data.size() * sizeof(tileData.data.front());
+	// Tiles are either 32-bit or 16-bit float RGBA, depending on the progressive format of the renderer
+	auto bytesPerPixel = size / numPixels;
+	uimg::Format format;
+	switch(bytesPerPixel) {
+	case 16:
+		format = uimg::Format::RGBA_FLOAT;
+		break;
+	case 8:
+		format = uimg::Format::RGBA_HDR;
+		break;
+	default:
+		return;
 	}
+	auto tileImg = uimg::ImageBuffer::Create(const_cast<void *>(static_cast<const void *>(tileData.data.data())), tileData.w, tileData.h, format, true);
+	tileImg->Convert(m_inputImage->GetFormat());
+	tileImg->Copy(*m_inputImage, 0, 0, tileData.x, tileData.y, tileData.w, tileData.h);
 }
 
 void DenoiseTexture::AppendTile(unirender::TileManager::TileData &&tileData)
 {
-	m_tileMutex.lock();
-	m_pendingTiles.push(std::move(tileData));
-	m_tileMutex.unlock();
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_pendingTiles.push(std::move(tileData));
+	}
+	m_tileCondition.notify_one();
 }
 std::shared_ptr<uimg::ImageBuffer> DenoiseTexture::GetDenoisedImageData() const { return m_outputImage; }
 
-void DenoiseTexture::Denoise() { m_shouldDenoise = true; }
+void DenoiseTexture::Denoise()
+{
+	{
+		std::scoped_lock lock {m_tileMutex};
+		++m_requestedDenoiseId;
+		m_denoisingState = DenoisingState::Denoising;
+	}
+	m_tileCondition.notify_one();
+}
 bool DenoiseTexture::IsDenoising() const { return m_denoisingState == DenoisingState::Denoising; }
 bool DenoiseTexture::IsDenoisingComplete() const { return m_denoisingState == DenoisingState::Complete; }
 
@@ -70,12 +112,16 @@ void DenoiseTexture::RunDenoise()
 	denoiseInfo.width = w;
 	denoiseInfo.height = h;
 
+	unirender::denoise::ImageData input {};
+	input.data = static_cast<uint8_t *>(m_inputImage->GetData());
+	input.format = m_inputImage->GetFormat();
+
 	unirender::denoise::ImageData output {};
-	output.data = static_cast<uint8_t *>(m_inputImage->GetData());
-	output.format = m_inputImage->GetFormat();
+	output.data = static_cast<uint8_t *>(m_denoisedImage->GetData());
+	output.format = m_denoisedImage->GetFormat();
 
 	unirender::denoise::ImageInputs inputs {};
-	inputs.beautyImage = output;
+	inputs.beautyImage = input;
 
 	m_denoiser.Denoise(denoiseInfo, inputs, output);
 	m_denoisedImage->Copy(*m_outputImage, 0, 0, 0, 0, w, h);
@@ -83,7 +129,11 @@ void DenoiseTexture::RunDenoise()
 
 DenoiseTexture::~DenoiseTexture()
 {
-	m_running = false;
+	{
+		std::scoped_lock lock {m_tileMutex};
+		m_running = false;
+	}
+	m_tileCondition.notify_one();
 	m_thread.join();
 }
 
@@ -93,9 +143,15 @@ ProgressiveTexture::~ProgressiveTexture()
 {
 	if(m_cbThink.IsValid())
 		m_cbThink.Remove();
-	c_engine->GetRenderContext().KeepResourceAliveUntilPresentationComplete(m_cmdBuffer);
+	auto &context = c_engine->GetRenderContext();
+	for(auto &slot : m_uploadSlots) {
+		context.KeepResourceAliveUntilPresentationComplete(slot.cmdBuffer);
+		for(auto &img : slot.stagingImages)
+			context.KeepResourceAliveUntilPresentationComplete(img);
+	}
 }
 std::shared_ptr<prosper::Texture> ProgressiveTexture::GetTexture() const { return m_texture; }
+const StagingImagePool::Stats *ProgressiveTexture::GetStagingImagePoolStats() const { return m_stagingImagePool ? &m_stagingImagePool->GetStats() : nullptr; }
 void ProgressiveTexture::Initialize(unirender::Renderer &renderer)
 {
 	m_renderer = renderer.shared_from_this();
@@ -107,17 +163,21 @@ void ProgressiveTexture::Initialize(unirender::Renderer &renderer)
 	auto img = CreateImage(res.x, res.y, true);
 	m_image = img;
 
-	uint32_t queueFamilyIndex;
-	m_cmdBuffer = context.AllocatePrimaryLevelCommandBuffer(prosper::QueueFamilyType::Universal, queueFamilyIndex);
-	m_fence = context.CreateFence(true);
-	auto result = m_cmdBuffer->StartRecording(false, false);
+	m_stagingImagePool = std::make_unique<StagingImagePool>([this](uint32_t width, uint32_t height) { return CreateImage(width, height, false); }, MAX_STAGING_IMAGES);
+	for(auto &slot : m_uploadSlots) {
+		uint32_t queueFamilyIndex;
+		slot.cmdBuffer = context.AllocatePrimaryLevelCommandBuffer(prosper::QueueFamilyType::Universal, queueFamilyIndex);
+		slot.fence = context.CreateFence(true);
+	}
+	auto &cmdBuffer = m_uploadSlots.front().cmdBuffer;
+	auto result = cmdBuffer->StartRecording(false, false);
 	assert(result);
 
 	// Clear alpha
-	m_cmdBuffer->RecordClearImage(*img, prosper::ImageLayout::TransferDstOptimal, std::array<float, 4> {0.f, 0.f, 0.f, 0.f});
-	m_cmdBuffer->RecordImageBarrier(*img, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
-	m_cmdBuffer->StopRecording();
-	context.SubmitCommandBuffer(*m_cmdBuffer, prosper::QueueFamilyType::Universal, true);
+	cmdBuffer->RecordClearImage(*img, prosper::ImageLayout::TransferDstOptimal, std::array<float, 4> {0.f, 0.f, 0.f, 0.f});
+	cmdBuffer->RecordImageBarrier(*img, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	cmdBuffer->StopRecording();
+	context.SubmitCommandBuffer(*cmdBuffer, prosper::QueueFamilyType::Universal, true);
 
 	prosper::util::SamplerCreateInfo samplerCreateInfo {};
 	samplerCreateInfo.addressModeU = prosper::SamplerAddressMode::ClampToEdge;
@@ -146,42 +206,78 @@ std::shared_ptr<prosper::IImage> ProgressiveTexture::CreateImage(uint32_t width,
 	imgCreateInfo.postCreateLayout = onDevice ? prosper::ImageLayout::TransferDstOptimal : prosper::ImageLayout::TransferSrcOptimal;
 	return context.CreateImage(imgCreateInfo);
 }
+ProgressiveTexture::UploadSlot *ProgressiveTexture::FindAvailableUploadSlot()
+{
+	// Slots are used in order, so the oldest submission is checked first
+	for(auto i = decltype(m_uploadSlots.size()) {0u}; i < m_uploadSlots.size(); ++i) {
+		auto idx = (m_nextUploadSlot + i) % m_uploadSlots.size();
+		auto &slot = m_uploadSlots[idx];
+		if(slot.fence->IsSignaled() == false)
+			continue;
+		m_nextUploadSlot = (idx + 1) % m_uploadSlots.size();
+		for(auto &img : slot.stagingImages)
+			m_stagingImagePool->Release(img);
+		slot.stagingImages.clear();
+		return &slot;
+	}
+	return nullptr;
+}
 void ProgressiveTexture::Update()
 {
-	auto &scene = m_renderer->GetScene();
 	auto &tileManager = m_renderer->GetTileManager();
 	// We'll wait for all tiles to have at least 1 finished sample before we write the image data
 	if(tileManager.AllTilesHaveRenderedSamples() == false)
 		return;
 	auto tiles = m_renderer->GetRenderedTileBatch();
-	if(tiles.empty())
+	for(auto &tile : tiles)
+		m_pendingTiles[(static_cast<uint64_t>(tile.x) << 32) | tile.y] = std::move(tile);
+	if(m_pendingTiles.empty())
 		return;
-	auto &tile = tiles.back();
-	auto it = std::find_if(m_mipImages.begin(), m_mipImages.end(), [&tile](const std::shared_ptr<prosper::IImage> &img) { return img->GetWidth() == tile.w && img->GetHeight() == tile.h; });
-	if(it == m_mipImages.end()) {
-		auto newImg = CreateImage(tile.w, tile.h, false);
-		m_mipImages.push_back(newImg);
-		it = m_mipImages.end() - 1;
-	}
+	auto *slot = FindAvailableUploadSlot();
+	if(!slot)
+		return; // All uploads are still in flight, try again next tick
 
-	auto &imgData = **it;
-	imgData.WriteImageData(tile.x, tile.y, tile.w, tile.h, 0, 0, tile.data.size() * sizeof(tile.data.front()), tile.data.data());
+	// Every tile needs its own staging image, since all of them are written before the command buffer is executed.
+	// Tiles that don't get an image because the pool is exhausted are uploaded with a later batch.
+	std::vector<std::pair<unirender::TileManager::TileData, std::shared_ptr<prosper::IImage>>> uploads;
+	uploads.reserve(m_pendingTiles.size());
+	for(auto it = m_pendingTiles.begin(); it != m_pendingTiles.end();) {
+		auto &tile = it->second;
+		auto stagingImg = m_stagingImagePool->Acquire(tile.w, tile.h);
+		if(!stagingImg) {
+			++it;
+			continue;
+		}
+		slot->stagingImages.push_back(stagingImg);
+		uploads.push_back({std::move(tile), stagingImg});
+		it = m_pendingTiles.erase(it);
+	}
+	if(uploads.empty())
+		return;
 
-	auto &context = c_engine->GetRenderContext();
-	context.WaitForFence(*m_fence);
-	auto res = m_cmdBuffer->StartRecording(false, false);
+	auto &cmdBuffer = *slot->cmdBuffer;
+	auto res = cmdBuffer.StartRecording(false, false);
 	assert(res);
 	if(!res)
 		return;
-	m_fence->Reset();
-	prosper::util::BarrierImageLayout {};
-	// Ensure image data has been written by host before blitting to destination image
-	m_cmdBuffer->RecordImageBarrier(imgData, prosper::PipelineStageFlags::HostBit, prosper::PipelineStageFlags::TransferBit, prosper::ImageLayout::TransferSrcOptimal, prosper::ImageLayout::TransferSrcOptimal, prosper::AccessFlags::HostWriteBit, prosper::AccessFlags::TransferReadBit);
+	slot->fence->Reset();
+	cmdBuffer.RecordImageBarrier(*m_image, prosper::ImageLayout::ShaderReadOnlyOptimal, prosper::ImageLayout::TransferDstOptimal);
+	for(auto &[tile, stagingImg] : uploads) {
+		auto &imgData = *stagingImg;
+		imgData.WriteImageData(0, 0, tile.w, tile.h, 0, 0, tile.data.size() * sizeof(tile.data.front()), tile.data.data());
 
-	m_cmdBuffer->RecordImageBarrier(*m_image, prosper::ImageLayout::ShaderReadOnlyOptimal, prosper::ImageLayout::TransferDstOptimal);
-	m_cmdBuffer->RecordBlitImage({}, imgData, *m_image);
-	m_cmdBuffer->RecordImageBarrier(*m_image, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+		// Ensure image data has been written by host before blitting to destination image
+		cmdBuffer.RecordImageBarrier(imgData, prosper::PipelineStageFlags::HostBit, prosper::PipelineStageFlags::TransferBit, prosper::ImageLayout::TransferSrcOptimal, prosper::ImageLayout::TransferSrcOptimal, prosper::AccessFlags::HostWriteBit, prosper::AccessFlags::TransferReadBit);
+		// The staging image may be larger than the tile, only the tile region is copied
+		prosper::util::BlitInfo blitInfo {};
+		blitInfo.offsetDst = {static_cast<int32_t>(tile.x), static_cast<int32_t>(tile.y)};
+		blitInfo.extentsSrc = prosper::Extent2D {tile.w, tile.h};
+		blitInfo.extentsDst = prosper::Extent2D {tile.w, tile.h};
+		cmdBuffer.RecordBlitImage(blitInfo, imgData, *m_image);
+	}
+	cmdBuffer.RecordImageBarrier(*m_image, prosper::ImageLayout::TransferDstOptimal, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	cmdBuffer.StopRecording();
 
-	m_cmdBuffer->StopRecording();
-	context.SubmitCommandBuffer(*m_cmdBuffer, prosper::QueueFamilyType::Universal, false, m_fence.get());
+	auto &context = c_engine->GetRenderContext();
+	context.SubmitCommandBuffer(cmdBuffer, prosper::QueueFamilyType::Universal, false, slot->fence.get());
 }
@@ -39,7 +39,10 @@
 #include <cmaterialmanager.h>
 #include <datasystem_color.h>
 #include <datasystem_vector.h>
+#include <algorithm>
+#include <unordered_set>
 #include "pr_cycles/subdivision.hpp"
+#include "pr_cycles/hash.hpp"
 
 // ccl happens to have the same include guard name as sharedutils, so we have to undef it here
 #undef __UTIL_STRING_H__
@@ -52,10 +55,12 @@ extern DLLCLIENT CGame *c_game;
 
 cycles::Cache::ShaderInfo::ShaderInfo() {}
 
-cycles::Scene::Scene(unirender::Scene &rtScene) : m_rtScene {rtScene.shared_from_this()}
+cycles::Scene::Scene(unirender::Scene &rtScene, std::optional<unirender::Scene::DenoiseMode> denoiseMode) : m_rtScene {rtScene.shared_from_this()}
 {
 	m_cache = std::make_shared<Cache>(rtScene.GetRenderMode());
 	m_cache->GetModelCache().SetUnique(true);
+	if(denoiseMode.has_value())
+		m_cache->SetRequiredShaderPasses(Cache::GetRequiredShaderPasses(rtScene.GetRenderMode(), *denoiseMode));
 }
 
 void cycles::Scene::AddRoughnessMapImageTextureNode(unirender::ShaderModuleRoughness &shader, Material &mat, float defaultRoughness) const
@@ -125,60 +130,73 @@ void cycles::Scene::Finalize()
 	m_rtScene->AddModelsFromCache(m_cache->GetModelCache());
 }
 
-unirender::Object *cycles::Scene::FindObject(const std::string &name)
-{
-	auto &cache = GetCache();
-	auto &mdlCache = cache.GetModelCache();
-	for(auto &chunk : mdlCache.GetChunks()) {
-		auto &objs = chunk.GetObjects();
-		auto it = std::find_if(objs.begin(), objs.end(), [&name](const unirender::PObject &obj) { return obj->GetName() == name; });
-		if(it == objs.end())
-			continue;
-		return it->get();
-	}
-	return nullptr;
-}
+unirender::Object *cycles::Scene::FindObject(const std::string &name) { return m_cache->FindObject(name); }
+unirender::Object *cycles::Scene::FindObjectByUuid(const util::Uuid &uuid) { return m_cache->FindObjectByUuid(uuid); }
 
 cycles::Renderer::Renderer(Scene &scene, unirender::Renderer &renderer) : m_scene {scene.shared_from_this()}, m_renderer {renderer.shared_from_this()} {}
 
-void cycles::Renderer::ReloadShaders()
+bool cycles::Renderer::ReloadShaders()
 {
 	// Can only reload shaders that are part of this scene's parimary cache
-	auto &shaderTranslationTable = m_scene->GetCache().GetRTShaderToShaderTable();
-	for(auto &mdlCache : (*m_scene)->GetModelCaches()) {
+	auto &cache = m_scene->GetCache();
+	auto &rtScene = **m_scene;
+	// Shaders are shared between meshes, so each one is only checked once. Unchanged shaders map to nullptr.
+	std::unordered_map<unirender::Shader *, unirender::PShader> reloadedShaders;
+	std::unordered_set<const unirender::Mesh *> changedMeshes;
+	for(auto &mdlCache : rtScene.GetModelCaches()) {
 		for(auto &chunk : mdlCache->GetChunks()) {
 			for(auto &mesh : chunk.GetMeshes()) {
+				auto &meshShaders = mesh->GetSubMeshShaders();
 				auto renderMesh = m_renderer->FindRenderMeshByHash(mesh->GetHash());
-				if(renderMesh == nullptr)
-					continue;
-				auto &meshShaders = renderMesh->GetSubMeshShaders();
 				for(auto i = decltype(meshShaders.size()) {0u}; i < meshShaders.size(); ++i) {
 					auto &rtShader = meshShaders.at(i);
-					auto it = shaderTranslationTable.find(rtShader.get());
-					if(it == shaderTranslationTable.end())
+					if(rtShader == nullptr)
 						continue;
-					auto &shader = it->second;
-					/*auto newRtShader = unirender::Shader::Create<unirender::GenericShader>();
-					newRtShader->combinedPass = ;
-					newRtShader->albedoPass = rtShader->albedoPass;
-					newRtShader->normalPass = rtShader->normalPass;
-					newRtShader->depthPass = rtShader->depthPass;
-					shaderTranslationTable.erase(it);
-					shaderTranslationTable[newRtShader.get()] = shader;
-
-					rtShader = newRtShader;*/
-
-					// TODO: Cache
-					// TODO
-					/*auto pass = shader->InitializeCombinedPass();
-					auto cclShader = unirender::CCLShader::Create(*m_renderer,*pass);
-					cclShader->Finalize(*m_scene);
-					renderMesh->GetCyclesMesh()->used_shaders.at(i) = **cclShader;
-					renderMesh->GetCyclesMesh()->tag_update(**m_scene,false);*/
+					auto it = reloadedShaders.find(rtShader.get());
+					if(it == reloadedShaders.end()) {
+						auto newRtShader = cache.ReloadShader(*rtShader);
+						if(newRtShader != nullptr)
+							newRtShader->Finalize(rtScene, true);
+						it = reloadedShaders.insert(std::make_pair(rtShader.get(), newRtShader)).first;
+					}
+					if(it->second == nullptr)
+						continue;
+					// The renderer keeps its own copy of the shader list, which has to be kept in sync with the scene mesh
+					if(renderMesh != nullptr) {
+						auto &renderMeshShaders = renderMesh->GetSubMeshShaders();
+						if(i < renderMeshShaders.size() && renderMeshShaders.at(i) == rtShader)
+							renderMeshShaders.at(i) = it->second;
+					}
+					rtShader = it->second;
+					changedMeshes.insert(mesh.get());
 				}
 			}
 		}
 	}
+	if(changedMeshes.empty())
+		return true;
+
+	// Only the objects using the affected meshes have to be updated, the render session and the BVH are left untouched.
+	// Syncing an object re-exports its mesh to the backend, which is where the backend shaders for the new shaders are created.
+	if(m_renderer->BeginSceneEdit() == false)
+		return false;
+	auto synced = true;
+	for(auto &mdlCache : rtScene.GetModelCaches()) {
+		for(auto &chunk : mdlCache->GetChunks()) {
+			for(auto &mesh : chunk.GetMeshes()) {
+				// Tags the mesh for an update of its shader assignments
+				if(changedMeshes.find(mesh.get()) != changedMeshes.end())
+					mesh->Finalize(rtScene, true);
+			}
+			for(auto &obj : chunk.GetObjects()) {
+				if(changedMeshes.find(&obj->GetMesh()) == changedMeshes.end())
+					continue;
+				if(m_renderer->SyncEditedActor(obj->GetUuid()) == false)
+					synced = false;
+			}
+		}
+	}
+	return m_renderer->EndSceneEdit() && synced;
 }
 
 void cycles::Scene::BuildLightMapObject()
@@ -217,7 +235,7 @@ void cycles::Scene::BuildLightMapObject()
 	auto o = unirender::Object::Create(*mesh);
 	if(o == nullptr)
 		return;
-	m_cache->GetModelCache().GetChunks().front().AddObject(*o);
+	m_cache->AddObject(*o);
 
 	// Lightmap uvs per mesh
 	auto numTris = mesh->GetTriangleCount();
@@ -252,50 +270,255 @@ void cycles::Scene::BuildLightMapObject()
 void cycles::Scene::AddLightmapBakeTarget(BaseEntity &ent) { m_lightMapTargets.push_back(ent.GetHandle()); }
 void cycles::Scene::SetLightmapDataCache(LightmapDataCache *cache) { m_lightMapDataCache = cache ? cache->shared_from_this() : nullptr; }
 
-unirender::PShader cycles::Cache::CreateShader(Material &mat, const std::string &meshName, const ShaderInfo &shaderInfo) const
+// Translated shaders are shared between all caches, scenes and renders, so that the (Lua) shader
+// callbacks only have to be invoked once for every distinct material.
+// The entries keep the translations alive after the caches that created them have been destroyed, so that the next scene can reuse them.
+// The number of entries is limited, the least recently used ones are evicted first. Changed materials result in new keys, their old
+// translations are evicted eventually as well (or right away if the shader is reloaded).
+struct ShaderGraphCacheEntry {
+	std::shared_ptr<unirender::GenericShader> rtShader = nullptr;
+	std::shared_ptr<cycles::Shader> shader = nullptr;
+	cycles::Cache::ShaderPass initializedPasses = cycles::Cache::ShaderPass::None;
+	uint64_t lastUse = 0;
+};
+static constexpr size_t MAX_SHADER_GRAPH_CACHE_ENTRIES = 1'024;
+static std::unordered_map<std::string, ShaderGraphCacheEntry> g_shaderGraphCache;
+static uint64_t g_shaderGraphCacheUseCounter = 0;
+void cycles::clear_shader_graph_cache() { g_shaderGraphCache.clear(); }
+static void add_shader_graph_cache_entry(const std::string &cacheKey, ShaderGraphCacheEntry &&entry)
+{
+	entry.lastUse = ++g_shaderGraphCacheUseCounter;
+	g_shaderGraphCache[cacheKey] = std::move(entry);
+	while(g_shaderGraphCache.size() > MAX_SHADER_GRAPH_CACHE_ENTRIES) {
+		auto itOldest = std::min_element(g_shaderGraphCache.begin(), g_shaderGraphCache.end(), [](const auto &a, const auto &b) { return a.second.lastUse < b.second.lastUse; });
+		g_shaderGraphCache.erase(itOldest);
+	}
+}
+
+static void hash_data_block(cycles::Hasher &hasher, const ds::Block &block)
+{
+	auto *data = block.GetData();
+	if(data == nullptr)
+		return;
+	// The iteration order of the map isn't deterministic, so we have to sort the entries first
+	std::vector<std::pair<const std::string *, const ds::Base *>> entries;
+	entries.reserve(data->size());
+	for(auto &[key, val] : *data)
+		entries.push_back({&key, val.get()});
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return *a.first < *b.first; });
+	hasher.Add<uint64_t>(entries.size());
+	for(auto &[key, val] : entries) {
+		hasher.Add(*key);
+		if(val == nullptr)
+			continue;
+		hasher.Add(std::string {typeid(*val).name()});
+		if(val->IsBlock()) {
+			hash_data_block(hasher, static_cast<const ds::Block &>(*val));
+			continue;
+		}
+		auto *dsVal = dynamic_cast<const ds::Value *>(val);
+		if(dsVal)
+			hasher.Add(dsVal->GetString());
+	}
+}
+
+// Lua shaders can read the entity and sub-mesh of the shader (e.g. the eye shader), so their translations are only shared between identical meshes
+static bool is_shader_mesh_dependent(const std::string &shaderName)
+{
+	auto &sm = cycles::get_shader_manager();
+	return sm.IsNativeShader(shaderName) == false && sm.IsShaderRegistered(shaderName);
+}
+
+static std::string get_shader_graph_cache_key(const std::string &shaderName, Material &mat, BaseEntity *optEnt, ModelSubMesh *optSubMesh)
+{
+	cycles::Hasher hasher {};
+	hasher.Add(shaderName).Add(mat.GetName());
+	hash_data_block(hasher, *mat.GetDataBlock());
+	if(is_shader_mesh_dependent(shaderName)) {
+		hasher.Add(optEnt ? optEnt->GetUuid() : util::Uuid {});
+		hasher.Add(optSubMesh ? optSubMesh->GetUuid() : util::Uuid {});
+	}
+	return hasher.GetHash().ToString();
+}
+
+cycles::Cache::ShaderPass cycles::Cache::GetRequiredShaderPasses(unirender::Scene::RenderMode renderMode, unirender::Scene::DenoiseMode denoiseMode)
+{
+	auto passes = ShaderPass::Combined;
+	switch(renderMode) {
+	case unirender::Scene::RenderMode::SceneAlbedo:
+		passes |= ShaderPass::Albedo;
+		break;
+	case unirender::Scene::RenderMode::SceneNormals:
+		passes |= ShaderPass::Normal;
+		break;
+	case unirender::Scene::RenderMode::SceneDepth:
+		passes |= ShaderPass::Depth;
+		break;
+	}
+	// The denoiser uses the albedo and normal passes as guides
+	if(denoiseMode != unirender::Scene::DenoiseMode::None)
+		passes |= ShaderPass::Albedo | ShaderPass::Normal;
+	return passes;
+}
+
+static std::shared_ptr<unirender::GenericShader> create_rt_shader(cycles::Shader &shader)
+{
+	auto rtShader = unirender::Shader::Create<unirender::GenericShader>();
+	auto &hairConfig = shader.GetHairConfig();
+	if(hairConfig.has_value())
+		rtShader->SetHairConfig(*hairConfig);
+
+	auto &subdivSettings = shader.GetSubdivisionSettings();
+	if(subdivSettings.has_value())
+		rtShader->SetSubdivisionSettings(*subdivSettings);
+	return rtShader;
+}
+
+// Only for shaders that haven't been published to the graph cache yet
+static void translate_shader_passes(unirender::GenericShader &rtShader, cycles::Shader &shader, cycles::Cache::ShaderPass passes)
+{
+	using ShaderPass = cycles::Cache::ShaderPass;
+	if(umath::is_flag_set(passes, ShaderPass::Combined))
+		rtShader.combinedPass = shader.InitializeCombinedPass();
+	if(umath::is_flag_set(passes, ShaderPass::Albedo))
+		rtShader.albedoPass = shader.InitializeAlbedoPass();
+	if(umath::is_flag_set(passes, ShaderPass::Normal))
+		rtShader.normalPass = shader.InitializeNormalPass();
+	if(umath::is_flag_set(passes, ShaderPass::Depth))
+		rtShader.depthPass = shader.InitializeDepthPass();
+}
+
+// Returns a shader with all required passes. A published shader may be in use by another render, so it is never modified.
+// Missing passes are added to a copy instead, which replaces the shader in the graph cache.
+static std::shared_ptr<unirender::GenericShader> initialize_shader_passes(ShaderGraphCacheEntry &entry, const std::shared_ptr<unirender::GenericShader> &rtShader, cycles::Shader &shader, cycles::Cache::ShaderPass passes)
+{
+	auto missingPasses = passes & ~entry.initializedPasses;
+	if(missingPasses == cycles::Cache::ShaderPass::None)
+		return rtShader;
+	auto newRtShader = create_rt_shader(shader);
+	newRtShader->combinedPass = rtShader->combinedPass;
+	newRtShader->albedoPass = rtShader->albedoPass;
+	newRtShader->normalPass = rtShader->normalPass;
+	newRtShader->depthPass = rtShader->depthPass;
+	translate_shader_passes(*newRtShader, shader, missingPasses);
+	entry.rtShader = newRtShader;
+	entry.initializedPasses |= missingPasses;
+	return newRtShader;
+}
+
+static std::optional<std::string> get_shader_name(Material &mat)
 {
-	auto it = m_materialToShader.find(&mat);
-	if(it != m_materialToShader.end())
-		return m_shaderCache->GetShader(it->second);
 	auto &matShader = mat.GetShaderIdentifier();
 	if(ustring::compare<std::string>(matShader, "nodraw", false))
-		return nullptr;
+		return {};
 	std::string cyclesShader = "pbr";
 	auto &dataBlock = mat.GetDataBlock();
 	auto cyclesBlock = dataBlock->GetBlock("unirender");
-	auto &shaderManager = get_shader_manager();
 	if(cyclesBlock)
 		cyclesShader = cyclesBlock->GetString("shader", "pbr");
 	else {
 		auto matShader = mat.GetShaderIdentifier();
 		ustring::to_lower(matShader);
-		if(shaderManager.IsShaderRegistered(matShader))
+		if(cycles::get_shader_manager().IsShaderRegistered(matShader))
 			cyclesShader = matShader;
 	}
 	if(ustring::compare<std::string>(cyclesShader, "nodraw", false))
-		return nullptr;
+		return {};
+	return cyclesShader;
+}
+
+unirender::PShader cycles::Cache::TranslateShader(Material &mat, const std::string &shaderName, BaseEntity *optEnt, ModelSubMesh *optSubMesh) const
+{
+	// The key covers the shader and the full material data, so changes to the material result in a new translation
+	auto cacheKey = get_shader_graph_cache_key(shaderName, mat, optEnt, optSubMesh);
+	auto itCached = g_shaderGraphCache.find(cacheKey);
+	if(itCached != g_shaderGraphCache.end()) {
+		auto &entry = itCached->second;
+		entry.lastUse = ++g_shaderGraphCacheUseCounter;
+		auto cachedShader = entry.shader;
+		auto cachedRtShader = entry.rtShader;
+		cachedRtShader = initialize_shader_passes(entry, cachedRtShader, *cachedShader, m_requiredShaderPasses);
+		m_rtShaderToShader[cachedRtShader.get()] = cachedShader;
+		m_rtShaderCacheKeys[cachedRtShader.get()] = cacheKey;
+		return cachedRtShader;
+	}
 
-	auto shader = shaderManager.CreateShader(get_node_manager(), cyclesShader, shaderInfo.entity.has_value() ? *shaderInfo.entity : nullptr, shaderInfo.subMesh.has_value() ? *shaderInfo.subMesh : nullptr, mat);
+	auto shader = get_shader_manager().CreateShader(get_node_manager(), shaderName, optEnt, optSubMesh, mat);
 	if(shader == nullptr)
 		return nullptr;
-	auto rtShader = unirender::Shader::Create<unirender::GenericShader>();
+	auto rtShader = create_rt_shader(*shader);
 	m_rtShaderToShader[rtShader.get()] = shader;
+	m_rtShaderCacheKeys[rtShader.get()] = cacheKey;
 
-	auto &hairConfig = shader->GetHairConfig();
-	if(hairConfig.has_value())
-		rtShader->SetHairConfig(*hairConfig);
+	// All passes are translated before the shader is published
+	translate_shader_passes(*rtShader, *shader, m_requiredShaderPasses);
+	add_shader_graph_cache_entry(cacheKey, {rtShader, shader, m_requiredShaderPasses});
+	return rtShader;
+}
 
-	auto &subdivSettings = shader->GetSubdivisionSettings();
-	if(subdivSettings.has_value())
-		rtShader->SetSubdivisionSettings(*subdivSettings);
+unirender::PShader cycles::Cache::CreateShader(Material &mat, const std::string &meshName, const ShaderInfo &shaderInfo) const
+{
+	auto it = m_materialToShader.find(&mat);
+	if(it != m_materialToShader.end())
+		return m_shaderCache->GetShader(it->second);
+	auto shaderName = get_shader_name(mat);
+	if(shaderName.has_value() == false)
+		return nullptr;
+	auto rtShader = TranslateShader(mat, *shaderName, shaderInfo.entity.has_value() ? *shaderInfo.entity : nullptr, shaderInfo.subMesh.has_value() ? *shaderInfo.subMesh : nullptr);
+	if(rtShader == nullptr)
+		return nullptr;
+	m_materialToShader[&mat] = AddShaderToShaderCache(rtShader);
+	return rtShader;
+}
 
-	rtShader->combinedPass = shader->InitializeCombinedPass();
-	rtShader->albedoPass = shader->InitializeAlbedoPass();
-	rtShader->normalPass = shader->InitializeNormalPass();
-	rtShader->depthPass = shader->InitializeDepthPass();
+// Materials with the same translation share a single shader cache slot, so the renderer only creates one backend shader for them.
+// Backend shaders belong to the backend scene, so they can't be shared between scenes (only the translated graphs can, see above).
+size_t cycles::Cache::AddShaderToShaderCache(const unirender::PShader &rtShader) const
+{
+	auto it = m_rtShaderToShaderCacheIndex.find(rtShader);
+	if(it != m_rtShaderToShaderCacheIndex.end())
+		return it->second;
 	auto idx = m_shaderCache->AddShader(*rtShader);
-	m_materialToShader[&mat] = idx;
-	return rtShader;
+	m_rtShaderToShaderCacheIndex[rtShader] = idx;
+	return idx;
+}
+
+unirender::PShader cycles::Cache::ReloadShader(unirender::Shader &rtShader)
+{
+	auto it = m_rtShaderToShader.find(&rtShader);
+	if(it == m_rtShaderToShader.end())
+		return nullptr;
+	auto shader = it->second;
+	auto *mat = shader->GetMaterial();
+	if(mat == nullptr)
+		return nullptr;
+	auto shaderName = get_shader_name(*mat);
+	if(shaderName.has_value() == false)
+		return nullptr;
+	// The translation is still valid if neither the material nor the shader class have changed (re-registering a shader clears the graph cache)
+	auto cacheKey = get_shader_graph_cache_key(*shaderName, *mat, shader->GetEntity(), shader->GetMesh());
+	auto itKey = m_rtShaderCacheKeys.find(&rtShader);
+	auto itCached = g_shaderGraphCache.find(cacheKey);
+	auto isCachedShader = (itCached != g_shaderGraphCache.end() && itCached->second.rtShader.get() == &rtShader);
+	if(itKey != m_rtShaderCacheKeys.end() && itKey->second == cacheKey && isCachedShader)
+		return nullptr;
+	if(isCachedShader)
+		g_shaderGraphCache.erase(itCached);
+	// If the material has changed, the translation is still published under the previous key
+	if(itKey != m_rtShaderCacheKeys.end() && itKey->second != cacheKey) {
+		auto itPrev = g_shaderGraphCache.find(itKey->second);
+		if(itPrev != g_shaderGraphCache.end() && itPrev->second.rtShader.get() == &rtShader)
+			g_shaderGraphCache.erase(itPrev);
+	}
+
+	auto newRtShader = TranslateShader(*mat, *shaderName, shader->GetEntity(), shader->GetMesh());
+	if(newRtShader == nullptr)
+		return nullptr;
+	m_rtShaderToShader.erase(&rtShader);
+	m_rtShaderCacheKeys.erase(&rtShader);
+	m_materialToShader[mat] = AddShaderToShaderCache(newRtShader);
+	return newRtShader;
+}
 
 #if 0
 	// Make sure all textures have finished loading
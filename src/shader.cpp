@@ -7,9 +7,13 @@
 
 #include "pr_cycles/shader.hpp"
 #include "pr_cycles/scene.hpp"
+#include "pr_cycles/texture.hpp"
 #include <pragma/model/modelmesh.h>
 #include <pragma/console/conout.h>
 #include <pragma/lua/ldefinitions.h>
+#include <texturemanager/texture.h>
+#include <textureinfo.h>
+#include <datasystem_vector.h>
 
 using namespace pragma::modules::cycles;
 
@@ -40,9 +44,28 @@ ModelSubMesh *Shader::GetMesh() const { return m_mesh.get(); }
 //////////////
 
 std::shared_ptr<ShaderManager> ShaderManager::Create() { return std::shared_ptr<ShaderManager> {new ShaderManager {}}; }
-void ShaderManager::RegisterShader(const std::string &name, luabind::object oClass) { m_shaders[name] = oClass; }
+void ShaderManager::RegisterShader(const std::string &name, luabind::object oClass)
+{
+	m_shaders[name] = oClass;
+	// Translations of the previous shader definition are no longer valid
+	clear_shader_graph_cache();
+}
+void ShaderManager::SetNativePbrShaderEnabled(bool enabled)
+{
+	if(enabled == m_nativePbrShaderEnabled)
+		return;
+	m_nativePbrShaderEnabled = enabled;
+	clear_shader_graph_cache();
+}
+bool ShaderManager::IsNativeShader(const std::string &name) const { return name == "pbr" && (m_nativePbrShaderEnabled || IsShaderRegistered(name) == false); }
 std::shared_ptr<Shader> ShaderManager::CreateShader(unirender::NodeManager &nodeManager, const std::string &name, BaseEntity *ent, ModelSubMesh *mesh, Material &mat)
 {
+	if(IsNativeShader(name)) {
+		// Skips the Lua round trips entirely
+		auto shader = std::make_shared<PbrShader>();
+		shader->Initialize(nodeManager, ent, mesh, mat);
+		return shader;
+	}
 	auto it = m_shaders.find(name);
 	if(it == m_shaders.end())
 		return nullptr;
@@ -114,3 +137,197 @@ std::shared_ptr<unirender::GroupNodeDesc> LuaShader::InitializeDepthPass()
 	CallLuaMember<void, std::shared_ptr<unirender::GroupNodeDesc>, std::shared_ptr<unirender::NodeDesc>>("InitializeDepthPass", desc, nodeOutput.shared_from_this());
 	return desc;
 }
+
+//////////////
+
+std::optional<std::string> PbrShader::GetTexturePath(TextureInfo *texInfo, const std::optional<std::string> &defaultTexture, bool translucent) const
+{
+	if(texInfo == nullptr || texInfo->texture == nullptr) {
+		if(defaultTexture.has_value() == false)
+			return {};
+		return prepare_texture_async(*defaultTexture, {}, translucent).path;
+	}
+	return prepare_texture_async(std::static_pointer_cast<Texture>(texInfo->texture), PreparedTextureInputFlags::None, nullptr, defaultTexture, translucent).path;
+}
+
+// Factors may be stored with or without an alpha component
+static std::optional<Vector4> get_color_factor(ds::Block &dataBlock, const std::string &key)
+{
+	auto &dv = dataBlock.GetValue(key);
+	if(dv == nullptr)
+		return {};
+	if(auto *v4 = dynamic_cast<ds::Vector4 *>(dv.get()))
+		return v4->GetValue();
+	if(auto *v3 = dynamic_cast<ds::Vector *>(dv.get()))
+		return Vector4 {v3->GetValue(), 1.f};
+	return {};
+}
+
+PbrShader::AlbedoSockets PbrShader::AddAlbedo(unirender::GroupNodeDesc &desc, Material &mat) const
+{
+	auto alphaMode = mat.GetAlphaMode();
+	auto translucent = alphaMode != AlphaMode::Opaque;
+	auto alphaCutoff = mat.GetAlphaCutoff();
+	auto colorFactor = get_color_factor(*mat.GetDataBlock(), "color_factor").value_or(Vector4 {1.f, 1.f, 1.f, 1.f});
+
+	AlbedoSockets sockets {};
+	auto albedoPath = GetTexturePath(mat.GetDiffuseMap(), "white", translucent);
+	if(albedoPath.has_value() == false) {
+		sockets.color = desc.AddConstantNode(Vector3 {colorFactor});
+		if(alphaMode == AlphaMode::Mask)
+			sockets.alpha = desc.AddConstantNode((colorFactor.w > alphaCutoff) ? 1.f : 0.f);
+		else if(translucent)
+			sockets.alpha = desc.AddConstantNode(colorFactor.w);
+		return sockets;
+	}
+	auto &nodeAlbedo = desc.AddImageTextureNode(*albedoPath, unirender::TextureType::ColorImage);
+	sockets.color = nodeAlbedo.GetOutputSocket(unirender::nodes::image_texture::OUT_COLOR);
+	if(colorFactor.x != 1.f || colorFactor.y != 1.f || colorFactor.z != 1.f)
+		sockets.color = *desc.AddVectorMathNode(sockets.color, desc.AddConstantNode(Vector3 {colorFactor}), unirender::nodes::vector_math::MathType::Multiply).GetPrimaryOutputSocket();
+	if(translucent) {
+		sockets.alpha = nodeAlbedo.GetOutputSocket(unirender::nodes::image_texture::OUT_ALPHA);
+		if(colorFactor.w != 1.f)
+			sockets.alpha = desc.AddMathNode(*sockets.alpha, desc.AddConstantNode(colorFactor.w), unirender::nodes::math::MathType::Multiply);
+		// Masked materials are either fully opaque or fully transparent
+		if(alphaMode == AlphaMode::Mask)
+			sockets.alpha = desc.AddMathNode(*sockets.alpha, desc.AddConstantNode(alphaCutoff), unirender::nodes::math::MathType::GreaterThan);
+	}
+	return sockets;
+}
+
+std::optional<unirender::Socket> PbrShader::AddAlpha(unirender::GroupNodeDesc &desc, Material &mat) const
+{
+	// Opaque materials don't need the albedo map at all
+	if(mat.GetAlphaMode() == AlphaMode::Opaque)
+		return {};
+	return AddAlbedo(desc, mat).alpha;
+}
+
+std::optional<unirender::Socket> PbrShader::AddNormal(unirender::GroupNodeDesc &desc, Material &mat) const
+{
+	auto normalPath = GetTexturePath(mat.GetNormalMap());
+	if(normalPath.has_value() == false)
+		return {};
+	return desc.AddNormalMapNode(*normalPath, {});
+}
+
+void PbrShader::LinkSurface(unirender::GroupNodeDesc &desc, unirender::NodeDesc &nodeOutput, const unirender::Socket &surface, const std::optional<unirender::Socket> &alpha) const
+{
+	if(alpha.has_value() == false) {
+		desc.Link(surface, nodeOutput.GetInputSocket(unirender::nodes::output::IN_SURFACE));
+		return;
+	}
+	auto &nodeTransparent = desc.AddNode(unirender::NODE_TRANSPARENT_BSDF);
+	auto &nodeMix = desc.AddNode(unirender::NODE_MIX_CLOSURE);
+	desc.Link(*alpha, nodeMix.GetInputSocket(unirender::nodes::mix_closure::IN_FAC));
+	desc.Link(nodeTransparent.GetOutputSocket(unirender::nodes::transparent_bsdf::OUT_BSDF), nodeMix.GetInputSocket(unirender::nodes::mix_closure::IN_CLOSURE1));
+	desc.Link(surface, nodeMix.GetInputSocket(unirender::nodes::mix_closure::IN_CLOSURE2));
+	desc.Link(nodeMix.GetOutputSocket(unirender::nodes::mix_closure::OUT_CLOSURE), nodeOutput.GetInputSocket(unirender::nodes::output::IN_SURFACE));
+}
+
+std::shared_ptr<unirender::GroupNodeDesc> PbrShader::InitializeCombinedPass()
+{
+	auto *mat = GetMaterial();
+	if(mat == nullptr)
+		return nullptr;
+	auto &dataBlock = mat->GetDataBlock();
+	auto desc = unirender::GroupNodeDesc::Create(*m_nodeManager);
+	auto &nodeOutput = desc->AddNode(unirender::NODE_OUTPUT);
+	auto &nodeBsdf = desc->AddNode(unirender::NODE_PRINCIPLED_BSDF);
+
+	auto albedo = AddAlbedo(*desc, *mat);
+	desc->Link(albedo.color, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_BASE_COLOR));
+
+	auto normal = AddNormal(*desc, *mat);
+	if(normal.has_value())
+		desc->Link(*normal, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_NORMAL));
+
+	// Roughness and metalness are stored in the green and blue channels of the RMA map
+	auto rmaPath = GetTexturePath(mat->GetRMAMap());
+	if(rmaPath.has_value()) {
+		auto roughnessFactor = 1.f;
+		auto metalnessFactor = 1.f;
+		dataBlock->GetFloat("roughness_factor", &roughnessFactor);
+		dataBlock->GetFloat("metalness_factor", &metalnessFactor);
+		auto &nodeRma = desc->AddImageTextureNode(*rmaPath, unirender::TextureType::NonColorImage);
+		auto &nodeRgb = desc->SeparateRGB(nodeRma.GetOutputSocket(unirender::nodes::image_texture::OUT_COLOR));
+		auto roughness = nodeRgb.GetOutputSocket(unirender::nodes::separate_rgb::OUT_G);
+		auto metalness = nodeRgb.GetOutputSocket(unirender::nodes::separate_rgb::OUT_B);
+		if(roughnessFactor != 1.f)
+			roughness = desc->AddMathNode(roughness, desc->AddConstantNode(roughnessFactor), unirender::nodes::math::MathType::Multiply);
+		if(metalnessFactor != 1.f)
+			metalness = desc->AddMathNode(metalness, desc->AddConstantNode(metalnessFactor), unirender::nodes::math::MathType::Multiply);
+		desc->Link(roughness, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_ROUGHNESS));
+		desc->Link(metalness, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_METALLIC));
+	}
+	else {
+		auto roughness = 0.5f;
+		auto metalness = 0.f;
+		dataBlock->GetFloat("roughness_factor", &roughness);
+		dataBlock->GetFloat("metalness_factor", &metalness);
+		nodeBsdf.SetProperty(unirender::nodes::principled_bsdf::IN_ROUGHNESS, roughness);
+		nodeBsdf.SetProperty(unirender::nodes::principled_bsdf::IN_METALLIC, metalness);
+	}
+
+	auto emissionPath = GetTexturePath(mat->GetGlowMap());
+	if(emissionPath.has_value()) {
+		auto emissionFactor = Vector3 {get_color_factor(*dataBlock, "emission_factor").value_or(Vector4 {1.f, 1.f, 1.f, 1.f})};
+		auto &nodeEmission = desc->AddImageTextureNode(*emissionPath, unirender::TextureType::ColorImage);
+		auto emission = nodeEmission.GetOutputSocket(unirender::nodes::image_texture::OUT_COLOR);
+		if(emissionFactor != Vector3 {1.f, 1.f, 1.f})
+			emission = *desc->AddVectorMathNode(emission, desc->AddConstantNode(emissionFactor), unirender::nodes::vector_math::MathType::Multiply).GetPrimaryOutputSocket();
+		desc->Link(emission, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_EMISSION));
+	}
+
+	if(albedo.alpha.has_value())
+		desc->Link(*albedo.alpha, nodeBsdf.GetInputSocket(unirender::nodes::principled_bsdf::IN_ALPHA));
+	desc->Link(nodeBsdf.GetOutputSocket(unirender::nodes::principled_bsdf::OUT_BSDF), nodeOutput.GetInputSocket(unirender::nodes::output::IN_SURFACE));
+	return desc;
+}
+
+std::shared_ptr<unirender::GroupNodeDesc> PbrShader::InitializeAlbedoPass()
+{
+	auto *mat = GetMaterial();
+	if(mat == nullptr)
+		return nullptr;
+	auto desc = unirender::GroupNodeDesc::Create(*m_nodeManager);
+	auto &nodeOutput = desc->AddNode(unirender::NODE_OUTPUT);
+	auto albedo = AddAlbedo(*desc, *mat);
+	auto &nodeEmission = desc->AddNode(unirender::NODE_EMISSION);
+	desc->Link(albedo.color, nodeEmission.GetInputSocket(unirender::nodes::emission::IN_COLOR));
+	nodeEmission.SetProperty(unirender::nodes::emission::IN_STRENGTH, 1.f);
+	LinkSurface(*desc, nodeOutput, nodeEmission.GetOutputSocket(unirender::nodes::emission::OUT_EMISSION), albedo.alpha);
+	return desc;
+}
+
+std::shared_ptr<unirender::GroupNodeDesc> PbrShader::InitializeNormalPass()
+{
+	auto *mat = GetMaterial();
+	if(mat == nullptr)
+		return nullptr;
+	auto desc = unirender::GroupNodeDesc::Create(*m_nodeManager);
+	auto &nodeOutput = desc->AddNode(unirender::NODE_OUTPUT);
+	auto normal = AddNormal(*desc, *mat);
+	if(normal.has_value() == false)
+		normal = desc->AddNode(unirender::NODE_GEOMETRY).GetOutputSocket(unirender::nodes::geometry::OUT_NORMAL);
+	auto &nodeEmission = desc->AddNode(unirender::NODE_EMISSION);
+	desc->Link(*normal, nodeEmission.GetInputSocket(unirender::nodes::emission::IN_COLOR));
+	nodeEmission.SetProperty(unirender::nodes::emission::IN_STRENGTH, 1.f);
+	LinkSurface(*desc, nodeOutput, nodeEmission.GetOutputSocket(unirender::nodes::emission::OUT_EMISSION), AddAlpha(*desc, *mat));
+	return desc;
+}
+
+std::shared_ptr<unirender::GroupNodeDesc> PbrShader::InitializeDepthPass()
+{
+	auto *mat = GetMaterial();
+	if(mat == nullptr)
+		return nullptr;
+	auto desc = unirender::GroupNodeDesc::Create(*m_nodeManager);
+	auto &nodeOutput = desc->AddNode(unirender::NODE_OUTPUT);
+	auto depth = desc->AddNode(unirender::NODE_CAMERA_INFO).GetOutputSocket(unirender::nodes::camera_info::OUT_VIEW_DISTANCE);
+	auto &nodeEmission = desc->AddNode(unirender::NODE_EMISSION);
+	desc->Link(desc->CombineRGB(depth, depth, depth), nodeEmission.GetInputSocket(unirender::nodes::emission::IN_COLOR));
+	nodeEmission.SetProperty(unirender::nodes::emission::IN_STRENGTH, 1.f);
+	LinkSurface(*desc, nodeOutput, nodeEmission.GetOutputSocket(unirender::nodes::emission::OUT_EMISSION), AddAlpha(*desc, *mat));
+	return desc;
+}
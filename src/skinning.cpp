@@ -0,0 +1,173 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/skinning.hpp"
+#include "pr_cycles/skinning_avx2.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PR_CYCLES_SKINNING_SSE
+#include <xmmintrin.h>
+#endif
+
+#ifdef PR_CYCLES_SKINNING_SSE
+// Same order of operations as glm's mat4 * vec4, so the results match the scalar path exactly
+static inline __m128 mul(const __m128 (&cols)[4], float x, float y, float z, float w)
+{
+	auto add0 = _mm_add_ps(_mm_mul_ps(cols[0], _mm_set1_ps(x)), _mm_mul_ps(cols[1], _mm_set1_ps(y)));
+	auto add1 = _mm_add_ps(_mm_mul_ps(cols[2], _mm_set1_ps(z)), _mm_mul_ps(cols[3], _mm_set1_ps(w)));
+	return _mm_add_ps(add0, add1);
+}
+#endif
+
+void pragma::modules::cycles::transform_vertices(const umath::Vertex *verts, const uint32_t *indices, const Mat4 *matrices, const Vector3 *normalOffsets, size_t count, umath::Vertex *outVerts)
+{
+	for(auto i = decltype(count) {0u}; i < count; ++i) {
+		auto idx = indices[i];
+		auto &v = verts[idx];
+		auto &m = matrices[i];
+		auto &normalOffset = normalOffsets[i];
+#ifdef PR_CYCLES_SKINNING_SSE
+		const __m128 cols[4] = {_mm_loadu_ps(&m[0][0]), _mm_loadu_ps(&m[1][0]), _mm_loadu_ps(&m[2][0]), _mm_loadu_ps(&m[3][0])};
+		alignas(16) float vpos[4];
+		alignas(16) float vn[4];
+		alignas(16) float vt[4];
+		_mm_store_ps(vpos, mul(cols, v.position.x, v.position.y, v.position.z, 1.f));
+		_mm_store_ps(vn, mul(cols, v.normal.x, v.normal.y, v.normal.z, 0.f));
+		_mm_store_ps(vt, mul(cols, v.tangent.x, v.tangent.y, v.tangent.z, 0.f));
+		Vector3 pos {vpos[0], vpos[1], vpos[2]};
+		pos /= vpos[3];
+		Vector3 n {vn[0], vn[1], vn[2]};
+		Vector3 nt {vt[0], vt[1], vt[2]};
+#else
+		auto vpos = m * Vector4 {v.position.x, v.position.y, v.position.z, 1.f};
+		auto vn = m * Vector4 {v.normal.x, v.normal.y, v.normal.z, 0.f};
+		auto vt = m * Vector4 {v.tangent.x, v.tangent.y, v.tangent.z, 0.f};
+		Vector3 pos {vpos.x, vpos.y, vpos.z};
+		pos /= vpos.w;
+		Vector3 n {vn.x, vn.y, vn.z};
+		Vector3 nt {vt.x, vt.y, vt.z};
+#endif
+		n += normalOffset;
+		uvec::normalize(&n);
+		nt += normalOffset;
+		uvec::normalize(&nt);
+
+		auto &vTransformed = outVerts[idx];
+		vTransformed = {};
+		vTransformed.position = pos;
+		vTransformed.normal = n;
+		vTransformed.tangent = {nt, vTransformed.tangent.w};
+		vTransformed.uv = v.uv;
+	}
+}
+
+// The operation order has to stay in sync with skinning_avx2.cpp, otherwise the two paths no longer produce identical results
+static void transform_point(const float (&m)[16], float x, float y, float z, float w, float (&out)[4])
+{
+	for(auto k = 0u; k < 4; ++k)
+		out[k] = (m[k] * x + m[4 + k] * y) + (m[8 + k] * z + m[12 + k] * w);
+}
+
+static void normalize(float (&v)[4])
+{
+	auto len = std::sqrt((v[0] * v[0] + v[1] * v[1]) + v[2] * v[2]);
+	if(len > 0.f) {
+		auto invLen = 1.f / len;
+		v[0] *= invLen;
+		v[1] *= invLen;
+		v[2] *= invLen;
+	}
+}
+
+void pragma::modules::cycles::skin_vertices_scalar(const umath::Vertex *verts, const umath::VertexWeight *weights, size_t count, const Mat4 *palette, uint32_t numBones, umath::Vertex *outVerts)
+{
+	constexpr float zero[16] = {};
+	for(auto i = decltype(count) {0u}; i < count; ++i) {
+		auto &v = verts[i];
+		auto &vw = weights[i];
+		auto &vOut = outVerts[i];
+		vOut = v;
+
+		// Invalid slots still add zero, so the accumulation matches the masked gathers of the AVX2 path
+		float m[16] = {};
+		auto hasWeight = false;
+		for(auto j = 0u; j < 4; ++j) {
+			auto boneId = vw.boneIds[j];
+			auto valid = (boneId >= 0 && static_cast<uint32_t>(boneId) < numBones);
+			auto weight = valid ? vw.weights[j] : 0.f;
+			auto *bm = valid ? &palette[boneId][0][0] : zero;
+			hasWeight = hasWeight || (valid && weight != 0.f);
+			for(auto e = 0u; e < 16; ++e)
+				m[e] += weight * bm[e];
+		}
+		if(hasWeight == false)
+			continue;
+
+		float pos[4];
+		float n[4];
+		float t[4];
+		transform_point(m, v.position.x, v.position.y, v.position.z, 1.f, pos);
+		transform_point(m, v.normal.x, v.normal.y, v.normal.z, 0.f, n);
+		transform_point(m, v.tangent.x, v.tangent.y, v.tangent.z, 0.f, t);
+		normalize(n);
+		normalize(t);
+		auto invW = 1.f / pos[3];
+		vOut.position = {pos[0] * invW, pos[1] * invW, pos[2] * invW};
+		vOut.normal = {n[0], n[1], n[2]};
+		vOut.tangent = {t[0], t[1], t[2], v.tangent.w};
+	}
+}
+
+bool pragma::modules::cycles::is_avx2_skinning_available()
+{
+	static auto available = []() {
+		if(detail::is_avx2_skinning_compiled() == false)
+			return false;
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if(info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		auto osxsave = (info[2] & (1 << 27)) != 0;
+		auto avx = (info[2] & (1 << 28)) != 0;
+		if(!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		return __builtin_cpu_supports("avx2") != 0;
+#else
+		return false;
+#endif
+	}();
+	return available;
+}
+
+void pragma::modules::cycles::skin_vertices(const umath::Vertex *verts, const umath::VertexWeight *weights, size_t count, const Mat4 *palette, uint32_t numBones, umath::Vertex *outVerts)
+{
+	size_t numProcessed = 0;
+	if(is_avx2_skinning_available()) {
+		detail::SkinningLayout layout {};
+		layout.vertexStride = sizeof(umath::Vertex);
+		layout.positionOffset = offsetof(umath::Vertex, position);
+		layout.normalOffset = offsetof(umath::Vertex, normal);
+		layout.tangentOffset = offsetof(umath::Vertex, tangent);
+		layout.weightStride = sizeof(umath::VertexWeight);
+		layout.boneIdOffset = offsetof(umath::VertexWeight, boneIds);
+		layout.weightOffset = offsetof(umath::VertexWeight, weights);
+		numProcessed = detail::skin_vertices_avx2(reinterpret_cast<const uint8_t *>(verts), reinterpret_cast<const uint8_t *>(weights), count, reinterpret_cast<const float *>(palette), numBones, reinterpret_cast<uint8_t *>(outVerts), layout);
+	}
+	skin_vertices_scalar(verts + numProcessed, weights + numProcessed, count - numProcessed, palette, numBones, outVerts + numProcessed);
+}
@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/skinning_avx2.hpp"
+
+// This file is compiled with AVX2 enabled (see CMakeLists.txt) and is only called into if the CPU supports it
+#ifdef __AVX2__
+#include <immintrin.h>
+#include <cstring>
+
+bool pragma::modules::cycles::detail::is_avx2_skinning_compiled() { return true; }
+
+// Same order of operations as transform_point in skinning.cpp
+static inline __m256 transform_component(const __m256 (&m)[16], uint32_t k, __m256 x, __m256 y, __m256 z, __m256 w)
+{
+	auto add0 = _mm256_add_ps(_mm256_mul_ps(m[k], x), _mm256_mul_ps(m[4 + k], y));
+	auto add1 = _mm256_add_ps(_mm256_mul_ps(m[8 + k], z), _mm256_mul_ps(m[12 + k], w));
+	return _mm256_add_ps(add0, add1);
+}
+
+static inline void normalize(__m256 &x, __m256 &y, __m256 &z)
+{
+	auto len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+	auto mask = _mm256_cmp_ps(len, _mm256_setzero_ps(), _CMP_GT_OQ);
+	auto invLen = _mm256_div_ps(_mm256_set1_ps(1.f), len);
+	x = _mm256_blendv_ps(x, _mm256_mul_ps(x, invLen), mask);
+	y = _mm256_blendv_ps(y, _mm256_mul_ps(y, invLen), mask);
+	z = _mm256_blendv_ps(z, _mm256_mul_ps(z, invLen), mask);
+}
+
+// Transposes the 8x8 matrix in rows, so rows[i] contains the former column i
+static inline void transpose8(__m256 (&rows)[8])
+{
+	auto t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+	auto t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+	auto t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+	auto t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+	auto t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+	auto t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+	auto t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+	auto t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+	auto u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	auto u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	auto u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	auto u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	auto u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	auto u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	auto u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	auto u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+	rows[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+	rows[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+	rows[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+	rows[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+	rows[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+	rows[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+	rows[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+	rows[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+size_t pragma::modules::cycles::detail::skin_vertices_avx2(const uint8_t *verts, const uint8_t *weights, size_t count, const float *palette, uint32_t numBones, uint8_t *outVerts, const SkinningLayout &layout)
+{
+	constexpr size_t blockSize = 8;
+	alignas(32) static constexpr float zeroMatrix[16] = {};
+	auto numBlocks = count / blockSize;
+	auto stride = static_cast<int32_t>(layout.vertexStride);
+	auto vertexOffsets = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+	for(auto block = decltype(numBlocks) {0u}; block < numBlocks; ++block) {
+		auto first = block * blockSize;
+
+		// Blend the bone matrices of every vertex (the 16 matrix elements fit into two registers) and transpose the matrices into SoA layout.
+		// Invalid slots add the zero matrix with a weight of zero, like the scalar path.
+		__m256 lo[blockSize];
+		__m256 hi[blockSize];
+		auto laneMask = 0;
+		for(auto lane = decltype(blockSize) {0u}; lane < blockSize; ++lane) {
+			auto *vw = weights + (first + lane) * layout.weightStride;
+			int32_t ids[4];
+			float ws[4];
+			std::memcpy(ids, vw + layout.boneIdOffset, sizeof(ids));
+			std::memcpy(ws, vw + layout.weightOffset, sizeof(ws));
+			auto mlo = _mm256_setzero_ps();
+			auto mhi = _mm256_setzero_ps();
+			for(auto j = 0u; j < 4; ++j) {
+				auto valid = (ids[j] >= 0 && static_cast<uint32_t>(ids[j]) < numBones);
+				auto weight = valid ? ws[j] : 0.f;
+				auto *bm = valid ? (palette + static_cast<size_t>(ids[j]) * 16) : zeroMatrix;
+				if(valid && weight != 0.f)
+					laneMask |= 1 << lane;
+				auto w = _mm256_set1_ps(weight);
+				mlo = _mm256_add_ps(mlo, _mm256_mul_ps(w, _mm256_loadu_ps(bm)));
+				mhi = _mm256_add_ps(mhi, _mm256_mul_ps(w, _mm256_loadu_ps(bm + 8)));
+			}
+			lo[lane] = mlo;
+			hi[lane] = mhi;
+		}
+		std::memcpy(outVerts + first * layout.vertexStride, verts + first * layout.vertexStride, blockSize * layout.vertexStride);
+		if(laneMask == 0)
+			continue;
+
+		transpose8(lo);
+		transpose8(hi);
+		const __m256 m[16] = {lo[0], lo[1], lo[2], lo[3], lo[4], lo[5], lo[6], lo[7], hi[0], hi[1], hi[2], hi[3], hi[4], hi[5], hi[6], hi[7]};
+
+		// Gather the positions, normals and tangents of the block in SoA layout
+		auto *blockVerts = verts + first * layout.vertexStride;
+		const size_t offsets[3] = {layout.positionOffset, layout.normalOffset, layout.tangentOffset};
+		__m256 v[9];
+		for(auto i = 0u; i < 9; ++i)
+			v[i] = _mm256_i32gather_ps(reinterpret_cast<const float *>(blockVerts + offsets[i / 3] + (i % 3) * sizeof(float)), vertexOffsets, 1);
+
+		auto one = _mm256_set1_ps(1.f);
+		auto zero = _mm256_setzero_ps();
+		auto invW = _mm256_div_ps(one, transform_component(m, 3, v[0], v[1], v[2], one));
+		auto px = _mm256_mul_ps(transform_component(m, 0, v[0], v[1], v[2], one), invW);
+		auto py = _mm256_mul_ps(transform_component(m, 1, v[0], v[1], v[2], one), invW);
+		auto pz = _mm256_mul_ps(transform_component(m, 2, v[0], v[1], v[2], one), invW);
+		auto nx = transform_component(m, 0, v[3], v[4], v[5], zero);
+		auto ny = transform_component(m, 1, v[3], v[4], v[5], zero);
+		auto nz = transform_component(m, 2, v[3], v[4], v[5], zero);
+		auto tx = transform_component(m, 0, v[6], v[7], v[8], zero);
+		auto ty = transform_component(m, 1, v[6], v[7], v[8], zero);
+		auto tz = transform_component(m, 2, v[6], v[7], v[8], zero);
+		normalize(nx, ny, nz);
+		normalize(tx, ty, tz);
+
+		alignas(32) float out[9][blockSize];
+		_mm256_store_ps(out[0], px);
+		_mm256_store_ps(out[1], py);
+		_mm256_store_ps(out[2], pz);
+		_mm256_store_ps(out[3], nx);
+		_mm256_store_ps(out[4], ny);
+		_mm256_store_ps(out[5], nz);
+		_mm256_store_ps(out[6], tx);
+		_mm256_store_ps(out[7], ty);
+		_mm256_store_ps(out[8], tz);
+		for(auto lane = decltype(blockSize) {0u}; lane < blockSize; ++lane) {
+			if((laneMask & (1 << lane)) == 0)
+				continue;
+			auto *vOut = outVerts + (first + lane) * layout.vertexStride;
+			float pos[3] = {out[0][lane], out[1][lane], out[2][lane]};
+			float n[3] = {out[3][lane], out[4][lane], out[5][lane]};
+			float t[3] = {out[6][lane], out[7][lane], out[8][lane]};
+			std::memcpy(vOut + layout.positionOffset, pos, sizeof(pos));
+			std::memcpy(vOut + layout.normalOffset, n, sizeof(n));
+			std::memcpy(vOut + layout.tangentOffset, t, sizeof(t));
+		}
+	}
+	return numBlocks * blockSize;
+}
+#else
+bool pragma::modules::cycles::detail::is_avx2_skinning_compiled() { return false; }
+size_t pragma::modules::cycles::detail::skin_vertices_avx2(const uint8_t *verts, const uint8_t *weights, size_t count, const float *palette, uint32_t numBones, uint8_t *outVerts, const SkinningLayout &layout) { return 0; }
+#endif
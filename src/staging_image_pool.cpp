@@ -0,0 +1,82 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/staging_image_pool.hpp"
+#include <algorithm>
+
+using namespace pragma::modules::cycles;
+
+uint32_t StagingImagePool::GetSizeClass(uint32_t size)
+{
+	// The next power of two isn't representable, the shift below would overflow to 0 and never terminate
+	if(size > (1u << 31))
+		return size;
+	auto sizeClass = MIN_SIZE_CLASS;
+	while(sizeClass < size)
+		sizeClass <<= 1;
+	return sizeClass;
+}
+
+StagingImagePool::StagingImagePool(const ImageFactory &factory, uint32_t maxImages) : m_factory {factory}, m_maxImages {maxImages} { m_entries.reserve(maxImages); }
+
+std::shared_ptr<prosper::IImage> StagingImagePool::Acquire(uint32_t w, uint32_t h)
+{
+	auto wClass = GetSizeClass(w);
+	auto hClass = GetSizeClass(h);
+	auto it = std::find_if(m_entries.begin(), m_entries.end(), [wClass, hClass](const Entry &entry) { return !entry.inUse && entry.width == wClass && entry.height == hClass; });
+	if(it != m_entries.end()) {
+		++m_stats.hits;
+		++m_stats.imagesInUse;
+		it->inUse = true;
+		return it->image;
+	}
+
+	if(m_entries.size() >= m_maxImages) {
+		// Evict the least recently used image that isn't in use
+		auto itEvict = m_entries.end();
+		for(auto itEntry = m_entries.begin(); itEntry != m_entries.end(); ++itEntry) {
+			if(itEntry->inUse || (itEvict != m_entries.end() && itEvict->lastUse <= itEntry->lastUse))
+				continue;
+			itEvict = itEntry;
+		}
+		if(itEvict == m_entries.end()) {
+			++m_stats.failedRequests;
+			return nullptr;
+		}
+		m_entries.erase(itEvict);
+		++m_stats.evictions;
+	}
+
+	auto img = m_factory(wClass, hClass);
+	if(!img) {
+		++m_stats.failedRequests;
+		return nullptr;
+	}
+	++m_stats.misses;
+	m_entries.push_back({img, wClass, hClass, true, 0});
+	m_stats.imageCount = m_entries.size();
+	m_stats.peakImageCount = std::max(m_stats.peakImageCount, m_stats.imageCount);
+	++m_stats.imagesInUse;
+	return img;
+}
+
+void StagingImagePool::Release(const std::shared_ptr<prosper::IImage> &img)
+{
+	auto it = std::find_if(m_entries.begin(), m_entries.end(), [&img](const Entry &entry) { return entry.image == img; });
+	if(it == m_entries.end() || !it->inUse)
+		return;
+	it->inUse = false;
+	it->lastUse = ++m_useCounter;
+	--m_stats.imagesInUse;
+}
+
+void StagingImagePool::Clear()
+{
+	// Images that are still in use stay alive through their owners
+	m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [](const Entry &entry) { return !entry.inUse; }), m_entries.end());
+	m_stats.imageCount = m_entries.size();
+}
@@ -7,7 +7,11 @@
 
 #ifdef RT_ENABLE_SUBDIVISION
 #include "pr_cycles/subdivision.hpp"
+#include "pr_cycles/parallel.hpp"
 #include <mathutil/umath.h>
+#include <unordered_map>
+#include <numeric>
+#include <cmath>
 
 struct OsdVertexWeight {
 	OsdVertexWeight() { Clear(); }
@@ -23,18 +27,77 @@ struct OsdVertexWeight {
 	umath::VertexWeight vw {};
 };
 
-void pragma::modules::cycles::subdivide_mesh(const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &tris, std::vector<umath::Vertex> &outVerts, std::vector<int32_t> &outTris, uint32_t subDivLevel, const std::vector<std::shared_ptr<BaseChannelData>> &miscAttributes)
+// Meshes with fewer resulting faces are refined level by level, since the stencil tables would cost more than they save.
+// The two paths sum up the weights in a different order, so the path must only depend on the mesh, never on the number of threads.
+static constexpr int PARALLEL_SUBDIVISION_FACE_THRESHOLD = 100'000;
+
+struct GridCell {
+	int64_t x, y, z;
+	bool operator==(const GridCell &other) const { return x == other.x && y == other.y && z == other.z; }
+};
+struct GridCellHash {
+	size_t operator()(const GridCell &cell) const
+	{
+		auto h = std::hash<int64_t> {}(cell.x);
+		h ^= std::hash<int64_t> {}(cell.y) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		h ^= std::hash<int64_t> {}(cell.z) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		return h;
+	}
+};
+
+// Maps every vertex to the unique vertex of the first earlier vertex with a squared distance below epsilon, or a new unique vertex if there is none.
+// Vertices are sorted into a grid with a cell size of sqrt(epsilon), so only the 27 surrounding cells have to be searched for candidates.
+template<typename TAddUniqueVertex>
+static void weld_vertices(const std::vector<umath::Vertex> &verts, float epsilon, std::vector<int32_t> &outUniqueIndices, const TAddUniqueVertex &addUniqueVertex)
+{
+	outUniqueIndices.resize(verts.size());
+	auto cellSize = std::sqrt(epsilon);
+	auto getCell = [cellSize](const Vector3 &pos) -> GridCell { return {static_cast<int64_t>(std::floor(pos.x / cellSize)), static_cast<int64_t>(std::floor(pos.y / cellSize)), static_cast<int64_t>(std::floor(pos.z / cellSize))}; };
+	std::unordered_map<GridCell, std::vector<uint32_t>, GridCellHash> grid {};
+	grid.reserve(verts.size());
+	for(auto i = decltype(verts.size()) {0u}; i < verts.size(); ++i) {
+		auto &v0 = verts.at(i);
+		auto cell = getCell(v0.position);
+		auto match = std::numeric_limits<uint32_t>::max();
+		for(auto x = cell.x - 1; x <= cell.x + 1; ++x) {
+			for(auto y = cell.y - 1; y <= cell.y + 1; ++y) {
+				for(auto z = cell.z - 1; z <= cell.z + 1; ++z) {
+					auto it = grid.find({x, y, z});
+					if(it == grid.end())
+						continue;
+					// Indices within a cell are in ascending order, so the first match is the earliest one of the cell
+					for(auto j : it->second) {
+						if(j >= match)
+							break;
+						if(uvec::distance_sqr(v0.position, verts.at(j).position) < epsilon) {
+							match = j;
+							break;
+						}
+					}
+				}
+			}
+		}
+		if(match != std::numeric_limits<uint32_t>::max())
+			outUniqueIndices.at(i) = outUniqueIndices.at(match);
+		else
+			outUniqueIndices.at(i) = addUniqueVertex(v0.position);
+		grid[cell].push_back(i);
+	}
+}
+
+void pragma::modules::cycles::subdivide_mesh(const std::vector<umath::Vertex> &verts, const std::vector<int32_t> &tris, std::vector<umath::Vertex> &outVerts, std::vector<int32_t> &outTris, uint32_t subDivLevel, const std::vector<std::shared_ptr<BaseChannelData>> &miscAttributes,
+  uint32_t numThreads)
 {
 	std::vector<std::shared_ptr<BaseChannelData>> vertexAttributes {};
 	vertexAttributes.reserve(miscAttributes.size() + 3);
-	auto vertexData = std::make_shared<ChannelData<OsdVertex>>([](BaseChannelData &cd, FaceVertexIndex faceVertexIndex, umath::Vertex &v, int idx) { v.position = static_cast<OsdVertex *>(cd.GetElementPtr(idx))->value; });
+	auto vertexData = std::make_shared<ChannelData<OsdVertex>>(ChannelTarget::Position);
 	vertexAttributes.push_back(vertexData);
 
-	auto uvData = std::make_shared<ChannelData<OsdUV>>([](BaseChannelData &cd, FaceVertexIndex faceVertexIndex, umath::Vertex &v, int idx) { v.uv = static_cast<OsdUV *>(cd.GetElementPtr(idx))->value; });
+	auto uvData = std::make_shared<ChannelData<OsdUV>>(ChannelTarget::Uv);
 	vertexAttributes.push_back(uvData);
 	uvData->ReserveBuffer(verts.size());
 
-	auto normData = std::make_shared<ChannelData<OsdVertex>>([](BaseChannelData &cd, FaceVertexIndex faceVertexIndex, umath::Vertex &v, int idx) { v.normal = static_cast<OsdVertex *>(cd.GetElementPtr(idx))->value; });
+	auto normData = std::make_shared<ChannelData<OsdVertex>>(ChannelTarget::Normal);
 	vertexAttributes.push_back(normData);
 	normData->ReserveBuffer(verts.size());
 
@@ -47,29 +110,14 @@ void pragma::modules::cycles::subdivide_mesh(const std::vector<umath::Vertex> &v
 		normData->buffer.push_back({v.normal});
 	}
 
+	constexpr float VERTEX_EPSILON = 0.02f;
 	std::vector<int32_t> originalVertexIndexToUniqueIndex;
-	originalVertexIndexToUniqueIndex.resize(verts.size());
 	vertexData->ReserveBuffer(verts.size());
-	constexpr float VERTEX_EPSILON = 0.02f;
-	for(auto i = decltype(verts.size()) {0u}; i < verts.size(); ++i) {
-		auto &v0 = verts.at(i);
-
-		auto wasInserted = false;
-		for(auto j = decltype(verts.size()) {0u}; j < i; ++j) {
-			auto &v1 = verts.at(j);
-			auto d = uvec::distance_sqr(v0.position, v1.position);
-			if(d < VERTEX_EPSILON) {
-				wasInserted = true;
-				originalVertexIndexToUniqueIndex.at(i) = originalVertexIndexToUniqueIndex.at(j);
-				break;
-			}
-		}
-		if(wasInserted)
-			continue;
+	weld_vertices(verts, VERTEX_EPSILON, originalVertexIndexToUniqueIndex, [&vertexData](const Vector3 &pos) -> int32_t {
 		vertexData->buffer.push_back({});
-		vertexData->buffer.back().value = v0.position;
-		originalVertexIndexToUniqueIndex.at(i) = vertexData->buffer.size() - 1;
-	}
+		vertexData->buffer.back().value = pos;
+		return vertexData->buffer.size() - 1;
+	});
 
 	std::cout << "Reduced mesh vertex count from " << verts.size() << " to " << vertexData->buffer.size() << std::endl;
 
@@ -106,69 +154,92 @@ void pragma::modules::cycles::subdivide_mesh(const std::vector<umath::Vertex> &v
 	desc.numFVarChannels = channels.size();
 	desc.fvarChannels = channels.data();
 
-	auto *refiner = OpenSubdiv::Far::TopologyRefinerFactory<OpenSubdiv::Far::TopologyDescriptor>::Create(desc, OpenSubdiv::Far::TopologyRefinerFactory<OpenSubdiv::Far::TopologyDescriptor>::Options(type, options));
+	std::unique_ptr<OpenSubdiv::Far::TopologyRefiner> refiner {OpenSubdiv::Far::TopologyRefinerFactory<OpenSubdiv::Far::TopologyDescriptor>::Create(desc, OpenSubdiv::Far::TopologyRefinerFactory<OpenSubdiv::Far::TopologyDescriptor>::Options(type, options))};
 
 	OpenSubdiv::Far::TopologyRefiner::UniformOptions refineOptions(subDivLevel);
 	refineOptions.fullTopologyInLastLevel = true;
 	refiner->RefineUniform(refineOptions);
 
-	for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i)
-		vertexAttributes.at(i)->ResizeBuffer((i == 0) ? refiner->GetNumVerticesTotal() : refiner->GetNumFVarValuesTotal(i - 1));
-
-	OpenSubdiv::Far::PrimvarRefiner primvarRefiner {*refiner};
-	std::vector<uint8_t *> attrPtrs {};
-	attrPtrs.reserve(vertexAttributes.size());
-	for(auto &attr : vertexAttributes)
-		attrPtrs.push_back(static_cast<uint8_t *>(attr->GetDataPtr()));
-	for(auto level = decltype(subDivLevel) {1}; level <= subDivLevel; ++level) {
-		for(auto i = decltype(attrPtrs.size()) {0u}; i < attrPtrs.size(); ++i) {
-			auto *src = attrPtrs.at(i);
-			auto n = (i == 0) ? refiner->GetLevel(level - 1).GetNumVertices() : refiner->GetLevel(level - 1).GetNumFVarValues(i - 1);
-			auto *dst = src + n * vertexAttributes.at(i)->GetElementSize();
-			vertexAttributes.at(i)->Interpolate(primvarRefiner, level, src, dst, i);
-			attrPtrs.at(i) = dst;
-		}
-	}
-
 	auto &refLastLevel = refiner->GetLevel(subDivLevel);
 	std::vector<int> numResultAttrs {};
 	std::vector<int> firstOfLastAttrs {};
 	numResultAttrs.resize(vertexAttributes.size());
 	firstOfLastAttrs.resize(vertexAttributes.size());
-	for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i) {
+	for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i)
 		numResultAttrs.at(i) = (i == 0) ? refLastLevel.GetNumVertices() : refLastLevel.GetNumFVarValues(i - 1);
-		firstOfLastAttrs.at(i) = (i == 0) ? (refiner->GetNumVerticesTotal() - numResultAttrs.at(i)) : (refiner->GetNumFVarValuesTotal(i - 1) - numResultAttrs.at(i));
-	}
 
-	auto numResultFaces = refLastLevel.GetNumFaces();
-	outVerts.reserve(numResultFaces * 3);
-	outTris.reserve(numResultFaces * 3);
-	for(auto &attr : vertexAttributes)
-		attr->PrepareResultData(numResultFaces);
-	for(auto face = decltype(numResultFaces) {0u}; face < numResultFaces; ++face) {
-		std::vector<OpenSubdiv::Far::ConstIndexArray> attrIndices;
-		attrIndices.reserve(numResultAttrs.size());
-		for(auto i = decltype(numResultAttrs.size()) {0u}; i < numResultAttrs.size(); ++i)
-			attrIndices.push_back((i == 0) ? refLastLevel.GetFaceVertices(face) : refLastLevel.GetFaceFVarValues(face, i - 1));
-
-		for(uint8_t i = 0; i < 3; ++i) {
-			umath::Vertex v {};
-			for(auto j = decltype(numResultAttrs.size()) {0u}; j < numResultAttrs.size(); ++j) {
-				auto &attr = vertexAttributes.at(j);
-				auto idx = firstOfLastAttrs.at(j) + attrIndices.at(j)[i];
-				attr->Apply(face * 3 + i, v, idx);
+	if(refLastLevel.GetNumFaces() >= PARALLEL_SUBDIVISION_FACE_THRESHOLD) {
+		// Build a stencil table per channel, which maps the control values directly to the values of the last level.
+		// Stencils are independent of each other, so all channels can be evaluated in parallel in ranges. Every stencil is
+		// evaluated in the same order regardless of the thread it runs on, so the result doesn't depend on numThreads.
+		std::vector<std::unique_ptr<const OpenSubdiv::Far::StencilTable>> stencilTables;
+		stencilTables.reserve(vertexAttributes.size());
+		for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i) {
+			OpenSubdiv::Far::StencilTableFactory::Options stencilOptions {};
+			stencilOptions.generateOffsets = true;
+			stencilOptions.generateIntermediateLevels = false;
+			if(i > 0) {
+				stencilOptions.interpolationMode = OpenSubdiv::Far::StencilTableFactory::INTERPOLATE_FACE_VARYING;
+				stencilOptions.fvarChannel = static_cast<int>(i - 1);
 			}
-			auto it = outVerts.end(); /*std::find_if(outVerts.begin(),outVerts.end(),[&v,VERTEX_EPSILON](const umath::Vertex &vOther) {
-				return vOther.Equal(v,VERTEX_EPSILON);
-			});*/
-			if(it == outVerts.end()) {
-				outVerts.push_back(v);
-				it = outVerts.end() - 1;
+			stencilTables.emplace_back(OpenSubdiv::Far::StencilTableFactory::Create(*refiner, stencilOptions));
+
+			// Control values are followed by the values of the last level
+			auto numControlValues = (i == 0) ? refiner->GetLevel(0).GetNumVertices() : refiner->GetLevel(0).GetNumFVarValues(i - 1);
+			vertexAttributes.at(i)->ResizeBuffer(numControlValues + numResultAttrs.at(i));
+			firstOfLastAttrs.at(i) = numControlValues;
+		}
+
+		struct StencilRange {
+			uint32_t channel;
+			int start;
+			int end;
+		};
+		constexpr int rangeSize = 4'096;
+		std::vector<StencilRange> ranges;
+		for(auto i = decltype(stencilTables.size()) {0u}; i < stencilTables.size(); ++i) {
+			auto numStencils = stencilTables.at(i)->GetNumStencils();
+			for(auto start = 0; start < numStencils; start += rangeSize)
+				ranges.push_back({static_cast<uint32_t>(i), start, std::min(start + rangeSize, numStencils)});
+		}
+		parallel_for(
+		  ranges.size(),
+		  [&ranges, &vertexAttributes, &stencilTables, &firstOfLastAttrs](size_t idx) {
+			  auto &range = ranges.at(idx);
+			  vertexAttributes.at(range.channel)->UpdateValues(*stencilTables.at(range.channel), firstOfLastAttrs.at(range.channel), range.start, range.end);
+		  },
+		  numThreads);
+	}
+	else {
+		for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i) {
+			vertexAttributes.at(i)->ResizeBuffer((i == 0) ? refiner->GetNumVerticesTotal() : refiner->GetNumFVarValuesTotal(i - 1));
+			firstOfLastAttrs.at(i) = (i == 0) ? (refiner->GetNumVerticesTotal() - numResultAttrs.at(i)) : (refiner->GetNumFVarValuesTotal(i - 1) - numResultAttrs.at(i));
+		}
+
+		OpenSubdiv::Far::PrimvarRefiner primvarRefiner {*refiner};
+		std::vector<uint8_t *> attrPtrs {};
+		attrPtrs.reserve(vertexAttributes.size());
+		for(auto &attr : vertexAttributes)
+			attrPtrs.push_back(static_cast<uint8_t *>(attr->GetDataPtr()));
+		for(auto level = decltype(subDivLevel) {1}; level <= subDivLevel; ++level) {
+			for(auto i = decltype(attrPtrs.size()) {0u}; i < attrPtrs.size(); ++i) {
+				auto *src = attrPtrs.at(i);
+				auto n = (i == 0) ? refiner->GetLevel(level - 1).GetNumVertices() : refiner->GetLevel(level - 1).GetNumFVarValues(i - 1);
+				auto *dst = src + n * vertexAttributes.at(i)->GetElementSize();
+				vertexAttributes.at(i)->Interpolate(primvarRefiner, level, src, dst, i);
+				attrPtrs.at(i) = dst;
 			}
-			outTris.push_back(it - outVerts.begin());
 		}
 	}
 
+	// Every face-vertex becomes its own output vertex, so the triangle indices are simply sequential
+	auto numResultFaces = refLastLevel.GetNumFaces();
+	outVerts.resize(numResultFaces * 3);
+	outTris.resize(numResultFaces * 3);
+	std::iota(outTris.begin(), outTris.end(), 0);
+	for(auto i = decltype(vertexAttributes.size()) {0u}; i < vertexAttributes.size(); ++i)
+		vertexAttributes.at(i)->WriteResult(refLastLevel, static_cast<int>(i) - 1, firstOfLastAttrs.at(i), outVerts);
+
 	std::cout << "Reduced final vertex count from " << refLastLevel.GetNumVertices() << " to " << outVerts.size() << std::endl;
 
 #if 0
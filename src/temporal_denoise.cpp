@@ -0,0 +1,122 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+* License, v. 2.0. If a copy of the MPL was not distributed with this
+* file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*
+* Copyright (c) 2023 Silverlan
+*/
+
+#include "pr_cycles/denoise.hpp"
+#include "pr_cycles/parallel.hpp"
+#include <util_image_buffer.hpp>
+#include <mathutil/umath.h>
+#include <cstring>
+
+static std::shared_ptr<uimg::ImageBuffer> to_rgb_float_image(const std::shared_ptr<uimg::ImageBuffer> &img, uint32_t w, uint32_t h)
+{
+	if(!img || img->GetWidth() != w || img->GetHeight() != h)
+		return nullptr;
+	if(img->GetFormat() == uimg::Format::RGB_FLOAT)
+		return img;
+	auto copy = img->Copy();
+	copy->Convert(uimg::Format::RGB_FLOAT);
+	return copy;
+}
+
+// Bilinear sample at pixel coordinates, where integer coordinates are pixel centers
+static bool sample_bilinear(const float *data, uint32_t w, uint32_t h, float x, float y, Vector3 &outColor)
+{
+	if(x < -0.5f || y < -0.5f || x > w - 0.5f || y > h - 0.5f)
+		return false;
+	x = umath::clamp(x, 0.f, static_cast<float>(w - 1));
+	y = umath::clamp(y, 0.f, static_cast<float>(h - 1));
+	auto x0 = static_cast<uint32_t>(x);
+	auto y0 = static_cast<uint32_t>(y);
+	auto x1 = std::min(x0 + 1, w - 1);
+	auto y1 = std::min(y0 + 1, h - 1);
+	auto fx = x - x0;
+	auto fy = y - y0;
+	auto get = [data, w](uint32_t x, uint32_t y) -> Vector3 {
+		auto *p = data + (static_cast<size_t>(y) * w + x) * 3;
+		return {p[0], p[1], p[2]};
+	};
+	outColor = glm::mix(glm::mix(get(x0, y0), get(x1, y0), fx), glm::mix(get(x0, y1), get(x1, y1), fx), fy);
+	return true;
+}
+
+bool pragma::modules::cycles::apply_temporal_denoise(uimg::ImageBuffer &current, const uimg::ImageBuffer &history, const TemporalFrameInfo &currentInfo, const TemporalFrameInfo &historyInfo, const TemporalDenoiseSettings &settings, uint32_t numThreads)
+{
+	auto w = current.GetWidth();
+	auto h = current.GetHeight();
+	if(current.GetFormat() != uimg::Format::RGB_FLOAT || history.GetFormat() != uimg::Format::RGB_FLOAT || history.GetWidth() != w || history.GetHeight() != h)
+		return false;
+	auto motionVectors = to_rgb_float_image(currentInfo.motionVectors, w, h);
+	auto depth = motionVectors ? nullptr : to_rgb_float_image(currentInfo.depth, w, h);
+	auto useCamera = depth && currentInfo.view && currentInfo.projection && historyInfo.view && historyInfo.projection;
+	Mat4 invViewProj {};
+	Mat4 historyViewProj {};
+	Vector3 camPos {};
+	if(useCamera) {
+		invViewProj = glm::inverse(*currentInfo.projection * *currentInfo.view);
+		historyViewProj = *historyInfo.projection * *historyInfo.view;
+		camPos = Vector3 {glm::inverse(*currentInfo.view)[3]};
+	}
+
+	auto *curData = static_cast<const float *>(current.GetData());
+	auto *historyData = static_cast<const float *>(history.GetData());
+	auto *motionData = motionVectors ? static_cast<const float *>(motionVectors->GetData()) : nullptr;
+	auto *depthData = useCamera ? static_cast<const float *>(depth->GetData()) : nullptr;
+	std::vector<float> result(static_cast<size_t>(w) * h * 3);
+	parallel_for(
+	  h,
+	  [&](size_t y) {
+		  for(auto x = decltype(w) {0u}; x < w; ++x) {
+			  auto idx = (y * w + x) * 3;
+			  Vector3 color {curData[idx], curData[idx + 1], curData[idx + 2]};
+			  Vector2 historyPos {static_cast<float>(x), static_cast<float>(y)};
+			  auto hasHistory = true;
+			  if(motionData)
+				  historyPos += Vector2 {motionData[idx], motionData[idx + 1]};
+			  else if(depthData) {
+				  // Reconstruct the world position from the view distance and project it with the camera of the previous frame.
+				  // Row 0 is at NDC y = -1, the depth is the distance along the ray (see TemporalFrameInfo).
+				  Vector4 ndc {(x + 0.5f) / w * 2.f - 1.f, (y + 0.5f) / h * 2.f - 1.f, 1.f, 1.f};
+				  auto farPos = invViewProj * ndc;
+				  auto dir = glm::normalize(Vector3 {farPos} / farPos.w - camPos);
+				  auto clipPos = historyViewProj * Vector4 {camPos + dir * depthData[idx], 1.f};
+				  if(clipPos.w <= 0.f)
+					  hasHistory = false;
+				  else
+					  historyPos = {(clipPos.x / clipPos.w + 1.f) * 0.5f * w - 0.5f, (clipPos.y / clipPos.w + 1.f) * 0.5f * h - 0.5f};
+			  }
+			  Vector3 historyColor;
+			  if(hasHistory)
+				  hasHistory = sample_bilinear(historyData, w, h, historyPos.x, historyPos.y, historyColor);
+			  if(hasHistory) {
+				  if(settings.clampHistory) {
+					  auto minColor = color;
+					  auto maxColor = color;
+					  for(auto oy = -1; oy <= 1; ++oy) {
+						  for(auto ox = -1; ox <= 1; ++ox) {
+							  auto nx = static_cast<int64_t>(x) + ox;
+							  auto ny = static_cast<int64_t>(y) + oy;
+							  if(nx < 0 || ny < 0 || nx >= w || ny >= h)
+								  continue;
+							  auto *p = curData + (static_cast<size_t>(ny) * w + nx) * 3;
+							  Vector3 n {p[0], p[1], p[2]};
+							  minColor = glm::min(minColor, n);
+							  maxColor = glm::max(maxColor, n);
+						  }
+					  }
+					  historyColor = glm::clamp(historyColor, minColor, maxColor);
+				  }
+				  color = glm::mix(color, historyColor, settings.historyWeight);
+			  }
+			  result[idx] = color.x;
+			  result[idx + 1] = color.y;
+			  result[idx + 2] = color.z;
+		  }
+	  },
+	  numThreads);
+	memcpy(current.GetData(), result.data(), result.size() * sizeof(result.front()));
+	return true;
+}
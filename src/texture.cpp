@@ -7,6 +7,8 @@
 
 #include "pr_cycles/scene.hpp"
 #include "pr_cycles/texture.hpp"
+#include "pr_cycles/hash.hpp"
+#include "pr_cycles/parallel.hpp"
 #include <pragma/c_engine.h>
 #include <prosper_context.hpp>
 #include <buffers/prosper_uniform_resizable_buffer.hpp>
@@ -16,11 +18,18 @@
 #include <cmaterialmanager.h>
 #include <cmaterial_manager2.hpp>
 #include <sharedutils/util_file.h>
+#include <sharedutils/util_path.hpp>
 #include <pragma/rendering/shaders/c_shader_cubemap_to_equirectangular.hpp>
 #include <pragma/rendering/shaders/particles/c_shader_particle.hpp>
 #include <util_texture_info.hpp>
 #include <util_image.hpp>
 #include <fsys/ifile.hpp>
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
 
 extern DLLCLIENT CEngine *c_engine;
 extern DLLCLIENT ClientState *client;
@@ -35,18 +44,274 @@ static std::optional<std::string> get_abs_error_texture_path()
 	return {};
 }
 
-enum class PreparedTextureInputFlags : uint8_t { None = 0u, CanBeEnvMap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureInputFlags)
-enum class PreparedTextureOutputFlags : uint8_t { None = 0u, Envmap = 1u };
-REGISTER_BASIC_BITWISE_OPERATORS(PreparedTextureOutputFlags)
 
-static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &tex, bool &outSuccess, bool &outConverted, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
+using namespace pragma::modules::cycles;
+
+enum class TextureFileFormat : uint8_t { DDS = 0, PNG };
+
+// Extensions of texture files the converted textures may have been created from
+static constexpr std::array<const char *, 11> SOURCE_TEXTURE_EXTENSIONS = {"dds", "ktx", "png", "tga", "jpg", "jpeg", "bmp", "psd", "hdr", "vtf", "vtex_c"};
+static const std::string CONVERTED_TEXTURE_PATH = "addons/converted/";
+
+struct SourceTexture {
+	std::string absPath;
+	std::string extension;
+	uint64_t size = 0;
+	int64_t writeTime = 0;
+};
+static std::optional<SourceTexture> find_source_texture(const std::string &texName)
+{
+	for(auto *ext : SOURCE_TEXTURE_EXTENSIONS) {
+		std::string absPath;
+		if(FileManager::FindAbsolutePath("materials/" + texName + "." + ext, absPath) == false)
+			continue;
+		std::replace(absPath.begin(), absPath.end(), '\\', '/');
+		if(absPath.find("/" + CONVERTED_TEXTURE_PATH) != std::string::npos)
+			continue; // Output of a previous conversion
+		std::error_code ec;
+		auto size = std::filesystem::file_size(absPath, ec);
+		if(ec)
+			continue;
+		auto writeTime = std::filesystem::last_write_time(absPath, ec);
+		if(ec)
+			continue;
+		SourceTexture source {};
+		source.absPath = absPath;
+		source.extension = ext;
+		source.size = size;
+		source.writeTime = writeTime.time_since_epoch().count();
+		return source;
+	}
+	return {};
+}
+
+// Whether the texture file can be handed to the renderer as is, without going through the GPU readback and DDS/PNG export.
+// Only formats OpenImageIO can decode qualify, everything else (e.g. KTX or VTF) still needs to be converted.
+static bool can_renderer_read_directly(const SourceTexture &source, Texture &tex, prosper::Format format, TextureFileFormat targetFormat)
+{
+	if(source.extension == "dds") {
+		// DDS files are not used for translucent textures (see prepare_texture_async)
+		if(targetFormat != TextureFileFormat::DDS)
+			return false;
+		switch(format) {
+		case prosper::Format::BC6H_SFloat_Block:
+		case prosper::Format::BC6H_UFloat_Block:
+		case prosper::Format::BC7_SRGB_Block:
+		case prosper::Format::BC7_UNorm_Block:
+			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC6 and BC7
+			return false;
+		}
+		return true;
+	}
+	// Normal maps have to go through the conversion, which encodes them for the renderer (see get_dds_write_info)
+	if(tex.HasFlag(Texture::Flags::NormalMap))
+		return false;
+	// Floating point images are always read as linear data
+	if(source.extension == "hdr")
+		return true;
+	// These files carry no color space, so the renderer reads them as sRGB. Non-color data (e.g. roughness or metalness maps)
+	// has to go through the conversion, which writes the color space of the texture (see get_dds_write_info).
+	if(tex.HasFlag(Texture::Flags::SRGB) == false)
+		return false;
+	static constexpr std::array<const char *, 5> directExtensions = {"png", "tga", "jpg", "jpeg", "bmp"};
+	return std::find_if(directExtensions.begin(), directExtensions.end(), [&source](const char *ext) { return source.extension == ext; }) != directExtensions.end();
+}
+
+static std::optional<Hash128> hash_file_content(const std::string &absPath)
+{
+	std::ifstream f {absPath, std::ios::binary};
+	if(!f)
+		return {};
+	Hasher hasher {};
+	std::vector<char> buf(1024 * 1024);
+	while(f) {
+		f.read(buf.data(), buf.size());
+		auto n = f.gcount();
+		if(n > 0)
+			hasher.Add(buf.data(), static_cast<size_t>(n));
+	}
+	return hasher.GetHash();
+}
+
+// Records which source file content and write parameters a converted texture was created from
+struct TextureCacheEntry {
+	std::array<char, 4> magic;
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceWriteTime;
+	Hash128 contentHash;
+	Hash128 paramsHash;
+};
+static_assert(sizeof(TextureCacheEntry) == 56);
+static constexpr std::array<char, 4> TEXTURE_CACHE_MAGIC = {'P', 'T', 'C', 'E'};
+static constexpr uint32_t TEXTURE_CACHE_VERSION = 1;
+static std::mutex g_textureCacheMutex;
+
+static std::string get_texture_cache_entry_path(const std::string &outputPath) { return "cache/unirender/textures/" + Hasher {}.Add(outputPath).GetHash().ToString() + ".bin"; }
+
+static std::optional<TextureCacheEntry> load_texture_cache_entry(const std::string &outputPath)
+{
+	std::scoped_lock lock {g_textureCacheMutex};
+	auto f = FileManager::OpenFile(get_texture_cache_entry_path(outputPath).c_str(), "rb");
+	if(f == nullptr)
+		return {};
+	TextureCacheEntry entry {};
+	if(f->Read(&entry, sizeof(entry)) != sizeof(entry) || entry.magic != TEXTURE_CACHE_MAGIC || entry.version != TEXTURE_CACHE_VERSION)
+		return {};
+	return entry;
+}
+
+static void save_texture_cache_entry(const std::string &outputPath, const TextureCacheEntry &entry)
+{
+	std::scoped_lock lock {g_textureCacheMutex};
+	auto path = get_texture_cache_entry_path(outputPath);
+	FileManager::CreatePath(ufile::get_path_from_filename(path).c_str());
+	auto f = FileManager::OpenFile<VFilePtrReal>(path.c_str(), "wb");
+	if(f == nullptr)
+		return;
+	f->Write(&entry, sizeof(entry));
+}
+
+static void remove_texture_cache_entry(const std::string &outputPath)
+{
+	std::scoped_lock lock {g_textureCacheMutex};
+	FileManager::RemoveFile(get_texture_cache_entry_path(outputPath).c_str());
+}
+
+// Without a source file on disk (e.g. textures that only exist in an archive), a conversion can only be validated against the parameters it was written with
+static bool is_conversion_up_to_date(const std::string &outputPath, const Hash128 &paramsHash)
+{
+	auto entry = load_texture_cache_entry(outputPath);
+	return entry.has_value() && entry->paramsHash == paramsHash;
+}
+
+static bool is_conversion_up_to_date(const std::string &outputPath, const SourceTexture &source, const Hash128 &paramsHash)
+{
+	auto entry = load_texture_cache_entry(outputPath);
+	if(entry.has_value() == false || entry->paramsHash != paramsHash)
+		return false;
+	if(entry->sourceSize == source.size && entry->sourceWriteTime == source.writeTime)
+		return true;
+	// The source file has been touched, but we only need to re-convert it if the content has actually changed
+	auto contentHash = hash_file_content(source.absPath);
+	if(contentHash.has_value() == false || *contentHash != entry->contentHash)
+		return false;
+	entry->sourceSize = source.size;
+	entry->sourceWriteTime = source.writeTime;
+	save_texture_cache_entry(outputPath, *entry);
+	return true;
+}
+
+static uimg::TextureInfo get_dds_write_info(Texture &tex, prosper::IImage &img)
+{
+	uimg::TextureInfo imgWriteInfo {};
+	imgWriteInfo.containerFormat = uimg::TextureInfo::ContainerFormat::DDS; // Cycles doesn't support KTX
+	if(tex.HasFlag(Texture::Flags::SRGB))
+		imgWriteInfo.flags |= uimg::TextureInfo::Flags::SRGB;
+
+	// Try to determine appropriate formats
+	if(tex.HasFlag(Texture::Flags::NormalMap)) {
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
+		imgWriteInfo.SetNormalMap();
+		return imgWriteInfo;
+	}
+	auto format = img.GetFormat();
+	if(prosper::util::is_16bit_format(format)) {
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
+	}
+	else if(prosper::util::is_32bit_format(format) || prosper::util::is_64bit_format(format)) {
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
+	}
+	else {
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R8G8B8A8_UInt;
+		// TODO: Check the alpha channel values to determine whether we actually need a full alpha channel?
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::ColorMapSmoothAlpha;
+	}
+	switch(format) {
+	case prosper::Format::BC1_RGBA_SRGB_Block:
+	case prosper::Format::BC1_RGBA_UNorm_Block:
+	case prosper::Format::BC1_RGB_SRGB_Block:
+	case prosper::Format::BC1_RGB_UNorm_Block:
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC1;
+		break;
+	case prosper::Format::BC2_SRGB_Block:
+	case prosper::Format::BC2_UNorm_Block:
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC2;
+		break;
+	case prosper::Format::BC3_SRGB_Block:
+	case prosper::Format::BC3_UNorm_Block:
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC3;
+		break;
+	case prosper::Format::BC4_SNorm_Block:
+	case prosper::Format::BC4_UNorm_Block:
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC4;
+		break;
+	case prosper::Format::BC5_SNorm_Block:
+	case prosper::Format::BC5_UNorm_Block:
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC5;
+		break;
+	case prosper::Format::BC6H_SFloat_Block:
+	case prosper::Format::BC6H_UFloat_Block:
+		// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC6, so we'll
+		// fall back to a different format
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
+		// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC6;
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT5;
+		break;
+	case prosper::Format::BC7_SRGB_Block:
+	case prosper::Format::BC7_UNorm_Block:
+		// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC7, so we'll
+		// fall back to a different format
+		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
+		// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC7;
+		imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT1;
+		break;
+	}
+	return imgWriteInfo;
+}
+
+static uimg::Format get_host_image_format(uimg::TextureInfo::InputFormat inputFormat)
+{
+	switch(inputFormat) {
+	case uimg::TextureInfo::InputFormat::R16G16B16A16_Float:
+		return uimg::Format::RGBA16;
+	case uimg::TextureInfo::InputFormat::R32G32B32A32_Float:
+		return uimg::Format::RGBA32;
+	default:
+		return uimg::Format::RGBA8;
+	}
+}
+
+static std::shared_future<bool> make_ready_future(bool value)
+{
+	std::promise<bool> promise {};
+	promise.set_value(value);
+	return promise.get_future().share();
+}
+
+struct PendingConversion {
+	std::string textureName;
+	std::string outputPath;
+	TextureFileFormat format;
+	std::shared_future<bool> ready;
+};
+static std::mutex g_pendingConversionMutex;
+static std::unordered_map<std::string, PendingConversion> g_pendingConversions;
+
+static WorkerPool &get_conversion_pool()
+{
+	// Leave some threads for the readbacks and the remaining scene setup
+	static WorkerPool pool {std::max(get_default_thread_count() / 2, 1u)};
+	return pool;
+}
+
+PreparedTexture pragma::modules::cycles::prepare_texture_async(std::shared_ptr<Texture> tex, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
 {
 	if(optOutFlags)
 		*optOutFlags = PreparedTextureOutputFlags::None;
 
-	outSuccess = false;
-	outConverted = false;
 	std::string texName {};
 	// Make sure texture has been fully loaded!
 	if(tex == nullptr || tex->IsLoaded() == false) {
@@ -65,200 +330,202 @@ static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &tex,
 	else
 		texName = tex->GetName();
 	if(tex == nullptr || tex->IsError() || tex->HasValidVkTexture() == false)
-		return get_abs_error_texture_path();
+		return {get_abs_error_texture_path(), make_ready_future(false)};
 
-	/*if(tex->IsLoaded() == false)
-	{
-	TextureManager::LoadInfo loadInfo {};
-	loadInfo.flags = TextureLoadFlags::LoadInstantly;
-	static_cast<CMaterialManager&>(client->GetMaterialManager()).GetTextureManager().Load(*c_engine,texInfo->name,loadInfo);
-	if(tex->IsLoaded() == false)
-	return get_abs_error_texture_path();
-	}
-	*/
 	ufile::remove_extension_from_filename(texName); // DDS-writer will add the extension for us
+	auto sourceName = texName;
 
 	auto vkTex = tex->GetVkTexture();
 	auto *img = &vkTex->GetImage();
 	auto isCubemap = img->IsCubemap();
 	if(isCubemap) {
 		if(umath::is_flag_set(inFlags, PreparedTextureInputFlags::CanBeEnvMap) == false)
-			return {};
-		// Image is a cubemap, which Cycles doesn't support! We'll have to convert it to a equirectangular image and use that instead.
-		auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
-		auto equiRectMap = shader.CubemapToEquirectangularTexture(*vkTex);
-		vkTex = equiRectMap;
-		img = &vkTex->GetImage();
+			return {{}, make_ready_future(false)};
+		// Cubemaps are converted to equirectangular images further below, since Cycles doesn't support them
 		texName += "_equirect";
 
 		if(optOutFlags)
 			*optOutFlags |= PreparedTextureOutputFlags::Envmap;
 	}
 
-	enum class Format { DDS = 0, PNG };
-	auto format = Format::DDS;
+	auto format = TextureFileFormat::DDS;
 	if(translucent) {
 		// Transparent DDS textures sometimes cause weird emission artifacts (with transparent areas
 		// appearing emissive in bright white), so we'll use png for those textures instead.
-		format = Format::PNG;
+		format = TextureFileFormat::PNG;
 	}
+	std::string ext = (format == TextureFileFormat::DDS) ? "dds" : "png";
+	auto texPath = "materials/" + texName + "." + ext;
+	auto outputPath = CONVERTED_TEXTURE_PATH + texPath;
 
-	auto texPath = "materials\\" + texName;
-	std::string ext = (format == Format::DDS) ? "dds" : "png";
+	// If the renderer can read the original texture file, we can just use it directly and skip the conversion entirely!
+	auto source = find_source_texture(sourceName);
+	if(source.has_value() && isCubemap == false && can_renderer_read_directly(*source, *tex, img->GetFormat(), format))
+		return {source->absPath, make_ready_future(true)};
 
+	Hasher paramsHasher {};
+	paramsHasher.Add(TEXTURE_CACHE_VERSION).Add(format).Add(isCubemap);
+	if(format == TextureFileFormat::DDS) {
+		auto imgWriteInfo = get_dds_write_info(*tex, *img);
+		paramsHasher.Add(imgWriteInfo.containerFormat).Add(imgWriteInfo.inputFormat).Add(imgWriteInfo.outputFormat).Add(imgWriteInfo.flags);
+	}
+	auto paramsHash = paramsHasher.GetHash();
+
+	// Check if a previous conversion exists and is still valid
 	std::string absPath;
-	texPath += "." + ext;
-	// Check if a version of the texture already exists, in which case we can just use it directly!
-	if(FileManager::FindAbsolutePath(texPath, absPath)) {
-		outSuccess = true;
-		return absPath;
+	if(FileManager::FindAbsolutePath(outputPath, absPath)) {
+		auto upToDate = source.has_value() ? is_conversion_up_to_date(outputPath, *source, paramsHash) : is_conversion_up_to_date(outputPath, paramsHash);
+		if(upToDate)
+			return {absPath, make_ready_future(true)};
 	}
 
-	// Texture does not have the right format to begin with or does not exist on the local hard drive.
-	// We will have to create the texture file in the right format (if the texture object is valid).
-	if(tex == nullptr)
-		return get_abs_error_texture_path(); // Texture is not valid! Return error texture.
-
-	std::string baseOutputPath = "addons/converted/";
-	if(format == Format::PNG) {
-		auto imgBuf = img->ToHostImageBuffer(uimg::Format::RGBA8, prosper::ImageLayout::ShaderReadOnlyOptimal);
-		auto fullPath = baseOutputPath + texPath;
-		FileManager::CreatePath(ufile::get_path_from_filename(fullPath).c_str());
-		auto f = filemanager::open_file(fullPath, filemanager::FileMode::Write | filemanager::FileMode::Binary);
-		fsys::File fp {f};
-		uimg::save_image(fp, *imgBuf, uimg::ImageFormat::PNG);
-		if(FileManager::FindAbsolutePath(texPath, absPath)) {
-			outSuccess = true;
-			return absPath;
-		}
-		return get_abs_error_texture_path();
+	auto absOutputPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + outputPath;
+	auto conversionKey = outputPath + '#' + paramsHash.ToString();
+	{
+		std::scoped_lock lock {g_pendingConversionMutex};
+		auto it = g_pendingConversions.find(conversionKey);
+		if(it != g_pendingConversions.end())
+			return {absOutputPath, it->second.ready};
 	}
 
-	// Output path for the DDS-file we're about to create
-	auto ddsPath = baseOutputPath + "materials/" + texName;
+	// The GPU work has to happen on this thread, only the encoding is deferred
+	if(isCubemap) {
+		auto &shader = static_cast<pragma::ShaderCubemapToEquirectangular &>(*c_engine->GetShader("cubemap_to_equirectangular"));
+		vkTex = shader.CubemapToEquirectangularTexture(*vkTex);
+		img = &vkTex->GetImage();
+	}
 	uimg::TextureInfo imgWriteInfo {};
-	imgWriteInfo.containerFormat = uimg::TextureInfo::ContainerFormat::DDS; // Cycles doesn't support KTX
-	if(tex->HasFlag(Texture::Flags::SRGB))
-		imgWriteInfo.flags |= uimg::TextureInfo::Flags::SRGB;
+	std::shared_ptr<uimg::ImageBuffer> imgBuf = nullptr;
+	if(format == TextureFileFormat::PNG)
+		imgBuf = img->ToHostImageBuffer(uimg::Format::RGBA8, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	else {
+		imgWriteInfo = get_dds_write_info(*tex, *img);
+		imgBuf = img->ToHostImageBuffer(get_host_image_format(imgWriteInfo.inputFormat), prosper::ImageLayout::ShaderReadOnlyOptimal);
+	}
+	if(imgBuf == nullptr)
+		return {get_abs_error_texture_path(), make_ready_future(false)};
 
-	// Try to determine appropriate formats
-	if(tex->HasFlag(Texture::Flags::NormalMap)) {
-		imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-		imgWriteInfo.SetNormalMap();
+	auto promise = std::make_shared<std::promise<bool>>();
+	auto ready = promise->get_future().share();
+	{
+		std::scoped_lock lock {g_pendingConversionMutex};
+		g_pendingConversions[conversionKey] = {texName, outputPath, format, ready};
 	}
-	else {
-		auto format = img->GetFormat();
-		if(prosper::util::is_16bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
-		}
-		else if(prosper::util::is_32bit_format(format) || prosper::util::is_64bit_format(format)) {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R32G32B32A32_Float;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::HDRColorMap;
+	get_conversion_pool().Push([promise, imgBuf, imgWriteInfo, format, outputPath, source, paramsHash]() {
+		FileManager::CreatePath(ufile::get_path_from_filename(outputPath).c_str());
+		auto success = false;
+		if(format == TextureFileFormat::PNG) {
+			auto f = filemanager::open_file(outputPath, filemanager::FileMode::Write | filemanager::FileMode::Binary);
+			if(f) {
+				fsys::File fp {f};
+				success = uimg::save_image(fp, *imgBuf, uimg::ImageFormat::PNG);
+			}
 		}
 		else {
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R8G8B8A8_UInt;
-			// TODO: Check the alpha channel values to determine whether we actually need a full alpha channel?
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::ColorMapSmoothAlpha;
+			auto ddsPath = outputPath;
+			ufile::remove_extension_from_filename(ddsPath);
+			success = uimg::save_texture(ddsPath, *imgBuf, imgWriteInfo);
 		}
-		switch(format) {
-		case prosper::Format::BC1_RGBA_SRGB_Block:
-		case prosper::Format::BC1_RGBA_UNorm_Block:
-		case prosper::Format::BC1_RGB_SRGB_Block:
-		case prosper::Format::BC1_RGB_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC1;
-			break;
-		case prosper::Format::BC2_SRGB_Block:
-		case prosper::Format::BC2_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC2;
-			break;
-		case prosper::Format::BC3_SRGB_Block:
-		case prosper::Format::BC3_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC3;
-			break;
-		case prosper::Format::BC4_SNorm_Block:
-		case prosper::Format::BC4_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC4;
-			break;
-		case prosper::Format::BC5_SNorm_Block:
-		case prosper::Format::BC5_UNorm_Block:
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC5;
-			break;
-		case prosper::Format::BC6H_SFloat_Block:
-		case prosper::Format::BC6H_UFloat_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC6, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC6;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT5;
-			break;
-		case prosper::Format::BC7_SRGB_Block:
-		case prosper::Format::BC7_UNorm_Block:
-			// TODO: As of 20-03-26, Cycles (/oiio) does not have support for BC7, so we'll
-			// fall back to a different format
-			imgWriteInfo.inputFormat = uimg::TextureInfo::InputFormat::R16G16B16A16_Float;
-			// imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::BC7;
-			imgWriteInfo.outputFormat = uimg::TextureInfo::OutputFormat::DXT1;
-			break;
+		if(success) {
+			TextureCacheEntry entry {};
+			entry.magic = TEXTURE_CACHE_MAGIC;
+			entry.version = TEXTURE_CACHE_VERSION;
+			entry.paramsHash = paramsHash;
+			std::optional<Hash128> contentHash {};
+			if(source.has_value()) {
+				contentHash = hash_file_content(source->absPath);
+				if(contentHash.has_value()) {
+					entry.sourceSize = source->size;
+					entry.sourceWriteTime = source->writeTime;
+					entry.contentHash = *contentHash;
+				}
+			}
+			if(source.has_value() == false || contentHash.has_value())
+				save_texture_cache_entry(outputPath, entry);
 		}
-	}
-	absPath = "";
-	// Save the DDS image and make sure the file exists
-	if(c_game->SaveImage(*img, ddsPath, imgWriteInfo) && FileManager::FindAbsolutePath(ddsPath + ".dds", absPath)) {
-		outSuccess = true;
-		outConverted = true;
-		return absPath;
-	}
-	// Something went wrong, fall back to error texture!
-	return get_abs_error_texture_path();
+		else
+			remove_texture_cache_entry(outputPath); // Make sure a failed conversion is never re-used
+		promise->set_value(success);
+	});
+	return {absOutputPath, ready};
 }
 
-static std::optional<std::string> prepare_texture(std::shared_ptr<Texture> &texInfo, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
+PreparedTexture pragma::modules::cycles::prepare_texture_async(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
+{
+	auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
+	auto tex = texManager.LoadAsset(texPath);
+	return prepare_texture_async(tex, PreparedTextureInputFlags::CanBeEnvMap, nullptr, defaultTexture, translucent);
+}
+
+std::optional<std::string> pragma::modules::cycles::prepare_texture(std::shared_ptr<Texture> tex, PreparedTextureInputFlags inFlags, PreparedTextureOutputFlags *optOutFlags, const std::optional<std::string> &defaultTexture, bool translucent)
 {
 	if(optOutFlags)
 		*optOutFlags = PreparedTextureOutputFlags::None;
-	if(texInfo == nullptr)
+	if(tex == nullptr)
 		return {};
-	auto success = false;
-	auto converted = false;
-	auto result = prepare_texture(texInfo, success, converted, inFlags, optOutFlags, defaultTexture, translucent);
-	if(success == false && texInfo->GetName() != "error") {
-		Con::cwar << "WARNING: Unable to prepare texture '";
-		if(texInfo)
-			Con::cwar << texInfo->GetName();
-		else
-			Con::cwar << "Unknown";
-		Con::cwar << "'! Using error texture instead..." << Con::endl;
-	}
-	else {
-		if(converted)
-			Con::cout << "Converted texture '" << texInfo->GetName() << "' to DDS!" << Con::endl;
-
-#if 0
-		// TODO: Re-implement this
-		ccl::ImageMetaData metaData;
-		if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-		{
-			Con::cwar<<"WARNING: Texture '"<<texInfo->name<<"' has format which is incompatible with cycles! Falling back to error texture..."<<Con::endl;
-			result = get_abs_error_texture_path();
-			if(scene.image_manager->get_image_metadata(*result,nullptr,ccl::u_colorspace_raw,metaData) == false)
-			{
-				Con::cwar<<"WARNING: Error texture also not compatible! Falling back to untextured!"<<Con::endl;
-				result = {};
-			}
-		}
-#endif
-	}
-
-	return result;
+	auto result = prepare_texture_async(tex, inFlags, optOutFlags, defaultTexture, translucent);
+	if(result.ready.get())
+		return result.path;
+	if(tex->GetName() != "error")
+		Con::cwar << "WARNING: Unable to prepare texture '" << tex->GetName() << "'! Using error texture instead..." << Con::endl;
+	if(result.path.has_value() == false)
+		return {};
+	return get_abs_error_texture_path();
 }
 
 std::optional<std::string> pragma::modules::cycles::prepare_texture(const std::string &texPath, const std::optional<std::string> &defaultTexture, bool translucent)
 {
 	auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
-	auto ptex = texManager.LoadAsset(texPath);
-	auto flags = PreparedTextureInputFlags::CanBeEnvMap;
-	PreparedTextureOutputFlags retFlags;
-	auto tex = ptex;
-	return ::prepare_texture(tex, flags, &retFlags, defaultTexture, translucent);
+	auto tex = texManager.LoadAsset(texPath);
+	return prepare_texture(tex, PreparedTextureInputFlags::CanBeEnvMap, nullptr, defaultTexture, translucent);
+}
+
+// Replaces the output of a failed conversion with the error texture, since the renderer has already been handed the output path
+static bool write_error_texture(const std::string &outputPath, TextureFileFormat format)
+{
+	auto absOutputPath = util::Path::CreatePath(FileManager::GetProgramPath()).GetString() + outputPath;
+	FileManager::CreatePath(ufile::get_path_from_filename(outputPath).c_str());
+	if(format == TextureFileFormat::DDS) {
+		auto errTexPath = get_abs_error_texture_path();
+		if(errTexPath.has_value() == false)
+			return false;
+		std::error_code ec;
+		std::filesystem::copy_file(*errTexPath, absOutputPath, std::filesystem::copy_options::overwrite_existing, ec);
+		return !ec;
+	}
+	auto &texManager = static_cast<msys::CMaterialManager &>(client->GetMaterialManager()).GetTextureManager();
+	auto tex = texManager.LoadAsset("error");
+	if(tex == nullptr || tex->HasValidVkTexture() == false)
+		return false;
+	auto imgBuf = tex->GetVkTexture()->GetImage().ToHostImageBuffer(uimg::Format::RGBA8, prosper::ImageLayout::ShaderReadOnlyOptimal);
+	if(imgBuf == nullptr)
+		return false;
+	auto f = filemanager::open_file(outputPath, filemanager::FileMode::Write | filemanager::FileMode::Binary);
+	if(f == nullptr)
+		return false;
+	fsys::File fp {f};
+	return uimg::save_image(fp, *imgBuf, uimg::ImageFormat::PNG);
+}
+
+void pragma::modules::cycles::wait_for_pending_texture_conversions()
+{
+	std::unordered_map<std::string, PendingConversion> pendingConversions;
+	{
+		std::scoped_lock lock {g_pendingConversionMutex};
+		pendingConversions = std::move(g_pendingConversions);
+		g_pendingConversions.clear();
+	}
+	uint32_t numConverted = 0;
+	for(auto &[key, conversion] : pendingConversions) {
+		if(conversion.ready.get()) {
+			++numConverted;
+			continue;
+		}
+		if(write_error_texture(conversion.outputPath, conversion.format))
+			Con::cwar << "WARNING: Unable to convert texture '" << conversion.textureName << "'! Using error texture instead..." << Con::endl;
+		else
+			Con::cwar << "WARNING: Unable to convert texture '" << conversion.textureName << "'! The texture will be missing from the render..." << Con::endl;
+	}
+	if(numConverted > 0)
+		Con::cout << "Converted " << numConverted << " textures!" << Con::endl;
 }